@@ -1,16 +1,28 @@
 /*TODO: change editor->verbose to global variable */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <linux/fs.h>
 #include <unistd.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 
 #define _ASSET_PATH "asset/"
+#define DEFAULT_MAP_NAME "test"
+#define DEFAULT_MAP _ASSET_PATH DEFAULT_MAP_NAME "/" DEFAULT_MAP_NAME ".md"
 #define SCREEN_W 1280
 #define SCREEN_H 768
 #define WIN_TITLE "EDITOR"
@@ -18,9 +30,59 @@
 #define TILE_COUNT 4
 #define SPRITESHEET_COUNT 25
 #define SPRITE_DB "sprite.db"
+#define ANIM_DB "anim.db"
+#define ATLAS_SIZE 2048
+#define ATLAS_CACHE ".cache"
+#define ATLAS_CACHE_MAGIC "L2TA"
+#define ATLAS_CACHE_VERSION 2
+#define WATCH_POLL_MS 100
+#define WATCH_SETTLE_MS 20
+#define UNDO_BUDGET (16 * 1024 * 1024)
+#define UNDO_ENTRIES 4096
+#define PROF_RING_SIZE (1 << 16)
+#define PROF_FRAMES 120
+#define PROF_TRACE "l2te_trace.json"
+#define MAP_MAGIC "L2TE"
+#define MAP_VERSION 1
+#define MAP_BYTE_ORDER 0x0102
+#define MAP_PATH_MAX 224
+#define READ_BUF_SIZE (64 * 1024)
+#define CHUNK_SIZE 32
+#define CHUNK_BUDGET (64 * 1024 * 1024)
+#define COLLISION_LAYER 4
+#define OBJECT_LAYER 5
+#define EVENT_LAYER 6
+#define SPARSE_MAGIC "L2TS"
+#define SPARSE_VERSION 1
+#define PACKED_MAGIC "L2TZ"
+#define SAVE_LOG_MAGIC "L2TL"
+#define SAVE_LOG_SUFFIX ".log"
+#define PACKED_VERSION 1
+#define CHUNK_COLD_BUDGET (16 * 1024 * 1024)
+#define DIRTY_SAVE 0x01
+#define DIRTY_AUTOSAVE 0x02
+#define DIRTY_RENDER 0x04
+#define DIRTY_SNAPSHOT 0x08
+#define DIRTY_EDIT (DIRTY_SAVE | DIRTY_AUTOSAVE | DIRTY_RENDER)
+#define AUTOSAVE_INTERVAL 30000
+#define AUTOSAVE_SLICE_US 500
+#define AUTOSAVE_SUFFIX ".autosave.lrb"
+#define ZOOM_MAX 4.0f
+#define ZOOM_STEP 1.25f
+#define PAN_PX 64
+#define LOD_TILE_PX 4
+#define LOD_LEVELS 17
+#define LOD_PAGE 1024
+#define LOD_SLICE_US 1000
+#define MINIMAP_SIZE 192
+#define IDLE_WAIT_MS 500
+#define EDIT_QUEUE 256
+#define SNAP_QUEUE 1024
+#define RENDER_MAX_PIXELS (256 * 1024 * 1024)
 
 extern int errno;
 int verbose;
+struct WorkerPool *pool;
 
 enum TILE_TYPE {
     SPRITE_STATIC = 0,
@@ -30,7 +92,10 @@ enum TILE_TYPE {
 };
 
 /* Spritesheet struct contains entire spritesheet loaded from png files,
- *	including, created texture, png width & height
+ *	including png width & height, and where it was packed into an atlas.
+ * sprite size, count and first, the id of its first sprite, are given in
+ * sprite.db. surface holds the decoded, color keyed pixels until they are
+ * uploaded, rect holds every sprite of the sheet relative to the sheet
 */
 struct Spritesheet {
     char *path;
@@ -38,30 +103,93 @@ struct Spritesheet {
     int height;
     int sprite_width;
     int sprite_height;
-    SDL_Texture *texture;
+    int count;
+    int first;
+    int atlas;
+    int x;
+    int y;
+    SDL_Surface *surface;
     SDL_Rect *rect;
 };
 
 /* Sprite struct is created from a parsed spritesheet 
- * a sprite is created with a sdl rect, which contains the x & y coordinates
- * to the sprite in the spritesheet struct
- * it also contains the sprite id and a reference to its spritesheet,
- * for example, sprite rect has x = 16, and y = 16, 
- * these coordinates points to where in referenced spritesheet the sprite is loaded from
+ * a sprite is the index of the atlas texture it lives in and a sdl rect,
+ * which contains the x & y coordinates (u, v) and size of the sprite in that atlas.
+ * the sprite id is its index in the sprite database
 */
 struct Sprite {
-    SDL_Rect *rect;
-    struct Spritesheet spritesheet;
-    int id;
+    int atlas;
+    SDL_Rect rect;
+};
+
+/* one texture shared by many spritesheets */
+/* pixels is the composed RGBA image until it is uploaded */
+struct Atlas {
+    SDL_Texture *texture;
+    int width;
+    int height;
+    Uint32 *pixels;
+};
+
+/* every spritesheet listed in sprite.db packed into a few atlas textures,
+ * and every sprite of those sheets indexed by id.
+ * the database owns the atlas textures, sprites only refer to them.
+ * ranges are the animated tiles of anim.db, frame maps every id to the
+ * sprite shown for it at clock and animated marks ids that are in a range */
+struct SpriteDB {
+    struct Atlas *atlases;
+    int atlas_count;
+    struct Spritesheet *sheets;
+    int sheet_count;
+    struct Sprite *sprites;
+    int count;
+    struct Tile *ranges;
+    int range_count;
+    uint16_t *frame;
+    uint8_t *animated;
+    Uint32 clock;
+    Uint32 *colors;
+};
+
+/* a sheet decoded again by the sprite watch, waiting on the render thread
+ * to be copied into its place in the atlas. colors are the average colors
+ * of its sprites, path is where it was read from */
+struct SheetReload {
+    int sheet;
+    char *path;
+    SDL_Surface *surface;
+    Uint32 *colors;
+};
+
+/* sprite.db and the sheets it lists watched with inotify
+ * the directories are watched rather than the files, so a sheet saved by
+ * renaming a new file over the old one is seen too. dirs are the watch
+ * descriptors, sheet_dir the one of each sheet. the watch thread owns
+ * sheets, its copy of what sprite.db gives, and decodes changed sheets
+ * into ready, which the render thread empties under lock */
+struct SpriteWatch {
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_atomic_t quit;
+    int fd;
+    char *db_file;
+    int db_dir;
+    struct Spritesheet *sheets;
+    int *sheet_dir;
+    int count;
+    int *dirs;
+    int dir_count;
+    struct SheetReload *ready;
+    int ready_count;
 };
 
 /* Tile struct contains information about tiles, sprite, id, events and actions */
-/* TODO: should tile have the same structure as layers in map->layers */
-/* so each id in layers corresponds to a tile which contains id of 
- * sprite and destination x / y on which to render sprite */
-/* so a (3d) array of tiles same as layers */
+/* the layer store in struct Map only holds 16 bit tile ids, a tile struct
+ * describes what an id means, the render position of a cell is derived from
+ * its row and column so it is never stored per cell */
 /* type specifies what type of tile this is, see enum TILE_TYPE */
-/* range is only used by type SPRITE_RANGE to set an animated sprite range */
+/* range is only used by type SPRITE_RANGE to set an animated sprite range,
+ * each sprite of the range is shown for frame_ms */
 struct Tile {
     SDL_Rect *rect;
     struct Sprite *sprite;
@@ -69,38 +197,83 @@ struct Tile {
     int type;
     int range_start;
     int range_end;
+    int frame_ms;
 };
  
+/* solid tiles of the collision layer packed one bit per tile, 64 tiles
+ * per word, bit col % 64 of word col / 64 of a row. a tile is solid when
+ * its id in COLLISION_LAYER is not 0. rows are stride words apart and the
+ * bits past cols in the last word of a row are always 0 */
+struct Collision {
+    int cols;
+    int rows;
+    int stride;
+    uint64_t *bits;
+};
+
+/* the tiles of a mostly empty layer that are not 0, keys are
+ * row * cols + col in ascending order so the tiles of a row are adjacent
+ * and any cell or run of a row is found with a binary search */
+struct SparseLayer {
+    uint32_t *keys;
+    uint16_t *ids;
+    int count;
+    int capacity;
+    struct SparseRun *runs;
+    int run_count;
+    int run_capacity;
+};
+
+/* keys key..key+len-1 of a sparse layer that were written since the index
+ * was last merged, the layer itself holds their new ids */
+struct SparseRun {
+    uint32_t key;
+    uint32_t len;
+};
+
+/* a tile found by a sparse layer query */
+struct SparseCell {
+    int row;
+    int col;
+    uint16_t id;
+};
+
+/* sparse layer file header, count entries follow, each the distance to
+ * the previous key and the id, both as LEB128 varints */
+struct SparseHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t byte_order;
+    int32_t cols;
+    int32_t rows;
+    int32_t count;
+};
+
 /* Map struct contains information about current loaded map,
  * number of layers, width, height etc
- * layers is an array to arrays to arrays
- * this is to not limit the number of possible layers in the future.
- * The graph below depicts 3 layers, each with 5 rows each, each row contains 6 cells
- * 
-                +-------------+
-	        0|[0,1,2,3,4,5]|
-	        1|[0,1,2,3,4,5]|
-	+---[0]-2|[0,1,2,3,4,5]|
-	|       3|[0,1,2,3,4,5]|
-	|	4|[0,1,2,3,4,5]|
-	|	5|[0,1,2,3,4,5]|
-	|	+-------------+
-        |        +-------------+
-	|	0|[0,1,2,3,4,5]|
-	|       1|[0,1,2,3,4,5]|
-    L---+---[1]-2|[0,1,2,3,4,5]|
-	|	3|[0,1,2,3,4,5]|
-	|	4|[0,1,2,3,4,5]|
-	|	5|[0,1,2,3,4,5]|
-	|	+-------------+
-        |       +-------------+
-	|	0|[0,1,2,3,4,5]|
-	|       1|[0,1,2,3,4,5]|
-	+---[3]-2|[0,1,2,3,4,5]|
-		3|[0,1,2,3,4,5]|
-		4|[0,1,2,3,4,5]|
-		5|[0,1,2,3,4,5]|
-		+-------------+
+ * layers is one flat buffer of 16 bit tile ids holding every layer,
+ * layer after layer, each layer row after row (layer-major).
+ * a full map pass is then a linear walk over memory instead of chasing
+ * layer and row pointers, and the whole map is a single allocation.
+ * use the tile accessors below instead of indexing layers directly.
+ * dirty holds flags per layer per CHUNK_SIZE x CHUNK_SIZE block of tiles,
+ * set_tile marks the block so saving only writes what changed.
+ * file is the binary map the layer store was opened from, if any.
+ * collision mirrors COLLISION_LAYER as a bitset, built on first use by
+ * map_collision and kept up to date by set_tile and fill_span.
+ * sparse indexes OBJECT_LAYER and EVENT_LAYER the same way, see map_sparse.
+ * trailing counts the text layer files that held rows past the last row.
+ * autosave is the autosave of the map, while it copies a snapshot the
+ * chunks still to copy are flagged DIRTY_SNAPSHOT and set_tile and
+ * write_span copy them into it before they change.
+ * The graph below depicts 3 layers, each with 2 rows, each row contains 3 cells
+ *
+ *      layer 0           layer 1           layer 2
+ *   row 0    row 1    row 0    row 1    row 0    row 1
+ *  [0,1,2]  [0,1,2]  [0,1,2]  [0,1,2]  [0,1,2]  [0,1,2]
+ *   0 1 2    3 4 5    6 7 8    9 ...
+ *
+ * index = (layer * rows + row) * cols + col
 */
 struct Map {
     int cols;
@@ -117,8 +290,112 @@ struct Map {
     char *layer0;
     char *name;
     char *md;
-    int ***layers;
-    struct Tile ***tiles;
+    uint16_t *layers;
+    void *mapped;
+    size_t mapped_size;
+    struct ChunkStore *chunks;
+    int chunk_cols;
+    int chunk_rows;
+    uint8_t *dirty;
+    char *file;
+    char *packed;
+    struct Collision *collision;
+    struct SparseLayer *sparse[2];
+    int trailing;
+    struct Autosave *autosave;
+};
+
+/* a CHUNK_SIZE x CHUNK_SIZE block of every layer, loaded from a binary map
+ * tiles holds layer_count blocks of CHUNK_SIZE rows of CHUNK_SIZE ids,
+ * cells outside the map at the right and bottom edge are unused.
+ * filled is set once tiles hold the map, when the chunk is read or, in a
+ * store without a file, when the edit thread sends it */
+struct Chunk {
+    int cx;
+    int cy;
+    int dirty;
+    int filled;
+    struct Chunk *prev;
+    struct Chunk *next;
+    struct Chunk *hash_next;
+    uint16_t *tiles;
+};
+
+/* resident chunks of a streamed map
+ * a map opened with open_map_stream keeps at most capacity chunks in memory,
+ * chunks are read from the binary map file when first touched and the least
+ * recently used chunk is evicted when the budget is full, dirty chunks are
+ * written back on eviction or flush. they are written whole to the work
+ * file, at the place slot gives for their chunk index, and read from there
+ * from then on. the map file is only read, it changes when the map is saved.
+ * the lookup table is sized from the budget, never from the map, so memory
+ * depends on what is viewed and not on map size.
+ * evicted chunks are kept run length encoded in cold, by chunk index, up
+ * to cold_budget bytes, and are decoded from there instead of read again */
+struct ChunkStore {
+    int fd;
+    char *work;
+    int work_fd;
+    int32_t *slot;
+    int slot_count;
+    off_t data_offset;
+    int chunk_cols;
+    int chunk_rows;
+    int capacity;
+    int resident;
+    int hash_size;
+    struct Chunk *slots;
+    struct Chunk **hash;
+    struct Chunk *lru_head;
+    struct Chunk *lru_tail;
+    uint16_t *tile_pool;
+    long loads;
+    long evictions;
+    long writebacks;
+    uint8_t **cold;
+    uint32_t *cold_len;
+    uint8_t *scratch;
+    size_t cold_bytes;
+    size_t cold_budget;
+    long cold_hits;
+};
+
+/* header of a binary map file (<path><name>.lrb)
+ * the same fields as the .md metadata line, followed at header_size bytes
+ * by every layer as one array of rows * cols 16 bit tile ids,
+ * in the exact layout of struct Map layers, so the file is mmaped and used
+ * as the layer store directly.
+ * byte_order is written as MAP_BYTE_ORDER to catch files from a host with
+ * a different endianness */
+struct MapHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t byte_order;
+    uint32_t header_size;
+    int32_t cols;
+    int32_t rows;
+    int32_t layer_count;
+    int32_t sprite_width;
+    int32_t sprite_height;
+    char path[MAP_PATH_MAX];
+};
+
+/* save log of a binary map (<file>.log), used where the filesystem can not
+ * clone the map into a temporary file. the rows of the dirty chunks are
+ * written to it and synced before any of them is written over the map, a
+ * save cut short is finished from it when the map is next opened.
+ * count entries follow the header, each followed by its len bytes. hash
+ * covers the entries and their bytes, so a torn log is never replayed */
+struct SaveLogHeader {
+    char magic[4];
+    uint32_t count;
+    uint64_t bytes;
+    uint64_t hash;
+};
+
+struct SaveLogEntry {
+    uint64_t off;
+    uint64_t len;
 };
 
 /* SDL window settings */
@@ -132,6 +409,210 @@ struct Screen {
     SDL_Texture *texture;
 };
 
+/* every visible tile of one layer that samples texture, as quads of 4 vertices
+ * submitted with a single SDL_RenderGeometry call */
+struct RenderBatch {
+    SDL_Texture *texture;
+    float inv_w;
+    float inv_h;
+    SDL_Vertex *vertices;
+    int quads;
+    int capacity;
+};
+
+/* counters of the last rendered frame */
+struct RenderStats {
+    int draw_calls;
+    int tiles;
+    int frames;
+    Uint32 last_report;
+};
+
+/* fixed set of worker threads that run fn(ctx, i) for every i in [0, total)
+ * each worker takes the next index until none are left, pool_run
+ * returns when every index is finished */
+struct WorkerPool {
+    SDL_Thread **threads;
+    int count;
+    SDL_mutex *lock;
+    SDL_cond *wake;
+    SDL_cond *done;
+    void (*fn)(void *ctx, int i);
+    void *ctx;
+    int next;
+    int total;
+    int finished;
+    int quit;
+};
+
+/* one layer file read or written on the worker pool, or one layer of a
+ * binary map written to fd. bytes is the size or -1 when it failed */
+struct LayerFile {
+    struct Map *mp;
+    int layer;
+    char *fname;
+    int fd;
+    long bytes;
+    int trailing;
+    double msec;
+};
+
+/* a run of len changed cells of layer that all had old_id, from cell on
+ * in row * cols + col order, so a run may go on into the next row */
+struct Delta {
+    uint32_t cell;
+    uint16_t layer;
+    uint16_t len;
+    uint16_t old_id;
+    uint16_t new_id;
+};
+
+/* one undo step, count deltas starting at absolute delta position first
+ * layers has bit n set when layer n changed, bounds holds every changed cell */
+struct UndoEntry {
+    long first;
+    int count;
+    uint32_t layers;
+    SDL_Rect bounds;
+};
+
+/* undo/redo journal
+ * deltas is a ring of capacity deltas, sized from a byte budget, and
+ * entries a ring of UNDO_ENTRIES steps. positions are absolute and
+ * taken modulo the ring size, deltas tail..head and entries
+ * first..end are kept, entries before current are undone by undo and
+ * entries from current on are redone by redo.
+ * when a ring is full the oldest step is dropped, so memory is bounded
+ * by the budget and used in proportion to the runs of equal cells changed,
+ * a fill over a whole map of one tile is a handful of deltas */
+struct Journal {
+    struct Delta *deltas;
+    long capacity;
+    long tail;
+    long head;
+    struct UndoEntry *entries;
+    long first;
+    long current;
+    long end;
+    int open;
+    int overflow;
+};
+
+/* one chunk of one layer copied for the autosave thread */
+struct SnapChunk {
+    int layer;
+    int cx;
+    int cy;
+};
+
+/* periodic autosave of a map to <path><name>.autosave.lrb
+ * the chunks flagged DIRTY_AUTOSAVE when an autosave starts are flagged
+ * DIRTY_SNAPSHOT instead, the edit thread copies them into the snapshot
+ * a slice at a time, at most AUTOSAVE_SLICE_US per frame, and a chunk
+ * about to be edited before its turn is copied first, so the snapshot
+ * holds the map as it was when the autosave started. the snapshot is
+ * handed to the autosave thread which writes it through a save log while
+ * editing continues. state is only changed by the side that owns the
+ * snapshot: AUTOSAVE_IDLE and AUTOSAVE_COPYING by the edit thread,
+ * AUTOSAVE_WRITING by the autosave thread. created is set once the
+ * autosave file exists */
+struct Autosave {
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *wake;
+    SDL_atomic_t state;
+    int quit;
+    char *file;
+    char *base;
+    struct MapHeader hdr;
+    struct Map *mp;
+    int created;
+    int cols;
+    int rows;
+    size_t cursor;
+    struct SnapChunk *chunks;
+    uint16_t *tiles;
+    int count;
+    int capacity;
+    Uint32 last;
+    long bytes;
+    double msec;
+};
+
+enum AUTOSAVE_STATE {
+    AUTOSAVE_IDLE = 0,
+    AUTOSAVE_COPYING = 1,
+    AUTOSAVE_WRITING = 2,
+};
+
+/* a layer pre-rendered at the current camera position
+ * dirty is the part, in tiles, that no longer matches the map and is
+ * redrawn before the next composite, empty when the texture is current */
+struct LayerCache {
+    SDL_Texture *texture;
+    SDL_Rect dirty;
+};
+
+/* part of an lod level uploaded as one texture, at most LOD_PAGE square
+ * dirty is the part, in level pixels, changed since the last upload */
+struct LodPage {
+    SDL_Texture *texture;
+    SDL_Rect dirty;
+};
+
+/* the map at 1 / 2^level pixels per tile, level 0 holds one pixel per
+ * tile, the color of its layers blended, each next level is the one
+ * below downsampled by 2. pages are created when first drawn */
+struct LodLevel {
+    int w;
+    int h;
+    Uint32 *pixels;
+    struct LodPage *pages;
+    int page_cols;
+    int page_rows;
+};
+
+/* downsampled map for zoomed out drawing and the minimap
+ * stale flags the chunks whose level 0 pixels no longer match the map,
+ * they are rebuilt a time slice per frame and carried up every level.
+ * busy is set while the last slice ran out of time with chunks left */
+struct Lod {
+    int cols;
+    int rows;
+    int levels;
+    struct LodLevel level[LOD_LEVELS];
+    uint8_t *stale;
+    int chunk_cols;
+    int chunk_rows;
+    int stale_count;
+    int cursor;
+    int busy;
+};
+
+enum TOOL {
+    TOOL_PAINT = 0,
+    TOOL_RECT = 1,
+    TOOL_FILL = 2,
+    TOOL_STAMP = 3,
+};
+
+/* a block of tile ids copied from a selection, painted by TOOL_STAMP */
+struct Stamp {
+    int w;
+    int h;
+    uint16_t *tiles;
+};
+
+/* the animated tiles of one chunk of one layer, cells are offsets
+ * row * CHUNK_SIZE + col inside the chunk. built is cleared when the
+ * chunk is edited and the list is rebuilt the next time it is visible */
+struct AnimChunk {
+    uint16_t *cells;
+    int count;
+    int capacity;
+    int built;
+};
+
 /* General editor settings, verbose, is the editor running.
  *  what is under the mouse pointer, is a tile selected etc
 */
@@ -145,6 +626,110 @@ struct Editor {
     int verbose;
     int mouse_pos_x;
     int mouse_pos_y;
+    int camera_x;
+    int camera_y;
+    float zoom;
+    int panning;
+    int pan_x;
+    int pan_y;
+    struct RenderBatch *batches;
+    int batch_count;
+    int *indices;
+    int index_quads;
+    struct LayerCache *layer_cache;
+    int cache_layers;
+    int cache_camera_x;
+    int cache_camera_y;
+    float cache_zoom;
+    struct RenderStats stats;
+    int selected_tile;
+    struct Journal undo;
+    int tool;
+    int anchor_row;
+    int anchor_col;
+    int drag_row;
+    int drag_col;
+    int motion;
+    int motion_x;
+    int motion_y;
+    Uint32 motion_state;
+    struct Stamp stamp;
+    struct AnimChunk *anim_chunks;
+    int anim_chunk_count;
+    int anim_cols;
+    int anim_rows;
+    struct Lod lod;
+    int minimap;
+};
+
+enum EDIT_COMMAND {
+    EDIT_PRESS = 0,
+    EDIT_DRAG,
+    EDIT_RELEASE,
+    EDIT_SELECT_PRESS,
+    EDIT_SELECT_RELEASE,
+    EDIT_UNDO,
+    EDIT_REDO,
+    EDIT_SAVE,
+    EDIT_FETCH,
+    EDIT_VIEW,
+    EDIT_QUIT,
+};
+
+/* input for the edit thread, a screen position is turned into a tile with
+ * the camera, and painted with the tool, layer and tile, the editor had
+ * when the input was made. EDIT_FETCH asks for chunk x, y, EDIT_VIEW only
+ * brings the camera */
+struct EditCommand {
+    int type;
+    int x;
+    int y;
+    int camera_x;
+    int camera_y;
+    float zoom;
+    int tool;
+    int layer;
+    int tile;
+};
+
+/* every layer of one chunk as the edit thread left it, in the layout of
+ * struct Chunk tiles. bit l of layers is set when layer l changed, layers
+ * from 64 on always count as changed. never changed once queued */
+struct ChunkSnapshot {
+    int cx;
+    int cy;
+    uint64_t layers;
+    uint16_t tiles[];
+};
+
+/* the edit thread owns the map, its undo journal, tool state and autosave.
+ * the render thread sends it commands through cmds and gets chunks back
+ * through snaps, the ones it asked for and the ones edits changed, but only
+ * those on screen. it draws them from a map holding only those chunks.
+ * both are single producer single consumer rings, only the consumer moves
+ * head and only the producer moves tail, so neither takes a lock. commands
+ * that do not fit wait in pending on the render thread, asked flags the
+ * chunks it waits for and camera_x, camera_y and zoom are the camera the
+ * edit thread was last sent */
+struct EditThread {
+    SDL_Thread *thread;
+    SDL_sem *wake;
+    struct Map *mp;
+    struct Editor ed;
+    struct Autosave autosave;
+    struct EditCommand cmds[EDIT_QUEUE];
+    SDL_atomic_t cmd_head;
+    SDL_atomic_t cmd_tail;
+    struct ChunkSnapshot *snaps[SNAP_QUEUE];
+    SDL_atomic_t snap_head;
+    SDL_atomic_t snap_tail;
+    struct EditCommand *pending;
+    int pending_count;
+    int pending_capacity;
+    uint8_t *asked;
+    int camera_x;
+    int camera_y;
+    float zoom;
 };
 
 /* print what ever is in errno */
@@ -163,43 +748,224 @@ void verbose_print(const char *vstring)
     }
 }
 
-/* load a spritesheet from png to spritesheet struct and set width, and height of image */
-/* and store all individual sprites(coordinates and size) in rect array in spritesheet struct */
-int load_single_spritesheet(struct Editor *ed, struct Spritesheet *sp, const char *path, int sw, int sh, int ns)
+/* elapsed seconds since a SDL_GetPerformanceCounter value */
+double elapsed_sec(Uint64 start)
+{
+    return (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+/* worker thread, waits for work and runs indices until none are left */
+int pool_worker(void *data)
 {
-	
-    verbose_print("load_single_sprite... ");
+    struct WorkerPool *p = data;
 
-    sp->rect = calloc(ns, sizeof(SDL_Rect));
+    SDL_LockMutex(p->lock);
 
-    //SDL_Texture *new_texture = NULL;
+    while(!p->quit) {
+        if(p->next < p->total) {
+            int i = p->next++;
 
-    SDL_Surface *loaded_surface = IMG_Load(path);
+            SDL_UnlockMutex(p->lock);
+            p->fn(p->ctx, i);
+            SDL_LockMutex(p->lock);
 
-    if(loaded_surface == NULL) {
-        error_msg();
+            if(++p->finished == p->total) {
+                SDL_CondBroadcast(p->done);
+            }
+        } else {
+            SDL_CondWait(p->wake, p->lock);
+        }
     }
 
+    SDL_UnlockMutex(p->lock);
+    return 0;
+}
 
-    sp->sprite_width = sw;
-    sp->sprite_height = sh;
+/* start the global worker pool with one thread per cpu */
+int pool_init(void)
+{
+    pool = calloc(1, sizeof(struct WorkerPool));
 
-    SDL_SetColorKey(loaded_surface, SDL_TRUE, SDL_MapRGB(loaded_surface->format, 0, 0xFF, 0xFF));
-    sp->texture = SDL_CreateTextureFromSurface(ed->screen.renderer, loaded_surface);
+    if(pool == NULL) {
+        error_msg();
+    }
 
-    sp->path = calloc(strlen(path) + 1, sizeof(char));
-    
-    if(sp->path == NULL) {
+    pool->count = SDL_GetCPUCount();
+    pool->count = pool->count < 1 ? 1 : pool->count;
+    pool->threads = calloc(pool->count, sizeof(SDL_Thread *));
+    pool->lock = SDL_CreateMutex();
+    pool->wake = SDL_CreateCond();
+    pool->done = SDL_CreateCond();
+
+    if(pool->threads == NULL || pool->lock == NULL || pool->wake == NULL || pool->done == NULL) {
         error_msg();
     }
 
-    sp->width = loaded_surface->w;
-    sp->height = loaded_surface->h;
-    if(sp->texture == NULL) {
+    for(int i = 0; i < pool->count; i++) {
+        pool->threads[i] = SDL_CreateThread(pool_worker, "worker", pool);
+    }
+
+    return 0;
+}
+
+/* run fn(ctx, i) for i in [0, total) on the worker pool and wait for all */
+/* not reentrant, when fn calls pool_run the inner run is done in line on
+ * the calling worker */
+int pool_run(int total, void (*fn)(void *ctx, int i), void *ctx)
+{
+    if(pool == NULL) {
+        pool_init();
+    }
+
+    for(int t = 0; t < pool->count; t++) {
+        if(SDL_GetThreadID(pool->threads[t]) == SDL_ThreadID()) {
+            for(int i = 0; i < total; i++) {
+                fn(ctx, i);
+            }
+            return 0;
+        }
+    }
+
+    SDL_LockMutex(pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->total = total;
+    SDL_CondBroadcast(pool->wake);
+
+    while(pool->finished < pool->total) {
+        SDL_CondWait(pool->done, pool->lock);
+    }
+
+    pool->total = 0;
+    SDL_UnlockMutex(pool->lock);
+
+    return 0;
+}
+
+/* stop and join the worker pool */
+void pool_free(void)
+{
+    if(pool == NULL) {
+        return;
+    }
+
+    SDL_LockMutex(pool->lock);
+    pool->quit = 1;
+    SDL_CondBroadcast(pool->wake);
+    SDL_UnlockMutex(pool->lock);
+
+    for(int i = 0; i < pool->count; i++) {
+        SDL_WaitThread(pool->threads[i], NULL);
+    }
+
+    SDL_DestroyMutex(pool->lock);
+    SDL_DestroyCond(pool->wake);
+    SDL_DestroyCond(pool->done);
+    free(pool->threads);
+    free(pool);
+    pool = NULL;
+}
+
+/* instrumentation, only built with -DPROFILE (make profile)
+ * PROF_BEGIN(t) / PROF_END(t, name) time the code between them and push
+ * a timed event into a ring buffer, writers from any thread claim a slot
+ * with one atomic add so nothing is locked. the ring keeps the last
+ * PROF_RING_SIZE events for the trace dump, a slot may be overwritten
+ * while it is dumped which only costs that one event.
+ * without PROFILE the macros are empty and nothing is compiled in */
+#ifdef PROFILE
+struct ProfEvent {
+    const char *name;
+    Uint64 start;
+    Uint64 end;
+    SDL_threadID thread;
+};
+
+struct Profiler {
+    struct ProfEvent ring[PROF_RING_SIZE];
+    SDL_atomic_t head;
+    float frame_ms[PROF_FRAMES];
+    int frame;
+    long rss;
+    Uint32 rss_time;
+    int overlay;
+};
+
+struct Profiler prof;
+
+#define PROF_BEGIN(t) Uint64 t = SDL_GetPerformanceCounter()
+#define PROF_END(t, name) prof_record(name, t, SDL_GetPerformanceCounter())
+
+void prof_record(const char *name, Uint64 start, Uint64 end)
+{
+    int i = SDL_AtomicAdd(&prof.head, 1) & (PROF_RING_SIZE - 1);
+
+    prof.ring[i].name = name;
+    prof.ring[i].start = start;
+    prof.ring[i].end = end;
+    prof.ring[i].thread = SDL_ThreadID();
+}
+
+/* store the duration of the last frame for the histogram */
+void prof_frame(Uint64 start, Uint64 end)
+{
+    prof.frame_ms[prof.frame] = (float)((end - start) * 1000.0 / SDL_GetPerformanceFrequency());
+    prof.frame = (prof.frame + 1) % PROF_FRAMES;
+    prof_record("frame", start, end);
+}
+
+/* write the events in the ring as a chrome trace (chrome://tracing, perfetto) */
+int prof_dump(const char *fname)
+{
+    FILE *fp = fopen(fname, "w");
+    int head = SDL_AtomicGet(&prof.head);
+    int first = head > PROF_RING_SIZE ? head - PROF_RING_SIZE : 0;
+    double us = 1e6 / SDL_GetPerformanceFrequency();
+
+    if(fp == NULL) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+
+    for(int i = first; i < head; i++) {
+        struct ProfEvent *e = &prof.ring[i & (PROF_RING_SIZE - 1)];
+
+        fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                e->name, (unsigned long)e->thread, e->start * us, (e->end - e->start) * us,
+                i + 1 < head ? "," : "");
+    }
+
+    fprintf(fp, "]}\n");
+    fclose(fp);
+
+    if(verbose == 1) {
+        printf("%d events written to %s\n", head - first, fname);
+    }
+
+    return 0;
+}
+#else
+#define PROF_BEGIN(t)
+#define PROF_END(t, name)
+#endif
+
+/* store all individual sprites(coordinates and size) of a sheet of known
+ * width and height in rect array in spritesheet struct */
+int slice_spritesheet(struct Spritesheet *sp, int sw, int sh, int ns)
+{
+    sp->rect = calloc(ns, sizeof(SDL_Rect));
+
+    if(sp->rect == NULL) {
         error_msg();
     }
 
-    SDL_FreeSurface(loaded_surface);
+    sp->sprite_width = sw;
+    sp->sprite_height = sh;
+    sp->count = ns;
 
     /* get num rows */
     int cols = sp->width / sw;
@@ -208,10 +974,10 @@ int load_single_spritesheet(struct Editor *ed, struct Spritesheet *sp, const cha
     int tx = 0;
     int ty = 0;
 
-    for(int i = 0; i < (cols * rows); i++) {
+    for(int i = 0; i < (cols * rows) && i < ns; i++) {
         if(tx >sp->width - sw) {
             tx = 0;
-            ty += sw;
+            ty += sh;
         }
         sp->rect[i].x = tx;
         sp->rect[i].y = ty;
@@ -219,663 +985,8856 @@ int load_single_spritesheet(struct Editor *ed, struct Spritesheet *sp, const cha
         sp->rect[i].h = sh;
         tx += sw;
     }
-    
-	verbose_print("OK");
-    return 0;
 
+    return 0;
 }
 
-/* TODO: each sprite must have a reference to the correct spritesheet */
-/* create spritesheet from all files in sprite.db */
-/* create individual sprite structs from each created spritesheet and give them an id */
-/* id is index */
-/* each spritesheet contains 25 sprites */
-struct Sprite **load_sprite_database(const char *fname, struct Editor *ed)
+/* decode a png to 32 bit RGBA with the color key (0, 0xFF, 0xFF) made
+ * transparent, ready to be copied into an atlas. no renderer is needed so
+ * this runs on worker threads. returns NULL when it can not be read */
+SDL_Surface *decode_spritesheet(const char *path)
 {
-    FILE *fp = fopen(fname, "r");
-    
-    char c = '\0';
-    char line[255] = {0};
-    char result[64];
-    int row_count = 0;
-    int c_count = 0;
-    struct Sprite **sprites = NULL;
-    struct Spritesheet sp;
-    int sprite_count = 0;
+    SDL_Surface *loaded_surface = IMG_Load(path);
+    SDL_Surface *surface = NULL;
 
-    verbose_print("load_sprite_database... ");
+    if(loaded_surface == NULL) {
+        return NULL;
+    }
 
-    if(fp == NULL) {
-	verbose_print(strerror(errno));
+    surface = SDL_ConvertSurfaceFormat(loaded_surface, SDL_PIXELFORMAT_RGBA32, 0);
+    SDL_FreeSurface(loaded_surface);
+
+    if(surface == NULL) {
+        return NULL;
+    }
+
+    /* color key to alpha */
+    Uint32 key = SDL_MapRGB(surface->format, 0, 0xFF, 0xFF);
+    for(int y = 0; y < surface->h; y++) {
+        Uint32 *px = (Uint32 *)((Uint8 *)surface->pixels + y * surface->pitch);
+
+        for(int x = 0; x < surface->w; x++) {
+            if(px[x] == key) {
+                px[x] = 0;
+            }
+        }
+    }
+
+    return surface;
+}
+
+/* load a spritesheet from png to spritesheet struct and set width, and height of image */
+/* and slice it into sprites, see slice_spritesheet */
+/* the pixels are kept until they are copied into an atlas, see decode_spritesheet */
+int load_single_spritesheet(struct Spritesheet *sp, const char *path, int sw, int sh, int ns)
+{
+    sp->surface = decode_spritesheet(path);
+
+    if(sp->surface == NULL) {
         error_msg();
     }
 
-    /* get nr of lines in sprite database */
-    /* this is the nr of spritesheets */
-    /* and the nr of tiles are spritesheets * 25 */
-    while((c = fgetc(fp)) != EOF) {
-        if(ferror(fp) != 0) {
+    /* path is already set when loading from the sprite database */
+    if(sp->path == NULL) {
+        sp->path = calloc(strlen(path) + 1, sizeof(char));
+    
+        if(sp->path == NULL) {
             error_msg();
         }
-        if(c == '\n') {
-            row_count++;
-        }
+
+        strcpy(sp->path, path);
     }
 
-    rewind(fp);
+    sp->width = sp->surface->w;
+    sp->height = sp->surface->h;
+    sp->atlas = -1;
 
-    sprites = calloc(row_count * 25, sizeof(struct Sprite));
-    
-    if(sprites == NULL) {
+    return slice_spritesheet(sp, sw, sh, ns);
+}
+
+/* place every sheet of db in an atlas with a shelf packer
+ * sheets are taken tallest first and put left to right on a shelf,
+ * a new shelf starts below when the row is full and a new atlas when
+ * the atlas is full. sets atlas, x, y of each sheet and the size of each atlas */
+int pack_spritesheets(struct SpriteDB *db)
+{
+    int *order = calloc(db->sheet_count, sizeof(int));
+    int x = 0;
+    int y = 0;
+    int shelf = 0;
+
+    if(order == NULL) {
         error_msg();
     }
 
-    for(int i = 0; i < row_count * 25; i++) {
-        sprites[i] = calloc(1, sizeof(struct Sprite));
+    for(int i = 0; i < db->sheet_count; i++) {
+        order[i] = i;
+    }
+
+    /* insertion sort, tallest first */
+    for(int i = 1; i < db->sheet_count; i++) {
+        int o = order[i];
+        int j = i - 1;
 
-        if(sprites[i] == NULL) {
-            error_msg();
+        while(j >= 0 && db->sheets[order[j]].height < db->sheets[o].height) {
+            order[j + 1] = order[j];
+            j--;
         }
+        order[j + 1] = o;
     }
 
-    while((c = fgetc(fp)) != EOF) {
-        if(ferror(fp) != 0) {
-            error_msg();
+    db->atlas_count = 0;
+
+    for(int i = 0; i < db->sheet_count; i++) {
+        struct Spritesheet *sp = &db->sheets[order[i]];
+
+        if(sp->width > ATLAS_SIZE || sp->height > ATLAS_SIZE) {
+            fprintf(stderr, "%s: larger than %d atlas\n", sp->path, ATLAS_SIZE);
+            exit(-1);
         }
-        if(c != '\n') {
-            line[c_count] = c;
-            c_count++;
+
+        if(db->atlas_count == 0 || x + sp->width > ATLAS_SIZE) {
+            x = 0;
+            y += shelf;
+            shelf = 0;
         }
-        
-        /* for each line, load spritesheet into struct spritesheet */
-        /* then set spritesheets rect to sprite array */
-        if(c == '\n') {
-	    verbose_print(line);
-	    verbose_print("\n");
-            load_single_spritesheet(ed, &sp, line, 16,16, SPRITESHEET_COUNT);
-            for(int i = 0; i < SPRITESHEET_COUNT; i++) {
-                sprites[sprite_count]->rect = &sp.rect[i];
-                sprites[sprite_count]->id = sprite_count;
-                sprites[sprite_count]->spritesheet = sp;
-                //printf("[%d] x = %d y = %d\n", sprite_count, sprites[i]->rect->x, sprites[i]->rect->y);
-                sprite_count++;
+
+        if(db->atlas_count == 0 || y + sp->height > ATLAS_SIZE) {
+            struct Atlas *a = realloc(db->atlases, (db->atlas_count + 1) * sizeof(struct Atlas));
+
+            if(a == NULL) {
+                error_msg();
             }
-            /* reset line */
-	    verbose_print("resetting line\n");
-            memset(line, '\0', 255);
 
-            c_count = 0;
+            db->atlases = a;
+            db->atlases[db->atlas_count].texture = NULL;
+            db->atlases[db->atlas_count].width = 0;
+            db->atlases[db->atlas_count].height = 0;
+            db->atlases[db->atlas_count].pixels = NULL;
+            db->atlas_count++;
+            x = 0;
+            y = 0;
+            shelf = 0;
         }
+
+        struct Atlas *a = &db->atlases[db->atlas_count - 1];
+
+        sp->atlas = db->atlas_count - 1;
+        sp->x = x;
+        sp->y = y;
+
+        x += sp->width;
+        shelf = sp->height > shelf ? sp->height : shelf;
+        a->width = x > a->width ? x : a->width;
+        a->height = y + shelf > a->height ? y + shelf : a->height;
     }
-    fclose(fp);
-    ed->sprite_count = sprite_count-1;
-	sprintf(result, "%d tiles loaded\n", ed->sprite_count);
-	verbose_print(result);
-    return sprites;
 
+    free(order);
+    return 0;
 }
 
-/* render single sprite  to screen x y*/
-void render_sprite(int x, int y, struct Sprite *sp, struct Editor *ed) 
+/* copy each decoded sheet into its place in the pixels of its atlas */
+/* the decoded surfaces are freed once copied */
+int compose_atlases(struct SpriteDB *db)
 {
-    SDL_Rect render_quad = {x, y,sp->rect->w,sp->rect->h};
+    for(int i = 0; i < db->atlas_count; i++) {
+        struct Atlas *a = &db->atlases[i];
 
-    render_quad.w = sp->rect->w;
-    render_quad.h = sp->rect->h;
+        a->pixels = calloc((size_t)a->width * a->height, sizeof(Uint32));
 
-    SDL_RenderCopy(ed->screen.renderer, sp->spritesheet.texture,sp->rect, &render_quad);
-   
-}
-/* Not in use */
-void render(int x, int y, SDL_Rect *clip, struct Editor *ed, struct Spritesheet *sp) 
-{
-    SDL_Rect render_quad = {x, y,sp->width,sp->height};
+        if(a->pixels == NULL) {
+            error_msg();
+        }
+    }
+
+    for(int i = 0; i < db->sheet_count; i++) {
+        struct Spritesheet *sp = &db->sheets[i];
+        struct Atlas *a = &db->atlases[sp->atlas];
+
+        for(int y = 0; y < sp->height; y++) {
+            memcpy(a->pixels + (size_t)(sp->y + y) * a->width + sp->x,
+                    (Uint8 *)sp->surface->pixels + y * sp->surface->pitch,
+                    sp->width * sizeof(Uint32));
+        }
 
-    render_quad.w = clip->w;
-    render_quad.h = clip->h;
+        SDL_FreeSurface(sp->surface);
+        sp->surface = NULL;
+    }
 
-    SDL_RenderCopy(ed->screen.renderer, sp->texture, clip, &render_quad);
+    return 0;
 }
 
-/* create texture from png */
-SDL_Texture *load_texture(struct Editor *ed, const char *path)
+/* create atlas textures from the composed pixels, on the render thread */
+int upload_atlases(struct SpriteDB *db, SDL_Renderer *renderer)
 {
-    SDL_Texture *new_texture = NULL;
+    for(int i = 0; i < db->atlas_count; i++) {
+        struct Atlas *a = &db->atlases[i];
 
-    SDL_Surface *loaded_surface = IMG_Load(path);
+        a->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
+                SDL_TEXTUREACCESS_STATIC, a->width, a->height);
 
-    if(loaded_surface == NULL) {
-        error_msg();
+        if(a->texture == NULL) {
+            fprintf(stderr, "%s\n", SDL_GetError());
+            exit(-1);
+        }
+
+        SDL_SetTextureBlendMode(a->texture, SDL_BLENDMODE_BLEND);
+        SDL_UpdateTexture(a->texture, NULL, a->pixels, a->width * sizeof(Uint32));
+        free(a->pixels);
+        a->pixels = NULL;
     }
 
+    return 0;
+}
+
+/* modification time and size of a file, 0 when it can not be read */
+/* the key an atlas cache entry is checked against */
+struct FileStamp {
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+};
 
-    SDL_SetColorKey(loaded_surface, SDL_TRUE, SDL_MapRGB(loaded_surface->format, 0, 0xFF, 0xFF));
-    new_texture = SDL_CreateTextureFromSurface(ed->screen.renderer, loaded_surface);
+struct FileStamp file_stamp(const char *path)
+{
+    struct FileStamp fs = { 0, 0, 0 };
+    struct stat st;
 
-    if(new_texture == NULL) {
-        error_msg();
+    if(stat(path, &st) == 0) {
+        fs.mtime_sec = st.st_mtim.tv_sec;
+        fs.mtime_nsec = st.st_mtim.tv_nsec;
+        fs.size = st.st_size;
+    }
+
+    return fs;
+}
+
+/* atlas cache file <sprite.db>.cache, read with one mmap
+ * header, the stamp of sprite.db, then per sheet its stamp, placement in
+ * its atlas and what sprite.db gives for it, the sheet paths each ending
+ * in a 0 and padded to 4 bytes, the sprite index, a struct Sprite per id,
+ * the average color of every id, then per atlas its width and height
+ * followed by its RGBA pixels. while sprite.db is unchanged the sheets it
+ * lists come from here and it is not read */
+struct AtlasCacheHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t sheet_count;
+    int32_t atlas_count;
+    int32_t sprite_count;
+    int32_t path_bytes;
+};
+
+struct AtlasCacheSheet {
+    struct FileStamp stamp;
+    int32_t atlas;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    int32_t sprite_width;
+    int32_t sprite_height;
+    int32_t count;
+    int32_t first;
+};
+
+/* sync the directory fname is in, so a file created, renamed or removed
+ * there is on disk as well */
+int sync_dir(const char *fname)
+{
+    const char *slash = strrchr(fname, '/');
+    size_t len = slash == NULL ? 1 : (size_t)(slash - fname) + 1;
+    char *dir = calloc(len + 1, sizeof(char));
+    int fd = -1;
+
+    if(dir == NULL) {
+        error_msg();
+    }
+
+    memcpy(dir, slash == NULL ? "." : fname, len);
+    fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+    if(fd == -1 || fsync(fd) != 0) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        if(fd != -1) {
+            close(fd);
+        }
+        free(dir);
+        return -1;
+    }
+
+    close(fd);
+    free(dir);
+    return 0;
+}
+
+/* write the buffers of iov to fname so that a crash leaves either the old
+ * or the new file: everything goes to <fname>.<pid>.tmp in one writev, is
+ * synced and then renamed over fname, and the rename is synced. the pid
+ * keeps two processes writing the same file from sharing a temp file */
+int write_file_atomic(const char *fname, struct iovec *iov, int iovcnt)
+{
+    char *tmp = calloc(strlen(fname) + 32, sizeof(char));
+    int fd = -1;
+
+    if(tmp == NULL) {
+        error_msg();
+    }
+
+    sprintf(tmp, "%s.%ld.tmp", fname, (long)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(fd == -1) {
+        goto fail;
+    }
+
+    /* writev may write less than asked, continue where it stopped */
+    while(iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            goto fail;
+        }
+
+        while(iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if(iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    if(fsync(fd) != 0 || close(fd) != 0) {
+        fd = -1;
+        goto fail;
+    }
+    fd = -1;
+
+    if(rename(tmp, fname) != 0) {
+        goto fail;
+    }
+
+    free(tmp);
+    return sync_dir(fname);
+
+fail:
+    fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+    if(fd != -1) {
+        close(fd);
+    }
+    remove(tmp);
+    free(tmp);
+    return -1;
+}
+
+/* write the packed atlases and sprite index of db to the atlas cache of fname */
+/* the cache is replaced with a rename, another process that has it mapped
+ * keeps reading the old one. a failed write only costs the next start its
+ * warm path */
+int save_atlas_cache(struct SpriteDB *db, const char *fname)
+{
+    char *cname = calloc(strlen(fname) + strlen(ATLAS_CACHE) + 1, sizeof(char));
+    struct AtlasCacheHeader hdr;
+    struct FileStamp db_stamp = file_stamp(fname);
+    struct AtlasCacheSheet *cs = NULL;
+    int32_t (*sizes)[2] = NULL;
+    char *paths = NULL;
+    struct iovec *iov = NULL;
+    int n = 0;
+    int ret = 0;
+
+    if(cname == NULL) {
+        error_msg();
+    }
+
+    strcpy(cname, fname);
+    strcat(cname, ATLAS_CACHE);
+
+    memcpy(hdr.magic, ATLAS_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = ATLAS_CACHE_VERSION;
+    hdr.sheet_count = db->sheet_count;
+    hdr.atlas_count = db->atlas_count;
+    hdr.sprite_count = db->count;
+    hdr.path_bytes = 0;
+
+    for(int i = 0; i < db->sheet_count; i++) {
+        hdr.path_bytes += strlen(db->sheets[i].path) + 1;
+    }
+    hdr.path_bytes = (hdr.path_bytes + 3) & ~3;
+
+    cs = calloc(db->sheet_count, sizeof(*cs));
+    paths = calloc(hdr.path_bytes, sizeof(char));
+    sizes = calloc(db->atlas_count, sizeof(*sizes));
+    iov = calloc(6 + 2 * db->atlas_count, sizeof(*iov));
+
+    if(cs == NULL || paths == NULL || sizes == NULL || iov == NULL) {
+        error_msg();
+    }
+
+    char *path = paths;
+
+    for(int i = 0; i < db->sheet_count; i++) {
+        struct Spritesheet *sp = &db->sheets[i];
+        struct AtlasCacheSheet s = { file_stamp(sp->path), sp->atlas, sp->x, sp->y, sp->width, sp->height,
+            sp->sprite_width, sp->sprite_height, sp->count, sp->first };
+
+        cs[i] = s;
+        strcpy(path, sp->path);
+        path += strlen(sp->path) + 1;
+    }
+
+    iov[n].iov_base = &hdr;
+    iov[n++].iov_len = sizeof(hdr);
+    iov[n].iov_base = &db_stamp;
+    iov[n++].iov_len = sizeof(db_stamp);
+    iov[n].iov_base = cs;
+    iov[n++].iov_len = db->sheet_count * sizeof(*cs);
+    iov[n].iov_base = paths;
+    iov[n++].iov_len = hdr.path_bytes;
+    iov[n].iov_base = db->sprites;
+    iov[n++].iov_len = db->count * sizeof(struct Sprite);
+    iov[n].iov_base = db->colors;
+    iov[n++].iov_len = db->count * sizeof(Uint32);
+
+    for(int i = 0; i < db->atlas_count; i++) {
+        struct Atlas *a = &db->atlases[i];
+
+        sizes[i][0] = a->width;
+        sizes[i][1] = a->height;
+        iov[n].iov_base = sizes[i];
+        iov[n++].iov_len = sizeof(sizes[i]);
+        iov[n].iov_base = a->pixels;
+        iov[n++].iov_len = (size_t)a->width * a->height * sizeof(Uint32);
+    }
+
+    ret = write_file_atomic(cname, iov, n);
+
+    free(iov);
+    free(sizes);
+    free(paths);
+    free(cs);
+    free(cname);
+    return ret;
+}
+
+/* whether the rect at x,y of w by h lies inside an atlas of size */
+int rect_in_atlas(int x, int y, int w, int h, const int32_t size[2])
+{
+    return x >= 0 && y >= 0 && w > 0 && h > 0 && w <= size[0] && h <= size[1] &&
+        x <= size[0] - w && y <= size[1] - h;
+}
+
+/* fill db, its sheets, sprite index and atlases, from the atlas cache of
+ * fname when sprite.db and every sheet it lists still have the stamps the
+ * cache was written with. returns -1 when the cache is missing or stale,
+ * then nothing in db is changed */
+int load_atlas_cache(struct SpriteDB *db, const char *fname)
+{
+    char *cname = calloc(strlen(fname) + strlen(ATLAS_CACHE) + 1, sizeof(char));
+    const struct AtlasCacheHeader *hdr = NULL;
+    const struct AtlasCacheSheet *cs = NULL;
+    const struct Sprite *sprites = NULL;
+    const char *paths = NULL;
+    struct FileStamp db_stamp = file_stamp(fname);
+    struct FileStamp stamp;
+    struct stat st;
+    const uint8_t *base = NULL;
+    const uint8_t *p = NULL;
+    const uint8_t *end = NULL;
+    int32_t (*sizes)[2] = NULL;
+    void *map = MAP_FAILED;
+    int fd = -1;
+
+    if(cname == NULL) {
+        error_msg();
+    }
+
+    strcpy(cname, fname);
+    strcat(cname, ATLAS_CACHE);
+    fd = open(cname, O_RDONLY);
+    free(cname);
+
+    if(fd == -1) {
+        return -1;
+    }
+
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)(sizeof(*hdr) + sizeof(stamp))) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+
+    base = map;
+    end = base + st.st_size;
+    hdr = map;
+    memcpy(&stamp, base + sizeof(*hdr), sizeof(stamp));
+    p = base + sizeof(*hdr) + sizeof(stamp);
+
+    if(memcmp(hdr->magic, ATLAS_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->version != ATLAS_CACHE_VERSION || hdr->sheet_count <= 0 ||
+            hdr->atlas_count <= 0 || hdr->sprite_count <= 0 || hdr->sprite_count > UINT16_MAX + 1 ||
+            hdr->path_bytes <= 0 || memcmp(&stamp, &db_stamp, sizeof(stamp)) != 0 ||
+            (size_t)(end - p) < hdr->sheet_count * sizeof(*cs) + hdr->path_bytes +
+            hdr->sprite_count * (sizeof(struct Sprite) + sizeof(Uint32))) {
+        goto stale;
+    }
+
+    cs = (const struct AtlasCacheSheet *)p;
+    paths = (const char *)(cs + hdr->sheet_count);
+    sprites = (const struct Sprite *)(paths + hdr->path_bytes);
+    p = (const uint8_t *)(sprites + hdr->sprite_count) + hdr->sprite_count * sizeof(Uint32);
+
+    if(paths[hdr->path_bytes - 1] != '\0') {
+        goto stale;
+    }
+
+    /* every sheet must be where it was when the cache was written */
+    const char *path = paths;
+
+    for(int i = 0; i < hdr->sheet_count; i++) {
+        if(path >= paths + hdr->path_bytes) {
+            goto stale;
+        }
+
+        stamp = file_stamp(path);
+
+        if(memcmp(&stamp, &cs[i].stamp, sizeof(stamp)) != 0 || stamp.size == 0 ||
+                cs[i].atlas < 0 || cs[i].atlas >= hdr->atlas_count) {
+            goto stale;
+        }
+        path += strlen(path) + 1;
+    }
+
+    /* atlases follow the index, each sheet and sprite has to lie inside its
+     * atlas and the ids of a sheet inside the index */
+    const uint8_t *pixels = p;
+
+    sizes = malloc(hdr->atlas_count * sizeof(*sizes));
+
+    if(sizes == NULL) {
+        error_msg();
+    }
+
+    for(int i = 0; i < hdr->atlas_count; i++) {
+        int32_t *size = sizes[i];
+
+        if(end - p < (ptrdiff_t)sizeof(sizes[i])) {
+            goto stale;
+        }
+
+        memcpy(size, p, sizeof(sizes[i]));
+
+        if(size[0] <= 0 || size[1] <= 0 || size[0] > ATLAS_SIZE || size[1] > ATLAS_SIZE ||
+                (size_t)(end - p - sizeof(sizes[i])) < (size_t)size[0] * size[1] * sizeof(Uint32)) {
+            goto stale;
+        }
+        p += sizeof(sizes[i]) + (size_t)size[0] * size[1] * sizeof(Uint32);
+    }
+
+    for(int i = 0; i < hdr->sheet_count; i++) {
+        if(!rect_in_atlas(cs[i].x, cs[i].y, cs[i].width, cs[i].height, sizes[cs[i].atlas]) ||
+                cs[i].sprite_width <= 0 || cs[i].sprite_height <= 0 || cs[i].count < 0 ||
+                cs[i].first < 0 || cs[i].count > hdr->sprite_count - cs[i].first) {
+            goto stale;
+        }
+    }
+
+    for(int i = 0; i < hdr->sprite_count; i++) {
+        const SDL_Rect *r = &sprites[i].rect;
+
+        /* ids no sheet gives have an empty rect and are never drawn */
+        if(sprites[i].atlas < 0 || sprites[i].atlas >= hdr->atlas_count || ((r->w != 0 || r->h != 0) &&
+                !rect_in_atlas(r->x, r->y, r->w, r->h, sizes[sprites[i].atlas]))) {
+            goto stale;
+        }
+    }
+
+    free(sizes);
+
+    /* the cache is good, copy it out */
+    db->sheets = calloc(hdr->sheet_count, sizeof(struct Spritesheet));
+    db->atlases = calloc(hdr->atlas_count, sizeof(struct Atlas));
+    db->sprites = malloc(hdr->sprite_count * sizeof(struct Sprite));
+    db->colors = malloc(hdr->sprite_count * sizeof(Uint32));
+
+    if(db->sheets == NULL || db->atlases == NULL || db->sprites == NULL || db->colors == NULL) {
+        error_msg();
+    }
+
+    path = paths;
+    for(int i = 0; i < hdr->sheet_count; i++) {
+        struct Spritesheet *sp = &db->sheets[i];
+
+        sp->path = calloc(strlen(path) + 1, sizeof(char));
+
+        if(sp->path == NULL) {
+            error_msg();
+        }
+
+        strcpy(sp->path, path);
+        path += strlen(path) + 1;
+        sp->atlas = cs[i].atlas;
+        sp->x = cs[i].x;
+        sp->y = cs[i].y;
+        sp->width = cs[i].width;
+        sp->height = cs[i].height;
+        sp->sprite_width = cs[i].sprite_width;
+        sp->sprite_height = cs[i].sprite_height;
+        sp->count = cs[i].count;
+        sp->first = cs[i].first;
+    }
+
+    memcpy(db->sprites, sprites, hdr->sprite_count * sizeof(struct Sprite));
+    memcpy(db->colors, sprites + hdr->sprite_count, hdr->sprite_count * sizeof(Uint32));
+
+    p = pixels;
+    for(int i = 0; i < hdr->atlas_count; i++) {
+        struct Atlas *a = &db->atlases[i];
+        int32_t size[2];
+        size_t n = 0;
+
+        memcpy(size, p, sizeof(size));
+        n = (size_t)size[0] * size[1];
+        a->width = size[0];
+        a->height = size[1];
+        a->pixels = malloc(n * sizeof(Uint32));
+
+        if(a->pixels == NULL) {
+            error_msg();
+        }
+
+        memcpy(a->pixels, p + sizeof(size), n * sizeof(Uint32));
+        p += sizeof(size) + n * sizeof(Uint32);
+    }
+
+    db->sheet_count = hdr->sheet_count;
+    db->atlas_count = hdr->atlas_count;
+    db->count = hdr->sprite_count;
+    munmap(map, st.st_size);
+
+    return 0;
+
+stale:
+    free(sizes);
+    munmap(map, st.st_size);
+    return -1;
+}
+
+/* decode job for the worker pool, one sheet per index */
+void decode_sheet_job(void *ctx, int i)
+{
+    struct SpriteDB *db = ctx;
+
+    struct Spritesheet *sp = &db->sheets[i];
+
+    PROF_BEGIN(t);
+    load_single_spritesheet(sp, sp->path, sp->sprite_width, sp->sprite_height, sp->count);
+    PROF_END(t, "decode_sheet");
+}
+
+/* read the animated ranges of a sprite database from fname
+ * every line is <first id> <last id> <ms per frame>, an id of a range is
+ * drawn as the sprite that follows it in the range by the number of frames
+ * passed, so neighbouring tiles can run out of phase. a missing file means
+ * nothing animates */
+int load_animations(const char *fname, struct SpriteDB *db)
+{
+    FILE *fp = fopen(fname, "r");
+    char line[255];
+    int start = 0;
+    int end = 0;
+    int ms = 0;
+
+    db->frame = malloc(db->count * sizeof(uint16_t));
+    db->animated = calloc(db->count, sizeof(uint8_t));
+
+    if(db->frame == NULL || db->animated == NULL) {
+        error_msg();
+    }
+
+    for(int i = 0; i < db->count; i++) {
+        db->frame[i] = i;
+    }
+
+    if(fp == NULL) {
+        return 0;
+    }
+
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        struct Tile *t = NULL;
+
+        if(sscanf(line, "%d %d %d", &start, &end, &ms) != 3) {
+            continue;
+        }
+
+        if(start < 1 || end < start || end >= db->count || ms <= 0) {
+            fprintf(stderr, "%s: bad range %d %d %d\n", fname, start, end, ms);
+            continue;
+        }
+
+        db->ranges = realloc(db->ranges, (db->range_count + 1) * sizeof(struct Tile));
+
+        if(db->ranges == NULL) {
+            error_msg();
+        }
+
+        t = &db->ranges[db->range_count++];
+        memset(t, 0, sizeof(*t));
+        t->id = start;
+        t->type = SPRITE_RANGE;
+        t->range_start = start;
+        t->range_end = end;
+        t->frame_ms = ms;
+        memset(db->animated + start, 1, end - start + 1);
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+/* advance the animation clock to now and update the frame table
+ * only the ids of the ranges are touched, however many tiles use them.
+ * returns 1 when a frame changed and animated tiles need drawing */
+int anim_tick(struct SpriteDB *db, Uint32 now)
+{
+    int changed = 0;
+
+    for(int r = 0; r < db->range_count; r++) {
+        const struct Tile *t = &db->ranges[r];
+        int len = t->range_end - t->range_start + 1;
+        int step = (now / t->frame_ms) % len;
+
+        if(step == (int)((db->clock / t->frame_ms) % len)) {
+            continue;
+        }
+
+        for(int id = t->range_start; id <= t->range_end; id++) {
+            db->frame[id] = t->range_start + (id - t->range_start + step) % len;
+        }
+        changed = 1;
+    }
+
+    db->clock = now;
+    return changed;
+}
+
+/* average color of the sprite at rect in RGBA pixels, rows stride pixels
+ * apart. channels are weighted by alpha so transparent pixels add nothing */
+Uint32 sprite_color(const Uint32 *pixels, int stride, SDL_Rect rect)
+{
+    Uint32 color = 0;
+    Uint8 *out = (Uint8 *)&color;
+    uint64_t sum[4] = {0};
+
+    for(int y = rect.y; y < rect.y + rect.h; y++) {
+        const Uint8 *px = (const Uint8 *)&pixels[(size_t)y * stride + rect.x];
+
+        for(int x = 0; x < rect.w; x++, px += 4) {
+            sum[0] += px[0] * px[3];
+            sum[1] += px[1] * px[3];
+            sum[2] += px[2] * px[3];
+            sum[3] += px[3];
+        }
+    }
+
+    if(sum[3] == 0) {
+        return 0;
+    }
+
+    out[0] = sum[0] / sum[3];
+    out[1] = sum[1] / sum[3];
+    out[2] = sum[2] / sum[3];
+    out[3] = sum[3] / (rect.w * rect.h);
+
+    return color;
+}
+
+/* average color of every sprite, for drawing the map zoomed out */
+int sprite_colors(struct SpriteDB *db)
+{
+    db->colors = calloc(db->count, sizeof(Uint32));
+
+    if(db->colors == NULL) {
+        error_msg();
+    }
+
+    for(int i = 0; i < db->count; i++) {
+        const struct Sprite *s = &db->sprites[i];
+        const struct Atlas *a = &db->atlases[s->atlas];
+
+        db->colors[i] = sprite_color(a->pixels, a->width, s->rect);
+    }
+
+    return 0;
+}
+
+/* split a sprite.db line into its path and the numbers after it, in place
+ * the path is the rest of the line so it may hold spaces, a single number
+ * after it is taken to be part of the path. returns the count of numbers
+ * in vals, 0, 2, 3 or 4, in the order they were written */
+int split_sheet_line(char *line, char **path, int *vals)
+{
+    char *end = line + strlen(line);
+    char *ends[5];
+    int rev[4];
+    int k = 0;
+
+    while(*line == ' ' || *line == '\t') {
+        line++;
+    }
+
+    while(end > line && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+
+    ends[0] = end;
+
+    while(k < 4) {
+        char *tok = end;
+        char *stop = NULL;
+        long v = 0;
+
+        while(tok > line && tok[-1] != ' ' && tok[-1] != '\t') {
+            tok--;
+        }
+
+        /* the first word is always the path */
+        if(tok == line || tok == end) {
+            break;
+        }
+
+        v = strtol(tok, &stop, 10);
+
+        if(stop != end) {
+            break;
+        }
+
+        /* out of range numbers are kept as a bad size */
+        rev[k++] = v < INT32_MIN ? INT32_MIN : v > INT32_MAX ? INT32_MAX : (int)v;
+        end = tok;
+
+        while(end > line && (end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
+        }
+
+        ends[k] = end;
+    }
+
+    k = k == 1 ? 0 : k;
+    *ends[k] = '\0';
+    *path = line;
+
+    for(int i = 0; i < k; i++) {
+        vals[i] = rev[k - 1 - i];
+    }
+
+    return k;
+}
+
+/* read the sheets listed in sprite.db fname, one per line
+ *     <path> [<sprite width> <sprite height> [<count> [<first id>]]]
+ * the path is the rest of the line and may hold spaces.
+ * sprites default to 16x16 and SPRITESHEET_COUNT per sheet, the first id
+ * to the one after the last sprite of the sheet above. giving first ids
+ * keeps ids stable when sheets are added or removed in between. lines
+ * starting with # are skipped. a sheet whose ids overlap another sheet or
+ * do not fit a 16 bit id is reported and left out.
+ * returns the number of sheets in *sheets or -1 when fname can not be read */
+int read_sprite_db(const char *fname, struct Spritesheet **sheets)
+{
+    FILE *fp = fopen(fname, "r");
+    struct Spritesheet *list = NULL;
+    char line[255];
+    int count = 0;
+    int next = 0;
+    int n = 0;
+
+    *sheets = NULL;
+
+    if(fp == NULL) {
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        struct Spritesheet sp;
+        char *path = NULL;
+        int vals[4];
+        int k = 0;
+        int bad = 0;
+
+        n++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if(line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        memset(&sp, 0, sizeof(sp));
+        sp.sprite_width = 16;
+        sp.sprite_height = 16;
+        sp.count = SPRITESHEET_COUNT;
+        sp.first = next;
+        sp.atlas = -1;
+
+        k = split_sheet_line(line, &path, vals);
+
+        if(path[0] == '\0') {
+            continue;
+        }
+
+        sp.sprite_width = k > 0 ? vals[0] : sp.sprite_width;
+        sp.sprite_height = k > 1 ? vals[1] : sp.sprite_height;
+        sp.count = k > 2 ? vals[2] : sp.count;
+        sp.first = k > 3 ? vals[3] : sp.first;
+
+        bad = sp.sprite_width <= 0 || sp.sprite_height <= 0 || sp.count <= 0 || sp.first < 0 ||
+            sp.count > UINT16_MAX + 1 || sp.first > UINT16_MAX + 1 - sp.count;
+
+        for(int i = 0; i < count && !bad; i++) {
+            bad = sp.first < list[i].first + list[i].count && list[i].first < sp.first + sp.count;
+        }
+
+        if(bad) {
+            fprintf(stderr, "%s:%d: bad sheet %s, ids %d to %d\n", fname, n, path,
+                    sp.first, sp.first + sp.count - 1);
+            continue;
+        }
+
+        list = realloc(list, (count + 1) * sizeof(struct Spritesheet));
+        sp.path = calloc(strlen(path) + 1, sizeof(char));
+
+        if(list == NULL || sp.path == NULL) {
+            error_msg();
+        }
+
+        strcpy(sp.path, path);
+        list[count++] = sp;
+        next = sp.first + sp.count;
+    }
+
+    fclose(fp);
+    *sheets = list;
+    return count;
+}
+
+/* the sprite index, a struct Sprite per id with its atlas and rect in it
+ * ids no sheet gives have an empty rect and are drawn as nothing */
+int build_sprite_index(struct SpriteDB *db)
+{
+    db->count = 0;
+
+    for(int i = 0; i < db->sheet_count; i++) {
+        int end = db->sheets[i].first + db->sheets[i].count;
+
+        db->count = end > db->count ? end : db->count;
+    }
+
+    db->sprites = calloc(db->count, sizeof(struct Sprite));
+
+    if(db->sprites == NULL) {
+        error_msg();
+    }
+
+    for(int i = 0; i < db->sheet_count; i++) {
+        struct Spritesheet *sp = &db->sheets[i];
+
+        for(int k = 0; k < sp->count; k++) {
+            struct Sprite *s = &db->sprites[sp->first + k];
+
+            /* a count past the end of the sheet leaves the rest empty */
+            if(sp->rect[k].w == 0) {
+                continue;
+            }
+
+            s->atlas = sp->atlas;
+            s->rect = sp->rect[k];
+            s->rect.x += sp->x;
+            s->rect.y += sp->y;
+        }
+    }
+
+    return 0;
+}
+
+/* load every spritesheet listed in sprite.db, see read_sprite_db, pack
+ * them into atlas textures and index their sprites by id.
+ * when the atlas cache is current the sheets, index and packed atlases
+ * are read from it and sprite.db is not parsed, otherwise the sheets are
+ * decoded on the worker pool, packed and the cache is written. only the
+ * texture upload runs on this thread */
+int load_sprite_database(const char *fname, struct Editor *ed, struct SpriteDB *db)
+{
+    char result[64];
+    int warm = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    verbose_print("load_sprite_database... ");
+
+    memset(db, 0, sizeof(struct SpriteDB));
+
+    if(load_atlas_cache(db, fname) == 0) {
+        warm = 1;
+    } else {
+        db->sheet_count = read_sprite_db(fname, &db->sheets);
+
+        if(db->sheet_count == -1) {
+            verbose_print(strerror(errno));
+            error_msg();
+        }
+
+        if(db->sheet_count == 0) {
+            fprintf(stderr, "%s: no sheets\n", fname);
+            exit(-1);
+        }
+
+        pool_run(db->sheet_count, decode_sheet_job, db);
+        pack_spritesheets(db);
+        compose_atlases(db);
+        build_sprite_index(db);
+        sprite_colors(db);
+        save_atlas_cache(db, fname);
+    }
+
+    /* the atlas pixels are gone once uploaded, headless there is no
+     * renderer and they are kept for drawing in software */
+    if(ed->screen.renderer != NULL) {
+        upload_atlases(db, ed->screen.renderer);
+    }
+
+    load_animations(ANIM_DB, db);
+
+    ed->sprite_count = db->count;
+	sprintf(result, "%d tiles loaded, %d atlas textures, %s start %.1f ms\n", db->count, db->atlas_count,
+            warm ? "warm" : "cold", elapsed_sec(start) * 1000.0);
+	verbose_print(result);
+    return 0;
+
+}
+
+/* watch the directory of path, returns the index of its watch descriptor
+ * in sw->dirs or -1. a directory watched already gives the same one */
+int sprite_watch_dir(struct SpriteWatch *sw, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = NULL;
+    int wd = -1;
+
+    if(slash == NULL) {
+        wd = inotify_add_watch(sw->fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+    } else {
+        dir = calloc(slash - path + 2, sizeof(char));
+
+        if(dir == NULL) {
+            error_msg();
+        }
+
+        memcpy(dir, path, slash - path + 1);
+        wd = inotify_add_watch(sw->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        free(dir);
+    }
+
+    if(wd == -1) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    for(int i = 0; i < sw->dir_count; i++) {
+        if(sw->dirs[i] == wd) {
+            return i;
+        }
+    }
+
+    int *dirs = realloc(sw->dirs, (sw->dir_count + 1) * sizeof(int));
+
+    if(dirs == NULL) {
+        error_msg();
+    }
+
+    sw->dirs = dirs;
+    sw->dirs[sw->dir_count] = wd;
+
+    return sw->dir_count++;
+}
+
+/* 1 when an event for name in watched directory dir is about path */
+static inline int watch_match(const char *path, int dir, int event_dir, const char *name)
+{
+    const char *slash = strrchr(path, '/');
+
+    return dir == event_dir && strcmp(slash != NULL ? slash + 1 : path, name) == 0;
+}
+
+/* read sprite.db again and flag the sheets whose path changed
+ * ids and atlas places are given by the sheets in sprite.db, when a sheet
+ * was added or removed or its sprites changed they would move, so the
+ * change is left for a restart */
+void sprite_watch_reread(struct SpriteWatch *sw, uint8_t *changed)
+{
+    struct Spritesheet *sheets = NULL;
+    int count = read_sprite_db(sw->db_file, &sheets);
+    int same = count == sw->count;
+
+    if(count == -1) {
+        fprintf(stderr, "%s: %s\n", sw->db_file, strerror(errno));
+        return;
+    }
+
+    for(int i = 0; i < count && same; i++) {
+        same = sheets[i].sprite_width == sw->sheets[i].sprite_width &&
+            sheets[i].sprite_height == sw->sheets[i].sprite_height &&
+            sheets[i].count == sw->sheets[i].count && sheets[i].first == sw->sheets[i].first;
+    }
+
+    if(!same) {
+        fprintf(stderr, "%s: sheets or ids changed, restart to load them\n", sw->db_file);
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(same && strcmp(sheets[i].path, sw->sheets[i].path) != 0) {
+            free(sw->sheets[i].path);
+            sw->sheets[i].path = sheets[i].path;
+            sw->sheet_dir[i] = sprite_watch_dir(sw, sheets[i].path);
+            changed[i] = 1;
+            continue;
+        }
+        free(sheets[i].path);
+    }
+
+    free(sheets);
+}
+
+/* decode sheet i on the watch thread and queue it for the render thread
+ * a reload of the same sheet still queued is replaced */
+void sprite_watch_decode(struct SpriteWatch *sw, int i)
+{
+    struct SheetReload r = { i, NULL, NULL, NULL };
+    struct Spritesheet sp = sw->sheets[i];
+
+    r.surface = decode_spritesheet(sp.path);
+
+    if(r.surface == NULL) {
+        fprintf(stderr, "%s: %s\n", sp.path, IMG_GetError());
+        return;
+    }
+
+    /* sprite colors for the zoomed out map, from the rects of the sheet */
+    sp.width = r.surface->w;
+    sp.height = r.surface->h;
+    slice_spritesheet(&sp, sp.sprite_width, sp.sprite_height, sp.count);
+    r.colors = calloc(sp.count, sizeof(Uint32));
+    r.path = calloc(strlen(sp.path) + 1, sizeof(char));
+
+    if(r.colors == NULL || r.path == NULL) {
+        error_msg();
+    }
+
+    for(int k = 0; k < sp.count; k++) {
+        r.colors[k] = sprite_color(r.surface->pixels, r.surface->pitch / sizeof(Uint32), sp.rect[k]);
+    }
+    free(sp.rect);
+    strcpy(r.path, sp.path);
+
+    SDL_LockMutex(sw->lock);
+    int k = 0;
+
+    while(k < sw->ready_count && sw->ready[k].sheet != i) {
+        k++;
+    }
+
+    if(k == sw->ready_count) {
+        struct SheetReload *ready = realloc(sw->ready, (sw->ready_count + 1) * sizeof(struct SheetReload));
+
+        if(ready == NULL) {
+            error_msg();
+        }
+
+        sw->ready = ready;
+        sw->ready_count++;
+    } else {
+        SDL_FreeSurface(sw->ready[k].surface);
+        free(sw->ready[k].colors);
+        free(sw->ready[k].path);
+    }
+
+    sw->ready[k] = r;
+    SDL_UnlockMutex(sw->lock);
+
+    /* wake the main loop if it is waiting for events */
+    SDL_Event wake;
+
+    memset(&wake, 0, sizeof(wake));
+    wake.type = SDL_USEREVENT;
+    SDL_PushEvent(&wake);
+}
+
+/* watch thread, waits for inotify events and decodes the sheets they name
+ * a save is often several events, they are read until none came for
+ * WATCH_SETTLE_MS so a sheet is decoded once per save */
+int sprite_watch_worker(void *data)
+{
+    struct SpriteWatch *sw = data;
+    struct pollfd pfd = { sw->fd, POLLIN, 0 };
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    uint8_t *changed = calloc(sw->count, sizeof(uint8_t));
+
+    if(changed == NULL) {
+        error_msg();
+    }
+
+    while(!SDL_AtomicGet(&sw->quit)) {
+        int db_changed = 0;
+
+        if(poll(&pfd, 1, WATCH_POLL_MS) <= 0) {
+            continue;
+        }
+
+        do {
+            ssize_t n = 0;
+
+            while((n = read(sw->fd, buf, sizeof(buf))) > 0) {
+                for(char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+                    const struct inotify_event *ev = (const struct inotify_event *)p;
+                    int dir = -1;
+
+                    for(int i = 0; i < sw->dir_count; i++) {
+                        dir = sw->dirs[i] == ev->wd ? i : dir;
+                    }
+
+                    if(ev->len == 0 || dir == -1) {
+                        continue;
+                    }
+
+                    db_changed |= watch_match(sw->db_file, sw->db_dir, dir, ev->name);
+
+                    for(int i = 0; i < sw->count; i++) {
+                        changed[i] |= watch_match(sw->sheets[i].path, sw->sheet_dir[i], dir, ev->name);
+                    }
+                }
+            }
+        } while(poll(&pfd, 1, WATCH_SETTLE_MS) > 0);
+
+        if(db_changed) {
+            sprite_watch_reread(sw, changed);
+        }
+
+        for(int i = 0; i < sw->count; i++) {
+            if(changed[i]) {
+                sprite_watch_decode(sw, i);
+                changed[i] = 0;
+            }
+        }
+    }
+
+    free(changed);
+    return 0;
+}
+
+/* watch sprite.db fname and the sheets of db for changes
+ * returns -1 when inotify is not available, sheets are then never reloaded */
+int sprite_watch_init(struct SpriteWatch *sw, const char *fname, const struct SpriteDB *db)
+{
+    memset(sw, 0, sizeof(*sw));
+    sw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if(sw->fd == -1) {
+        fprintf(stderr, "inotify: %s\n", strerror(errno));
+        return -1;
+    }
+
+    sw->db_file = calloc(strlen(fname) + 1, sizeof(char));
+    sw->sheets = calloc(db->sheet_count, sizeof(struct Spritesheet));
+    sw->sheet_dir = calloc(db->sheet_count, sizeof(int));
+
+    if(sw->db_file == NULL || sw->sheets == NULL || sw->sheet_dir == NULL) {
+        error_msg();
+    }
+
+    strcpy(sw->db_file, fname);
+    sw->db_dir = sprite_watch_dir(sw, fname);
+    sw->count = db->sheet_count;
+
+    for(int i = 0; i < sw->count; i++) {
+        struct Spritesheet *sp = &sw->sheets[i];
+
+        sp->path = calloc(strlen(db->sheets[i].path) + 1, sizeof(char));
+
+        if(sp->path == NULL) {
+            error_msg();
+        }
+
+        strcpy(sp->path, db->sheets[i].path);
+        sp->sprite_width = db->sheets[i].sprite_width;
+        sp->sprite_height = db->sheets[i].sprite_height;
+        sp->count = db->sheets[i].count;
+        sp->first = db->sheets[i].first;
+        sw->sheet_dir[i] = sprite_watch_dir(sw, sp->path);
+    }
+
+    sw->lock = SDL_CreateMutex();
+
+    if(sw->lock == NULL) {
+        error_msg();
+    }
+
+    sw->thread = SDL_CreateThread(sprite_watch_worker, "sprite_watch", sw);
+    return 0;
+}
+
+/* copy the sheets decoded by the watch thread into their place in the
+ * atlas textures, called once per frame. ids stay the same, a sheet that
+ * changed size no longer fits its place and is left for a restart.
+ * returns 1 when a sheet was reloaded and the map needs drawing again */
+int sprite_watch_tick(struct SpriteWatch *sw, struct SpriteDB *db)
+{
+    struct SheetReload *ready = NULL;
+    int count = 0;
+    int changed = 0;
+    char result[255];
+
+    if(sw->thread == NULL) {
+        return 0;
+    }
+
+    SDL_LockMutex(sw->lock);
+    ready = sw->ready;
+    count = sw->ready_count;
+    sw->ready = NULL;
+    sw->ready_count = 0;
+    SDL_UnlockMutex(sw->lock);
+
+    for(int i = 0; i < count; i++) {
+        struct SheetReload *r = &ready[i];
+        struct Spritesheet *sp = &db->sheets[r->sheet];
+
+        if(r->surface->w != sp->width || r->surface->h != sp->height) {
+            fprintf(stderr, "%s: %dx%d, was %dx%d, restart to load it\n", r->path,
+                    r->surface->w, r->surface->h, sp->width, sp->height);
+        } else {
+            SDL_Rect rect = { sp->x, sp->y, sp->width, sp->height };
+
+            PROF_BEGIN(t);
+            SDL_UpdateTexture(db->atlases[sp->atlas].texture, &rect, r->surface->pixels, r->surface->pitch);
+            PROF_END(t, "sheet_reload");
+            memcpy(db->colors + sp->first, r->colors, sp->count * sizeof(Uint32));
+            free(sp->path);
+            sp->path = r->path;
+            r->path = NULL;
+            changed = 1;
+
+            snprintf(result, sizeof(result), "reloaded %s\n", sp->path);
+            verbose_print(result);
+        }
+
+        SDL_FreeSurface(r->surface);
+        free(r->colors);
+        free(r->path);
+    }
+
+    free(ready);
+    return changed;
+}
+
+/* stop the watch thread, it sees quit within WATCH_POLL_MS */
+void sprite_watch_free(struct SpriteWatch *sw)
+{
+    if(sw->thread != NULL) {
+        SDL_AtomicSet(&sw->quit, 1);
+        SDL_WaitThread(sw->thread, NULL);
+        SDL_DestroyMutex(sw->lock);
+    }
+
+    if(sw->fd != -1) {
+        close(sw->fd);
+    }
+
+    for(int i = 0; i < sw->count; i++) {
+        free(sw->sheets[i].path);
+    }
+
+    for(int i = 0; i < sw->ready_count; i++) {
+        SDL_FreeSurface(sw->ready[i].surface);
+        free(sw->ready[i].colors);
+        free(sw->ready[i].path);
+    }
+
+    free(sw->db_file);
+    free(sw->sheets);
+    free(sw->sheet_dir);
+    free(sw->dirs);
+    free(sw->ready);
+    memset(sw, 0, sizeof(*sw));
+    sw->fd = -1;
+}
+
+/* render single sprite  to screen x y*/
+void render_sprite(int x, int y, struct SpriteDB *db, int id, struct Editor *ed) 
+{
+    struct Sprite *sp = NULL;
+    SDL_Rect render_quad;
+
+    if(id < 0 || id >= db->count || db->sprites[id].rect.w == 0) {
+        return;
+    }
+
+    sp = &db->sprites[id];
+    render_quad = (SDL_Rect){ x, y, sp->rect.w, sp->rect.h };
+
+    SDL_RenderCopy(ed->screen.renderer, db->atlases[sp->atlas].texture, &sp->rect, &render_quad);
+   
+}
+
+/* create texture from png */
+SDL_Texture *load_texture(struct Editor *ed, const char *path)
+{
+    SDL_Texture *new_texture = NULL;
+
+    SDL_Surface *loaded_surface = IMG_Load(path);
+
+    if(loaded_surface == NULL) {
+        error_msg();
+    }
+
+
+    SDL_SetColorKey(loaded_surface, SDL_TRUE, SDL_MapRGB(loaded_surface->format, 0, 0xFF, 0xFF));
+    new_texture = SDL_CreateTextureFromSurface(ed->screen.renderer, loaded_surface);
+
+    if(new_texture == NULL) {
+        error_msg();
     }
 
     SDL_FreeSurface(loaded_surface);
 
-    return new_texture;
+    return new_texture;
+}
+
+/* allocate an empty journal that may use budget bytes of deltas */
+int undo_init(struct Journal *j, size_t budget)
+{
+    memset(j, 0, sizeof(struct Journal));
+    j->capacity = budget / sizeof(struct Delta);
+    j->capacity = j->capacity < 1 ? 1 : j->capacity;
+    j->deltas = calloc(j->capacity, sizeof(struct Delta));
+    j->entries = calloc(UNDO_ENTRIES, sizeof(struct UndoEntry));
+
+    if(j->deltas == NULL || j->entries == NULL) {
+        error_msg();
+    }
+
+    return 0;
+}
+
+void undo_free(struct Journal *j)
+{
+    free(j->deltas);
+    free(j->entries);
+    memset(j, 0, sizeof(struct Journal));
+}
+
+/* init sdl and set editor settings */
+int init_editor(struct Editor *ed)
+{
+    if(SDL_Init(SDL_INIT_EVERYTHING) != 0) {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        exit(-1);
+    }
+
+    ed->screen.w = SCREEN_W;
+    ed->screen.h = SCREEN_H;
+    ed->screen.title = calloc(strlen(WIN_TITLE) + 1, sizeof(char));
+    
+    if(ed->screen.title == NULL) {
+        error_msg();
+    }
+
+    strcpy(ed->screen.title, WIN_TITLE);
+
+    /* create SDL window */
+    ed->screen.window = SDL_CreateWindow(
+            WIN_TITLE, 
+            SDL_WINDOWPOS_CENTERED,
+            SDL_WINDOWPOS_CENTERED,
+            ed->screen.w,
+            ed->screen.h,
+            0
+        );
+
+    /* create SDL renderer */
+    ed->screen.renderer = SDL_CreateRenderer(ed->screen.window, -1,
+            SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+
+    SDL_SetRenderDrawColor(ed->screen.renderer, 0xFF,0xFF,0xFF,0xFF);
+
+    /* init SDL Image */
+    int img_flags = IMG_INIT_PNG;
+    if(!(IMG_Init(img_flags) & img_flags)) {
+        error_msg();
+    }
+
+    ed->screen.surface = SDL_GetWindowSurface(ed->screen.window);
+
+    ed->camera_x = 0;
+    ed->camera_y = 0;
+    ed->zoom = 1.0f;
+    ed->panning = 0;
+    ed->batches = NULL;
+    ed->batch_count = 0;
+    ed->indices = NULL;
+    ed->index_quads = 0;
+    ed->layer_cache = NULL;
+    ed->cache_layers = 0;
+    ed->cache_camera_x = 0;
+    ed->cache_camera_y = 0;
+    ed->cache_zoom = 1.0f;
+    memset(&ed->stats, 0, sizeof(ed->stats));
+
+    ed->selected_layer = 0;
+    ed->selected_tile = 1;
+    undo_init(&ed->undo, UNDO_BUDGET);
+    ed->tool = TOOL_PAINT;
+    ed->anchor_row = -1;
+    ed->anchor_col = -1;
+    ed->drag_row = -1;
+    ed->drag_col = -1;
+    ed->motion = 0;
+    memset(&ed->stamp, 0, sizeof(ed->stamp));
+    ed->anim_chunks = NULL;
+    ed->anim_chunk_count = 0;
+    ed->anim_cols = 0;
+    ed->anim_rows = 0;
+    memset(&ed->lod, 0, sizeof(ed->lod));
+    ed->minimap = 1;
+
+    ed->running = SDL_TRUE;
+
+    return 0;
+}
+/* free the lod levels and their page textures */
+void lod_free(struct Lod *lod)
+{
+    for(int l = 0; l < lod->levels; l++) {
+        struct LodLevel *lv = &lod->level[l];
+
+        for(int i = 0; i < lv->page_cols * lv->page_rows; i++) {
+            SDL_DestroyTexture(lv->pages[i].texture);
+        }
+        free(lv->pages);
+        free(lv->pixels);
+    }
+
+    free(lod->stale);
+    memset(lod, 0, sizeof(*lod));
+}
+
+/* set editor running to false and quit sdl */
+int quit_editor(struct Editor *ed)
+{
+    for(int i = 0; i < ed->batch_count; i++) {
+        free(ed->batches[i].vertices);
+    }
+    free(ed->batches);
+    free(ed->indices);
+
+    for(int i = 0; i < ed->cache_layers; i++) {
+        SDL_DestroyTexture(ed->layer_cache[i].texture);
+    }
+    free(ed->layer_cache);
+    undo_free(&ed->undo);
+    free(ed->stamp.tiles);
+    for(int i = 0; i < ed->anim_chunk_count; i++) {
+        free(ed->anim_chunks[i].cells);
+    }
+    free(ed->anim_chunks);
+    lod_free(&ed->lod);
+
+    SDL_DestroyRenderer(ed->screen.renderer);
+    SDL_DestroyWindow(ed->screen.window);
+    SDL_Quit();
+    ed->running = SDL_FALSE;
+
+    return 0;
+}
+
+/* init struct map */
+int init_map(struct Map *map)
+{
+    map->cols = 0;
+    map->rows = 0;
+    map->sprite_width = 0;
+    map->sprite_height = 0;
+    map->layer_count = 0;
+    map->path = NULL;
+    map->layer0 = NULL;
+    map->name = NULL;
+    map->md = NULL;
+    map->layers = NULL;
+    map->mapped = NULL;
+    map->mapped_size = 0;
+    map->chunks = NULL;
+    map->chunk_cols = 0;
+    map->chunk_rows = 0;
+    map->dirty = NULL;
+    map->file = NULL;
+    map->packed = NULL;
+    map->collision = NULL;
+    map->sparse[0] = NULL;
+    map->sparse[1] = NULL;
+    map->trailing = 0;
+    map->autosave = NULL;
+    return 0;
+}
+
+/* allocate clean dirty flags for every chunk of every layer */
+int alloc_dirty(struct Map *mp)
+{
+    free(mp->dirty);
+    mp->dirty = calloc((size_t)mp->layer_count * mp->chunk_rows * mp->chunk_cols, sizeof(uint8_t));
+
+    if(mp->dirty == NULL) {
+        error_msg();
+    }
+
+    return 0;
+}
+
+/* allocate memory for layers in map and set to 0 */
+/* all layers share one contiguous buffer, see struct Map */
+int alloc_layers(struct Map *mp) 
+{
+    verbose_print("allocating layers... ");
+    mp->layers = calloc((size_t)mp->layer_count * mp->rows * mp->cols, sizeof(uint16_t));
+
+    if(mp->layers == NULL) {
+        error_msg();
+    }
+
+    alloc_dirty(mp);
+
+    verbose_print("OK\n");
+    return 0;
+}
+
+/* store v as a LEB128 varint, returns the number of bytes used */
+static inline int put_varint(uint8_t *p, uint32_t v)
+{
+    int n = 0;
+
+    while(v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+
+    return n;
+}
+
+/* read a LEB128 varint at *p, no further than end, and advance *p */
+/* returns -1 when it runs past end */
+static inline int get_varint(const uint8_t **p, const uint8_t *end, uint32_t *v)
+{
+    uint32_t val = 0;
+
+    for(int shift = 0; *p < end && shift < 35; shift += 7) {
+        uint8_t b = *(*p)++;
+
+        val |= (uint32_t)(b & 0x7F) << shift;
+        if(!(b & 0x80)) {
+            *v = val;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* run length encode w x h cells, rows stride apart, returns the bytes used
+ * each run of equal ids is a varint length and the zigzag varint delta of
+ * its id from the id of the run before, so long runs and ids close to each
+ * other cost a few bytes. out must hold 6 bytes per cell */
+size_t rle_encode(const uint16_t *cells, int w, int h, int stride, uint8_t *out)
+{
+    uint8_t *p = out;
+    int prev = 0;
+    int cur = 0;
+    uint32_t run = 0;
+
+    for(int r = 0; r < h; r++) {
+        const uint16_t *row = cells + (size_t)r * stride;
+
+        for(int c = 0; c < w; c++) {
+            if(run > 0 && row[c] == cur) {
+                run++;
+                continue;
+            }
+
+            if(run > 0) {
+                int d = cur - prev;
+
+                p += put_varint(p, run);
+                p += put_varint(p, ((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+                prev = cur;
+            }
+            cur = row[c];
+            run = 1;
+        }
+    }
+
+    if(run > 0) {
+        int d = cur - prev;
+
+        p += put_varint(p, run);
+        p += put_varint(p, ((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+    }
+
+    return p - out;
+}
+
+/* decode w x h cells encoded by rle_encode from p, no further than end
+ * returns where the encoding ended or NULL when it is malformed */
+const uint8_t *rle_decode(const uint8_t *p, const uint8_t *end, uint16_t *cells, int w, int h, int stride)
+{
+    int n = w * h;
+    int prev = 0;
+    int i = 0;
+
+    while(i < n) {
+        uint32_t run = 0;
+        uint32_t zz = 0;
+        int id = 0;
+
+        if(get_varint(&p, end, &run) != 0 || get_varint(&p, end, &zz) != 0 ||
+                run == 0 || run > (uint32_t)(n - i)) {
+            return NULL;
+        }
+
+        id = prev + (int)((zz >> 1) ^ -(zz & 1));
+        if(id < 0 || id > UINT16_MAX) {
+            return NULL;
+        }
+
+        /* a run is filled a row piece at a time */
+        while(run > 0) {
+            int c = i % w;
+            int k = (int)run < w - c ? (int)run : w - c;
+            uint16_t *dst = cells + (size_t)(i / w) * stride + c;
+
+            for(int j = 0; j < k; j++) {
+                dst[j] = id;
+            }
+            i += k;
+            run -= k;
+        }
+        prev = id;
+    }
+
+    return p;
+}
+
+/* bytes of a whole chunk, every layer, as it is held and in the work file */
+static inline size_t chunk_bytes(const struct Map *mp)
+{
+    return (size_t)mp->layer_count * CHUNK_SIZE * CHUNK_SIZE * sizeof(uint16_t);
+}
+
+/* exit with errno when a pread or pwrite moved n bytes instead of len */
+void check_io(ssize_t n, size_t len)
+{
+    if(n != (ssize_t)len) {
+        if(n >= 0) {
+            errno = EIO;
+        }
+        error_msg();
+    }
+}
+
+/* the place of chunk c in the work file, given the first time the chunk
+ * is written back, the work file is created then. not thread safe, give
+ * chunks their slot before writing them back in parallel */
+off_t chunk_slot(const struct Map *mp, const struct Chunk *c)
+{
+    struct ChunkStore *cs = mp->chunks;
+    int i = c->cy * cs->chunk_cols + c->cx;
+
+    if(cs->work_fd == -1) {
+        cs->work_fd = open(cs->work, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+        if(cs->work_fd == -1) {
+            error_msg();
+        }
+    }
+
+    if(cs->slot[i] == -1) {
+        cs->slot[i] = cs->slot_count++;
+    }
+
+    return (off_t)cs->slot[i] * chunk_bytes(mp);
+}
+
+/* read or write the part of chunk c that lies inside the map */
+/* a chunk written back goes whole to its slot in the work file and is read
+ * from there after. else it is read from the map file, one pread per chunk
+ * row of each layer, rows of a layer are cols apart in the file */
+void chunk_io(const struct Map *mp, struct Chunk *c, int write_back)
+{
+    struct ChunkStore *cs = mp->chunks;
+    int x0 = c->cx * CHUNK_SIZE;
+    int y0 = c->cy * CHUNK_SIZE;
+    int w = (mp->cols - x0 < CHUNK_SIZE) ? mp->cols - x0 : CHUNK_SIZE;
+    int h = (mp->rows - y0 < CHUNK_SIZE) ? mp->rows - y0 : CHUNK_SIZE;
+    size_t len = w * sizeof(uint16_t);
+
+    /* a store without a file starts its chunks empty and never writes them */
+    if(cs->fd == -1) {
+        if(!write_back) {
+            memset(c->tiles, 0, chunk_bytes(mp));
+        }
+        return;
+    }
+
+    PROF_BEGIN(t);
+    if(write_back) {
+        check_io(pwrite(cs->work_fd, c->tiles, chunk_bytes(mp), chunk_slot(mp, c)), chunk_bytes(mp));
+    } else if(cs->slot[c->cy * cs->chunk_cols + c->cx] != -1) {
+        check_io(pread(cs->work_fd, c->tiles, chunk_bytes(mp), chunk_slot(mp, c)), chunk_bytes(mp));
+    } else {
+        for(int l = 0; l < mp->layer_count; l++) {
+            for(int r = 0; r < h; r++) {
+                uint16_t *dst = c->tiles + ((size_t)l * CHUNK_SIZE + r) * CHUNK_SIZE;
+                off_t off = cs->data_offset +
+                    (off_t)((((size_t)l * mp->rows + y0 + r) * mp->cols + x0) * sizeof(uint16_t));
+
+                check_io(pread(cs->fd, dst, len, off), len);
+            }
+        }
+    }
+    PROF_END(t, write_back ? "chunk_write" : "chunk_read");
+}
+
+/* unlink chunk from lru list */
+void chunk_lru_remove(struct ChunkStore *cs, struct Chunk *c)
+{
+    if(c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        cs->lru_head = c->next;
+    }
+
+    if(c->next != NULL) {
+        c->next->prev = c->prev;
+    } else {
+        cs->lru_tail = c->prev;
+    }
+
+    c->prev = NULL;
+    c->next = NULL;
+}
+
+/* put chunk first in lru list */
+void chunk_lru_push(struct ChunkStore *cs, struct Chunk *c)
+{
+    c->prev = NULL;
+    c->next = cs->lru_head;
+
+    if(cs->lru_head != NULL) {
+        cs->lru_head->prev = c;
+    }
+
+    cs->lru_head = c;
+
+    if(cs->lru_tail == NULL) {
+        cs->lru_tail = c;
+    }
+}
+
+int chunk_hash(const struct ChunkStore *cs, int cx, int cy)
+{
+    return (int)(((unsigned int)cy * 73856093u ^ (unsigned int)cx * 19349663u) % cs->hash_size);
+}
+
+/* keep an encoded copy of chunk c in the cold store while it fits */
+/* every layer is encoded in turn, only the part inside the map */
+void chunk_freeze(const struct Map *mp, struct Chunk *c)
+{
+    struct ChunkStore *cs = mp->chunks;
+    int i = c->cy * cs->chunk_cols + c->cx;
+    int w = (mp->cols - c->cx * CHUNK_SIZE < CHUNK_SIZE) ? mp->cols - c->cx * CHUNK_SIZE : CHUNK_SIZE;
+    int h = (mp->rows - c->cy * CHUNK_SIZE < CHUNK_SIZE) ? mp->rows - c->cy * CHUNK_SIZE : CHUNK_SIZE;
+    size_t len = 0;
+
+    if(cs->cold_budget == 0) {
+        return;
+    }
+
+    for(int l = 0; l < mp->layer_count; l++) {
+        len += rle_encode(c->tiles + (size_t)l * CHUNK_SIZE * CHUNK_SIZE, w, h, CHUNK_SIZE, cs->scratch + len);
+    }
+
+    if(cs->cold_bytes + len > cs->cold_budget) {
+        return;
+    }
+
+    cs->cold[i] = malloc(len);
+
+    if(cs->cold[i] == NULL) {
+        error_msg();
+    }
+
+    memcpy(cs->cold[i], cs->scratch, len);
+    cs->cold_len[i] = len;
+    cs->cold_bytes += len;
+}
+
+/* fill chunk c from its copy in the cold store and drop the copy */
+/* returns -1 when there is none */
+int chunk_thaw(const struct Map *mp, struct Chunk *c)
+{
+    struct ChunkStore *cs = mp->chunks;
+    int i = c->cy * cs->chunk_cols + c->cx;
+    int w = (mp->cols - c->cx * CHUNK_SIZE < CHUNK_SIZE) ? mp->cols - c->cx * CHUNK_SIZE : CHUNK_SIZE;
+    int h = (mp->rows - c->cy * CHUNK_SIZE < CHUNK_SIZE) ? mp->rows - c->cy * CHUNK_SIZE : CHUNK_SIZE;
+    const uint8_t *p = cs->cold[i];
+    const uint8_t *end = p + cs->cold_len[i];
+
+    if(p == NULL) {
+        return -1;
+    }
+
+    for(int l = 0; l < mp->layer_count && p != NULL; l++) {
+        p = rle_decode(p, end, c->tiles + (size_t)l * CHUNK_SIZE * CHUNK_SIZE, w, h, CHUNK_SIZE);
+    }
+
+    free(cs->cold[i]);
+    cs->cold[i] = NULL;
+    cs->cold_bytes -= cs->cold_len[i];
+
+    /* the copy was encoded here, it can only be damaged by a bug */
+    if(p == NULL) {
+        fprintf(stderr, "chunk %d,%d: bad cold copy\n", c->cx, c->cy);
+        return -1;
+    }
+
+    cs->cold_hits++;
+    return 0;
+}
+
+/* drop chunk from hash table, writing it back first when dirty */
+/* it moves to the cold store when there is room */
+void chunk_evict(const struct Map *mp, struct Chunk *c)
+{
+    struct ChunkStore *cs = mp->chunks;
+    struct Chunk **link = &cs->hash[chunk_hash(cs, c->cx, c->cy)];
+
+    if(c->dirty) {
+        chunk_io(mp, c, 1);
+        c->dirty = 0;
+        cs->writebacks++;
+    }
+    chunk_freeze(mp, c);
+
+    while(*link != c) {
+        link = &(*link)->hash_next;
+    }
+
+    *link = c->hash_next;
+    c->hash_next = NULL;
+    cs->resident--;
+    cs->evictions++;
+}
+
+/* resident chunk cx, cy or NULL, never loads and leaves the lru order */
+struct Chunk *chunk_find(const struct Map *mp, int cx, int cy)
+{
+    struct ChunkStore *cs = mp->chunks;
+    struct Chunk *c = cs->hash[chunk_hash(cs, cx, cy)];
+
+    while(c != NULL && (c->cx != cx || c->cy != cy)) {
+        c = c->hash_next;
+    }
+
+    return c;
+}
+
+/* get resident chunk cx, cy, reading it from the map file when needed */
+/* a returned chunk stays valid until the next chunk_get that has to load */
+struct Chunk *chunk_get(const struct Map *mp, int cx, int cy)
+{
+    struct ChunkStore *cs = mp->chunks;
+    int h = chunk_hash(cs, cx, cy);
+    struct Chunk *c = chunk_find(mp, cx, cy);
+
+    if(c != NULL) {
+        if(c != cs->lru_head) {
+            chunk_lru_remove(cs, c);
+            chunk_lru_push(cs, c);
+        }
+        return c;
+    }
+
+    /* take a free slot, or evict the least recently used chunk */
+    if(cs->resident < cs->capacity) {
+        c = &cs->slots[cs->resident];
+    } else {
+        c = cs->lru_tail;
+        chunk_evict(mp, c);
+        chunk_lru_remove(cs, c);
+    }
+
+    c->cx = cx;
+    c->cy = cy;
+    if(chunk_thaw(mp, c) != 0) {
+        chunk_io(mp, c, 0);
+    }
+    c->filled = cs->fd != -1;
+    c->hash_next = cs->hash[h];
+    cs->hash[h] = c;
+    chunk_lru_push(cs, c);
+    cs->resident++;
+    cs->loads++;
+
+    return c;
+}
+
+/* index of a cell in the flat layer store */
+static inline size_t tile_index(const struct Map *mp, int layer, int row, int col)
+{
+    return ((size_t)layer * mp->rows + row) * mp->cols + col;
+}
+
+/* pointer to a cell of a streamed map, inside its resident chunk */
+static inline uint16_t *chunk_cell(const struct Map *mp, int layer, int row, int col)
+{
+    struct Chunk *c = chunk_get(mp, col / CHUNK_SIZE, row / CHUNK_SIZE);
+
+    return c->tiles + ((size_t)layer * CHUNK_SIZE + row % CHUNK_SIZE) * CHUNK_SIZE + col % CHUNK_SIZE;
+}
+
+/* get tile id at layer, row, col */
+static inline uint16_t get_tile(const struct Map *mp, int layer, int row, int col)
+{
+    if(mp->layers != NULL) {
+        return mp->layers[tile_index(mp, layer, row, col)];
+    }
+
+    return *chunk_cell(mp, layer, row, col);
+}
+
+/* index of the dirty flags of the chunk holding row, col of layer */
+static inline size_t dirty_index(const struct Map *mp, int layer, int row, int col)
+{
+    return ((size_t)layer * mp->chunk_rows + row / CHUNK_SIZE) * mp->chunk_cols + col / CHUNK_SIZE;
+}
+
+/* set flags on every chunk of layer overlapping the tile rect
+ * for writers that fill tile_span or layer_data directly instead of using
+ * set_tile. the chunks of a streamed map are also marked for write back
+ * and must still be resident, mark right after writing */
+void mark_dirty(struct Map *mp, int layer, SDL_Rect rect, uint8_t flags)
+{
+    if(mp->chunks != NULL && rect.w > 0 && rect.h > 0) {
+        for(int cy = rect.y / CHUNK_SIZE; cy <= (rect.y + rect.h - 1) / CHUNK_SIZE; cy++) {
+            for(int cx = rect.x / CHUNK_SIZE; cx <= (rect.x + rect.w - 1) / CHUNK_SIZE; cx++) {
+                chunk_get(mp, cx, cy)->dirty = 1;
+            }
+        }
+    }
+
+    if(mp->dirty == NULL || rect.w <= 0 || rect.h <= 0) {
+        return;
+    }
+
+    for(int cy = rect.y / CHUNK_SIZE; cy <= (rect.y + rect.h - 1) / CHUNK_SIZE; cy++) {
+        for(int cx = rect.x / CHUNK_SIZE; cx <= (rect.x + rect.w - 1) / CHUNK_SIZE; cx++) {
+            mp->dirty[((size_t)layer * mp->chunk_rows + cy) * mp->chunk_cols + cx] |= flags;
+        }
+    }
+}
+
+/* position of the first key not less than key */
+static inline int sparse_lower_bound(const struct SparseLayer *sl, uint32_t key)
+{
+    int lo = 0;
+    int hi = sl->count;
+
+    while(lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if(sl->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* note that keys key..key+len-1 changed, writes are only collected here
+ * and merged into the index in one pass by map_sparse when it is read,
+ * so a fill costs one move of the entries instead of one per row */
+void sparse_mark(struct SparseLayer *sl, uint32_t key, uint32_t len)
+{
+    struct SparseRun *last = sl->run_count > 0 ? &sl->runs[sl->run_count - 1] : NULL;
+
+    /* a brush going over the same cells or a fill going along a row */
+    if(last != NULL && key >= last->key && key <= last->key + last->len) {
+        if(key + len > last->key + last->len) {
+            last->len = key + len - last->key;
+        }
+        return;
+    }
+
+    if(sl->run_count == sl->run_capacity) {
+        sl->run_capacity = sl->run_capacity > 0 ? sl->run_capacity * 2 : 64;
+        sl->runs = realloc(sl->runs, sl->run_capacity * sizeof(struct SparseRun));
+
+        if(sl->runs == NULL) {
+            error_msg();
+        }
+    }
+
+    sl->runs[sl->run_count].key = key;
+    sl->runs[sl->run_count].len = len;
+    sl->run_count++;
+}
+
+/* the sparse index of layer, NULL when layer is not sparse or not indexed yet */
+static inline struct SparseLayer *sparse_of(const struct Map *mp, int layer)
+{
+    return (layer == OBJECT_LAYER || layer == EVENT_LAYER) ? mp->sparse[layer - OBJECT_LAYER] : NULL;
+}
+
+/* set or clear the bit of row, col */
+static inline void collision_set(struct Collision *c, int row, int col, int solid)
+{
+    uint64_t *word = c->bits + (size_t)row * c->stride + col / 64;
+    uint64_t bit = (uint64_t)1 << (col % 64);
+
+    *word = solid ? *word | bit : *word & ~bit;
+}
+
+/* copy chunk i of the dirty flags, of a map in a flat layer store, into
+ * the snapshot of autosave as and clear its DIRTY_SNAPSHOT */
+void snapshot_chunk(struct Autosave *as, struct Map *mp, size_t i)
+{
+    size_t per_layer = (size_t)mp->chunk_rows * mp->chunk_cols;
+    int layer = i / per_layer;
+    int cy = (i % per_layer) / mp->chunk_cols;
+    int cx = i % mp->chunk_cols;
+    int len = mp->cols - cx * CHUNK_SIZE < CHUNK_SIZE ? mp->cols - cx * CHUNK_SIZE : CHUNK_SIZE;
+    uint16_t *dst = as->tiles + (size_t)as->count * CHUNK_SIZE * CHUNK_SIZE;
+
+    mp->dirty[i] &= ~DIRTY_SNAPSHOT;
+
+    if(as->count == as->capacity) {
+        return;
+    }
+
+    as->chunks[as->count].layer = layer;
+    as->chunks[as->count].cx = cx;
+    as->chunks[as->count].cy = cy;
+    as->count++;
+
+    for(int r = 0; r < CHUNK_SIZE && cy * CHUNK_SIZE + r < mp->rows; r++) {
+        memcpy(dst + (size_t)r * CHUNK_SIZE, mp->layers + tile_index(mp, layer, cy * CHUNK_SIZE + r, cx * CHUNK_SIZE),
+                len * sizeof(uint16_t));
+    }
+}
+
+/* copy the chunks of layer from row, col0 to col1 that the autosave still
+ * has to copy, before they are written */
+static inline void snapshot_before_write(struct Map *mp, int layer, int row, int col0, int col1)
+{
+    if(mp->autosave == NULL) {
+        return;
+    }
+
+    for(int cx = col0 / CHUNK_SIZE; cx <= col1 / CHUNK_SIZE; cx++) {
+        size_t i = dirty_index(mp, layer, row, cx * CHUNK_SIZE);
+
+        if(mp->dirty[i] & DIRTY_SNAPSHOT) {
+            snapshot_chunk(mp->autosave, mp, i);
+        }
+    }
+}
+
+/* set tile id at layer, row, col */
+static inline void set_tile(struct Map *mp, int layer, int row, int col, uint16_t id)
+{
+    if(layer == COLLISION_LAYER && mp->collision != NULL) {
+        collision_set(mp->collision, row, col, id != 0);
+    } else if(sparse_of(mp, layer) != NULL) {
+        sparse_mark(sparse_of(mp, layer), (uint32_t)row * mp->cols + col, 1);
+    }
+
+    if(mp->layers != NULL) {
+        snapshot_before_write(mp, layer, row, col, col);
+        mp->layers[tile_index(mp, layer, row, col)] = id;
+        mp->dirty[dirty_index(mp, layer, row, col)] |= DIRTY_EDIT;
+        return;
+    }
+
+    chunk_get(mp, col / CHUNK_SIZE, row / CHUNK_SIZE)->dirty = 1;
+    *chunk_cell(mp, layer, row, col) = id;
+    mp->dirty[dirty_index(mp, layer, row, col)] |= DIRTY_EDIT;
+}
+
+/* pointer to the first cell of a layer, rows * cols ids follow */
+/* only for maps held in a flat layer store, see tile_span */
+static inline uint16_t *layer_data(const struct Map *mp, int layer)
+{
+    return mp->layers + (size_t)layer * mp->rows * mp->cols;
+}
+
+/* pointer to row, col of layer and the number of cells that follow it
+ * contiguously in the same row, up to the end of the row in a flat store
+ * or to the end of the chunk row in a streamed map.
+ * lets a row be walked with one lookup per span instead of one per cell */
+static inline uint16_t *tile_span(const struct Map *mp, int layer, int row, int col, int *len)
+{
+    if(mp->layers != NULL) {
+        *len = mp->cols - col;
+        return mp->layers + tile_index(mp, layer, row, col);
+    }
+
+    *len = CHUNK_SIZE - col % CHUNK_SIZE;
+    if(*len > mp->cols - col) {
+        *len = mp->cols - col;
+    }
+
+    return chunk_cell(mp, layer, row, col);
+}
+
+/* copy cells col..col+len-1 of row of the collision layer into the bitset */
+/* for writers that fill tile_span directly instead of using set_tile */
+void collision_sync(struct Map *mp, int row, int col, int len)
+{
+    struct Collision *c = mp->collision;
+
+    while(c != NULL && len > 0) {
+        int n = 0;
+        const uint16_t *cell = tile_span(mp, COLLISION_LAYER, row, col, &n);
+
+        n = n > len ? len : n;
+        for(int i = 0; i < n; i++) {
+            collision_set(c, row, col + i, cell[i] != 0);
+        }
+        col += n;
+        len -= n;
+    }
+}
+
+/* the collision bitset of map, built from COLLISION_LAYER on first use */
+/* NULL when the map has no collision layer */
+struct Collision *map_collision(struct Map *mp)
+{
+    struct Collision *c = mp->collision;
+
+    if(c != NULL || mp->layer_count <= COLLISION_LAYER) {
+        return c;
+    }
+
+    c = calloc(1, sizeof(struct Collision));
+
+    if(c == NULL) {
+        error_msg();
+    }
+
+    c->cols = mp->cols;
+    c->rows = mp->rows;
+    c->stride = (mp->cols + 63) / 64;
+    c->bits = calloc((size_t)c->stride * c->rows, sizeof(uint64_t));
+
+    if(c->bits == NULL) {
+        error_msg();
+    }
+
+    /* 64 cells make one word, a row is walked a span at a time and a word
+     * is stored once it is complete */
+    PROF_BEGIN(t);
+    for(int row = 0; row < mp->rows; row++) {
+        uint64_t *word = c->bits + (size_t)row * c->stride;
+        uint64_t acc = 0;
+        int len = 0;
+
+        for(int col = 0; col < mp->cols; col += len) {
+            const uint16_t *cell = tile_span(mp, COLLISION_LAYER, row, col, &len);
+
+            for(int i = 0; i < len; i++) {
+                int b = col + i;
+
+                acc |= (uint64_t)(cell[i] != 0) << (b % 64);
+                if(b % 64 == 63 || b == mp->cols - 1) {
+                    word[b / 64] = acc;
+                    acc = 0;
+                }
+            }
+        }
+    }
+    PROF_END(t, "collision_build");
+
+    mp->collision = c;
+    return c;
+}
+
+/* mask of the bits of word w that lie in col0..col1 */
+static inline uint64_t collision_mask(int w, int col0, int col1)
+{
+    uint64_t mask = ~(uint64_t)0;
+
+    if(w == col0 / 64) {
+        mask &= ~(uint64_t)0 << (col0 % 64);
+    }
+    if(w == col1 / 64 && col1 % 64 != 63) {
+        mask &= ((uint64_t)1 << (col1 % 64 + 1)) - 1;
+    }
+
+    return mask;
+}
+
+/* is the tile at row, col solid, tiles off the map are not */
+static inline int collision_at(const struct Collision *c, int row, int col)
+{
+    if(row < 0 || row >= c->rows || col < 0 || col >= c->cols) {
+        return 0;
+    }
+
+    return (c->bits[(size_t)row * c->stride + col / 64] >> (col % 64)) & 1;
+}
+
+/* number of solid tiles inside the tile rect */
+long collision_count(const struct Collision *c, SDL_Rect rect)
+{
+    SDL_Rect all = { 0, 0, c->cols, c->rows };
+    long count = 0;
+
+    if(!SDL_IntersectRect(&rect, &all, &rect)) {
+        return 0;
+    }
+
+    for(int row = rect.y; row < rect.y + rect.h; row++) {
+        const uint64_t *word = c->bits + (size_t)row * c->stride;
+        int col1 = rect.x + rect.w - 1;
+
+        for(int w = rect.x / 64; w <= col1 / 64; w++) {
+            count += __builtin_popcountll(word[w] & collision_mask(w, rect.x, col1));
+        }
+    }
+
+    return count;
+}
+
+/* does any solid tile lie inside the tile rect */
+int collision_overlap(const struct Collision *c, SDL_Rect rect)
+{
+    SDL_Rect all = { 0, 0, c->cols, c->rows };
+
+    if(!SDL_IntersectRect(&rect, &all, &rect)) {
+        return 0;
+    }
+
+    for(int row = rect.y; row < rect.y + rect.h; row++) {
+        const uint64_t *word = c->bits + (size_t)row * c->stride;
+        int col1 = rect.x + rect.w - 1;
+
+        for(int w = rect.x / 64; w <= col1 / 64; w++) {
+            if(word[w] & collision_mask(w, rect.x, col1)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* does the box of x, y, w, h pixels overlap a solid tile */
+int collision_box(struct Map *mp, SDL_Rect box)
+{
+    const struct Collision *c = map_collision(mp);
+    SDL_Rect rect;
+
+    if(c == NULL || box.w <= 0 || box.h <= 0 || box.x + box.w <= 0 || box.y + box.h <= 0) {
+        return 0;
+    }
+
+    box.w += box.x < 0 ? box.x : 0;
+    box.h += box.y < 0 ? box.y : 0;
+    box.x = box.x < 0 ? 0 : box.x;
+    box.y = box.y < 0 ? 0 : box.y;
+    rect.x = box.x / mp->tile_width;
+    rect.y = box.y / mp->tile_height;
+    rect.w = (box.x + box.w - 1) / mp->tile_width - rect.x + 1;
+    rect.h = (box.y + box.h - 1) / mp->tile_height - rect.y + 1;
+
+    return collision_overlap(c, rect);
+}
+
+/* first solid column of row from col0 towards col1, either direction */
+/* returns -1 when there is none, whole words without a solid tile are skipped */
+int collision_scan_row(const struct Collision *c, int row, int col0, int col1)
+{
+    const uint64_t *word = NULL;
+    int lo = col0 < col1 ? col0 : col1;
+    int hi = col0 < col1 ? col1 : col0;
+
+    if(row < 0 || row >= c->rows || hi < 0 || lo >= c->cols) {
+        return -1;
+    }
+
+    lo = lo < 0 ? 0 : lo;
+    hi = hi >= c->cols ? c->cols - 1 : hi;
+    word = c->bits + (size_t)row * c->stride;
+
+    if(col0 <= col1) {
+        for(int w = lo / 64; w <= hi / 64; w++) {
+            uint64_t bits = word[w] & collision_mask(w, lo, hi);
+
+            if(bits != 0) {
+                return w * 64 + __builtin_ctzll(bits);
+            }
+        }
+    } else {
+        for(int w = hi / 64; w >= lo / 64; w--) {
+            uint64_t bits = word[w] & collision_mask(w, lo, hi);
+
+            if(bits != 0) {
+                return w * 64 + 63 - __builtin_clzll(bits);
+            }
+        }
+    }
+
+    return -1;
+}
+
+/* walk the segment from x0, y0 to x1, y1 in pixels tile by tile and find
+ * the first solid tile it enters, its row and col are stored in hit.
+ * returns 1 on a hit, 0 when the segment is clear.
+ * horizontal segments scan the row a word at a time, others step through
+ * the tiles the segment crosses in order (a DDA over the tile grid) */
+int collision_segment(struct Map *mp, double x0, double y0, double x1, double y1, SDL_Point *hit)
+{
+    const struct Collision *c = map_collision(mp);
+    double tx0 = x0 / mp->tile_width;
+    double ty0 = y0 / mp->tile_height;
+    double tx1 = x1 / mp->tile_width;
+    double ty1 = y1 / mp->tile_height;
+    double dx = tx1 - tx0;
+    double dy = ty1 - ty0;
+    int col = (int)floor(tx0);
+    int row = (int)floor(ty0);
+    int end_col = (int)floor(tx1);
+    int end_row = (int)floor(ty1);
+    int step_x = dx > 0 ? 1 : -1;
+    int step_y = dy > 0 ? 1 : -1;
+    double next_x = 0;
+    double next_y = 0;
+    double delta_x = 0;
+    double delta_y = 0;
+
+    if(c == NULL) {
+        return 0;
+    }
+
+    if(row == end_row) {
+        int found = collision_scan_row(c, row, col, end_col);
+
+        if(found == -1) {
+            return 0;
+        }
+        hit->x = found;
+        hit->y = row;
+        return 1;
+    }
+
+    /* distance along the segment, as a fraction of it, to the next
+     * column and row boundary and between two of them */
+    delta_x = dx != 0 ? fabs(1.0 / dx) : INFINITY;
+    delta_y = fabs(1.0 / dy);
+    next_x = dx != 0 ? (dx > 0 ? col + 1 - tx0 : tx0 - col) * delta_x : INFINITY;
+    next_y = (dy > 0 ? row + 1 - ty0 : ty0 - row) * delta_y;
+
+    /* the segment crosses one tile per boundary plus the one it starts in */
+    for(int n = abs(end_col - col) + abs(end_row - row); n >= 0; n--) {
+        if(collision_at(c, row, col)) {
+            hit->x = col;
+            hit->y = row;
+            return 1;
+        }
+
+        if(next_x < next_y) {
+            col += step_x;
+            next_x += delta_x;
+        } else {
+            row += step_y;
+            next_y += delta_y;
+        }
+    }
+
+    return 0;
+}
+
+static int sparse_run_order(const void *a, const void *b)
+{
+    uint32_t ka = ((const struct SparseRun *)a)->key;
+    uint32_t kb = ((const struct SparseRun *)b)->key;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+/* append one entry to keys and ids, growing them as needed */
+static void sparse_push(uint32_t **keys, uint16_t **ids, int *count, int *capacity, uint32_t key, uint16_t id)
+{
+    if(*count == *capacity) {
+        *capacity = *capacity > 0 ? *capacity * 2 : 64;
+        *keys = realloc(*keys, *capacity * sizeof(uint32_t));
+        *ids = realloc(*ids, *capacity * sizeof(uint16_t));
+
+        if(*keys == NULL || *ids == NULL) {
+            error_msg();
+        }
+    }
+
+    (*keys)[*count] = key;
+    (*ids)[*count] = id;
+    (*count)++;
+}
+
+/* merge the runs written since the last merge into the index of layer.
+ * the runs are sorted and joined, then the old entries between them and
+ * the cells of the layer inside them are copied into new arrays in one
+ * pass, whatever the number of runs */
+void sparse_merge(struct Map *mp, int layer, struct SparseLayer *sl)
+{
+    uint32_t *keys = NULL;
+    uint16_t *ids = NULL;
+    int count = 0;
+    int capacity = sl->count;
+    int runs = 0;
+    int next = 0;
+
+    if(sl->run_count == 0) {
+        return;
+    }
+
+    PROF_BEGIN(t);
+    qsort(sl->runs, sl->run_count, sizeof(struct SparseRun), sparse_run_order);
+    for(int i = 0; i < sl->run_count; i++) {
+        struct SparseRun *last = runs > 0 ? &sl->runs[runs - 1] : NULL;
+
+        if(last != NULL && sl->runs[i].key <= last->key + last->len) {
+            if(sl->runs[i].key + sl->runs[i].len > last->key + last->len) {
+                last->len = sl->runs[i].key + sl->runs[i].len - last->key;
+            }
+        } else {
+            sl->runs[runs++] = sl->runs[i];
+        }
+    }
+
+    if(capacity > 0) {
+        keys = malloc(capacity * sizeof(uint32_t));
+        ids = malloc(capacity * sizeof(uint16_t));
+
+        if(keys == NULL || ids == NULL) {
+            error_msg();
+        }
+    }
+
+    for(int i = 0; i < runs; i++) {
+        uint32_t key = sl->runs[i].key;
+        uint32_t end = key + sl->runs[i].len;
+
+        /* entries before the run stay, the ones inside it are replaced */
+        for(; next < sl->count && sl->keys[next] < key; next++) {
+            sparse_push(&keys, &ids, &count, &capacity, sl->keys[next], sl->ids[next]);
+        }
+        for(; next < sl->count && sl->keys[next] < end; next++);
+
+        while(key < end) {
+            int len = 0;
+            const uint16_t *cells = tile_span(mp, layer, key / mp->cols, key % mp->cols, &len);
+
+            if((uint32_t)len > end - key) {
+                len = end - key;
+            }
+
+            for(int c = 0; c < len; c++) {
+                if(cells[c] != 0) {
+                    sparse_push(&keys, &ids, &count, &capacity, key + c, cells[c]);
+                }
+            }
+            key += len;
+        }
+    }
+
+    for(; next < sl->count; next++) {
+        sparse_push(&keys, &ids, &count, &capacity, sl->keys[next], sl->ids[next]);
+    }
+    PROF_END(t, "sparse_merge");
+
+    free(sl->keys);
+    free(sl->ids);
+    sl->keys = keys;
+    sl->ids = ids;
+    sl->count = count;
+    sl->capacity = capacity;
+    sl->run_count = 0;
+}
+
+/* the sparse index of OBJECT_LAYER or EVENT_LAYER, built on first use
+ * and brought up to date with the writes made since it was last read */
+/* NULL for other layers or when the map does not have the layer */
+struct SparseLayer *map_sparse(struct Map *mp, int layer)
+{
+    struct SparseLayer *sl = NULL;
+
+    if((layer != OBJECT_LAYER && layer != EVENT_LAYER) || layer >= mp->layer_count) {
+        return NULL;
+    }
+
+    if(mp->sparse[layer - OBJECT_LAYER] != NULL) {
+        sl = mp->sparse[layer - OBJECT_LAYER];
+        sparse_merge(mp, layer, sl);
+        return sl;
+    }
+
+    sl = calloc(1, sizeof(struct SparseLayer));
+
+    if(sl == NULL) {
+        error_msg();
+    }
+
+    /* the whole layer is one run merged into an empty index */
+    PROF_BEGIN(t);
+    sparse_mark(sl, 0, (uint32_t)mp->rows * mp->cols);
+    sparse_merge(mp, layer, sl);
+    PROF_END(t, "sparse_build");
+
+    mp->sparse[layer - OBJECT_LAYER] = sl;
+    return sl;
+}
+
+/* id at row, col of a sparse layer, 0 when empty */
+uint16_t sparse_get(const struct Map *mp, const struct SparseLayer *sl, int row, int col)
+{
+    uint32_t key = (uint32_t)row * mp->cols + col;
+    int i = sparse_lower_bound(sl, key);
+
+    return (i < sl->count && sl->keys[i] == key) ? sl->ids[i] : 0;
+}
+
+/* tiles of a sparse layer inside the tile rect, up to max are stored in out
+ * returns how many there are, one binary search per row of the rect so
+ * the cost depends on the rect and the tiles in it, not on the map */
+int sparse_rect(const struct Map *mp, const struct SparseLayer *sl, SDL_Rect rect,
+        struct SparseCell *out, int max)
+{
+    SDL_Rect all = { 0, 0, mp->cols, mp->rows };
+    int count = 0;
+
+    if(!SDL_IntersectRect(&rect, &all, &rect)) {
+        return 0;
+    }
+
+    for(int row = rect.y; row < rect.y + rect.h; row++) {
+        uint32_t key = (uint32_t)row * mp->cols + rect.x;
+        int i = sparse_lower_bound(sl, key);
+
+        for(; i < sl->count && sl->keys[i] < key + rect.w; i++) {
+            if(count < max) {
+                out[count].row = row;
+                out[count].col = sl->keys[i] - (uint32_t)row * mp->cols;
+                out[count].id = sl->ids[i];
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* calculate map width and height */
+/* width = tile_width * columns */
+int set_map_dimensions(struct Map *mp)
+{
+    mp->map_width = (mp->tile_width * mp->cols);
+    mp->map_height = (mp->tile_height * mp->rows);
+    mp->chunk_cols = (mp->cols + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    mp->chunk_rows = (mp->rows + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    return 0;
+}
+
+/* calculate total nr of tiles in map */
+void set_tile_count(struct Map *mp)
+{
+    mp->tile_count = (mp->layer_count * mp->rows * mp->cols);
+}
+
+/* create metadata for map struct */
+/* NOTE: tile width and height defaults to same as sprite */
+int create_map(struct Map *mp, int w, int h, int layers, int sw, int sh, const char *name)
+{
+    verbose_print("creating map... \n");
+
+    mp->cols = w;
+    mp->rows = h;
+    mp->layer_count = layers;
+    mp->sprite_width = sw;
+    mp->sprite_height = sh;
+    mp->tile_height = sh;
+    mp->tile_width = sw;
+
+    verbose_print("\tsetting map dimensions...\n");
+    set_map_dimensions(mp);
+    if(verbose == 1) {
+        printf("\tmap.w = %d map.h = %d\n", mp->map_height, mp->map_width);
+        printf("\tOK\n");
+    }
+
+    verbose_print("\tsetting total number of tiles...\n");
+    set_tile_count(mp);
+    if(verbose == 1) {
+        printf("\tmap.tile_count = %d\n", mp->tile_count);
+        printf("\tOK\n");
+    }
+
+
+   
+    mp->name = calloc(strlen(name)+1, sizeof(char));
+
+    if(mp->name == NULL) {
+        fprintf(stderr, "%s\n", strerror(errno));
+        exit(errno);
+    }
+
+    strcpy(mp->name, name);
+
+    return 0;
+}
+/* append string and comma unless cflag is not 1 */
+int append_metadata(char **str, int data, int cflag)
+{
+    char tmp[128];
+
+    sprintf(tmp, "%d", data);
+
+    strcat(*str, tmp);
+
+    if(cflag == 1) {
+        strcat(*str, ",");
+    }
+
+    return 0;
+}
+
+/* build <path><name><suffix>, caller frees */
+char *map_file_name(struct Map *mp, const char *suffix)
+{
+    char *fname = calloc(strlen(mp->path) + strlen(mp->name) + strlen(suffix) + 1, sizeof(char));
+
+    if(fname == NULL) {
+        error_msg();
+    }
+
+    strcpy(fname, mp->path);
+    strcat(fname, mp->name);
+    strcat(fname, suffix);
+
+    return fname;
+}
+
+/* does any chunk of layer carry flag */
+int layer_dirty(const struct Map *mp, int layer, uint8_t flag)
+{
+    size_t n = (size_t)mp->chunk_rows * mp->chunk_cols;
+    const uint8_t *d = mp->dirty + (size_t)layer * n;
+
+    for(size_t i = 0; i < n; i++) {
+        if(d[i] & flag) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* format layer as text, every id followed by a comma and a newline per row */
+/* returns a buffer the caller frees, its length in len */
+char *format_layer(const struct Map *mp, int layer, size_t *len)
+{
+    /* at most 5 digits and a comma per cell */
+    char *buf = malloc((size_t)mp->rows * (mp->cols * 6 + 1));
+    char *p = buf;
+    const uint16_t *cell = layer_data(mp, layer);
+
+    if(buf == NULL) {
+        error_msg();
+    }
+
+    for(int row = 0; row < mp->rows; row++) {
+        for(int col = 0; col < mp->cols; col++) {
+            char digits[5];
+            int n = 0;
+            unsigned int v = *cell++;
+
+            do {
+                digits[n++] = '0' + v % 10;
+                v /= 10;
+            } while(v != 0);
+
+            while(n > 0) {
+                *p++ = digits[--n];
+            }
+            *p++ = ',';
+        }
+        *p++ = '\n';
+    }
+
+    *len = p - buf;
+    return buf;
+}
+
+/* encode a sparse layer as a sparse layer file, see struct SparseHeader */
+/* returns a buffer the caller frees, its length in len */
+char *format_sparse(struct Map *mp, int layer, size_t *len)
+{
+    const struct SparseLayer *sl = map_sparse(mp, layer);
+    struct SparseHeader hdr;
+    uint32_t prev = 0;
+    /* a key delta takes at most 5 bytes and an id 3 */
+    uint8_t *buf = malloc(sizeof(hdr) + (size_t)sl->count * 8);
+    uint8_t *p = buf + sizeof(hdr);
+
+    if(buf == NULL) {
+        error_msg();
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SPARSE_MAGIC, sizeof(hdr.magic));
+    hdr.version = SPARSE_VERSION;
+    hdr.byte_order = MAP_BYTE_ORDER;
+    hdr.cols = mp->cols;
+    hdr.rows = mp->rows;
+    hdr.count = sl->count;
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    for(int i = 0; i < sl->count; i++) {
+        p += put_varint(p, sl->keys[i] - prev);
+        p += put_varint(p, sl->ids[i]);
+        prev = sl->keys[i];
+    }
+
+    *len = p - buf;
+    return (char *)buf;
+}
+
+/* write one layer to its text layer file, a pool job over LayerFiles.
+ * a text layer can not be patched so a changed layer is written whole,
+ * with one write to a temporary file that replaces the old one */
+void save_layer_job(void *ctx, int i)
+{
+    struct LayerFile *lf = (struct LayerFile *)ctx + i;
+    struct Map *mp = lf->mp;
+    size_t chunks = (size_t)mp->chunk_rows * mp->chunk_cols;
+    Uint64 start = SDL_GetPerformanceCounter();
+    struct iovec iov;
+    char suffix[32];
+    size_t len = 0;
+    char *buf = NULL;
+
+    /* create file name for layer file */
+    /* /path/name_<layer>.lr, .lrs for the sparse layers */
+    sprintf(suffix, map_sparse(mp, lf->layer) != NULL ? "_%d.lrs" : "_%d.lr", lf->layer);
+    lf->fname = map_file_name(mp, suffix);
+
+    PROF_BEGIN(t);
+    buf = map_sparse(mp, lf->layer) != NULL ? format_sparse(mp, lf->layer, &len) : format_layer(mp, lf->layer, &len);
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    lf->bytes = write_file_atomic(lf->fname, &iov, 1) == 0 ? (long)len : -1;
+    PROF_END(t, "save_layer");
+
+    free(buf);
+
+    /* every job clears the flags of its own layer only */
+    if(lf->bytes >= 0) {
+        for(size_t c = 0; c < chunks; c++) {
+            mp->dirty[(size_t)lf->layer * chunks + c] &= ~DIRTY_SAVE;
+        }
+    }
+    lf->msec = elapsed_sec(start) * 1000.0;
+}
+
+/* print the files of a parallel load or save with their size and time
+ * returns the total bytes or -1 when any file failed */
+long layer_files_done(struct LayerFile *files, int count)
+{
+    long total = 0;
+
+    for(int i = 0; i < count; i++) {
+        if(verbose == 1 && files[i].bytes >= 0) {
+            printf("\t%s %ld bytes %.3f ms\n", files[i].fname, files[i].bytes, files[i].msec);
+        }
+        if(files[i].bytes < 0) {
+            total = -1;
+        } else if(total >= 0) {
+            total += files[i].bytes;
+        }
+        free(files[i].fname);
+    }
+
+    free(files);
+    return total;
+}
+
+/* write the layers of map that changed since the last save, or every
+ * layer when all is set, the layers are written in parallel.
+ * returns the number of bytes written or -1 */
+long save_layers(struct Map *mp, int all)
+{
+    struct LayerFile *files = calloc(mp->layer_count, sizeof(struct LayerFile));
+    int count = 0;
+
+    if(files == NULL) {
+        error_msg();
+    }
+
+    for(int i = 0; i < mp->layer_count; i++) {
+        if(all || layer_dirty(mp, i, DIRTY_SAVE)) {
+            files[count].mp = mp;
+            files[count].layer = i;
+            count++;
+        }
+    }
+
+    pool_run(count, save_layer_job, files);
+
+    return layer_files_done(files, count);
+}
+
+/* create empty layers for map */
+int create_layers(struct Map *mp)
+{
+    /* create n layers with default tiles in asset folder */
+    /* layers are zeroed by alloc_layers */
+    alloc_layers(mp);
+
+    return save_layers(mp, 1) < 0 ? -1 : 0;
+}
+
+/* write the metadata line of map to mp->md */
+int write_metadata(struct Map *mp)
+{
+    FILE *fp = NULL;
+    char *md_line;
+
+    /* load_metadata reads the path back into MAP_PATH_MAX bytes */
+    if(strlen(mp->path) >= MAP_PATH_MAX) {
+        fprintf(stderr, "%s: path too long for metadata\n", mp->path);
+        return -1;
+    }
+
+    /* five ints of at most 11 characters and a comma each */
+    md_line = calloc(strlen(mp->path) + 5 * 12 + 1, sizeof(char));
+
+    if(md_line == NULL) {
+        error_msg();
+    }
+
+    /* create metadata line to write to file */
+    append_metadata(&md_line, mp->cols, 1);
+    append_metadata(&md_line, mp->rows, 1);
+    append_metadata(&md_line, mp->layer_count, 1);
+    append_metadata(&md_line, mp->sprite_width, 1);
+    append_metadata(&md_line, mp->sprite_height, 1);
+    strcat(md_line, mp->path);
+
+    fp = fopen(mp->md, "w");
+
+    if(fp == NULL) {
+        fprintf(stderr, "%s: %s\n", mp->md, strerror(errno));
+        free(md_line);
+        return -1;
+    }
+
+    fprintf(fp, "%s", md_line);
+    fclose(fp);
+
+    free(md_line);
+
+    return 0;
+}
+
+/* save metadata file to map folder in asset */
+int save_metadata(struct Map *mp)
+{
+    mp->path = calloc((strlen(_ASSET_PATH) + strlen(mp->name) + 2), sizeof(char));
+
+    if(mp->path == NULL) {
+        fprintf(stderr, "%s\n", strerror(errno));
+    }
+
+
+    strcpy(mp->path, _ASSET_PATH);
+    strcat(mp->path, mp->name);
+    strcat(mp->path, "/");
+
+    mp->md = calloc((strlen(mp->path) + strlen(".md") + strlen(mp->name) + 1), sizeof(char));
+
+    if(mp->md == NULL) {
+        fprintf(stderr, "%s\n", strerror(errno));
+    }
+
+    strcpy(mp->md, mp->path);
+    strcat(mp->md, mp->name);
+    strcat(mp->md, ".md");
+
+
+    mkdir(mp->path, 0700);
+
+    return write_metadata(mp);
+}
+
+/* read the metadata line written by save_metadata */
+/* cols,rows,layers,sprite_width,sprite_height,path */
+int load_metadata(struct Map *mp, const char *md)
+{
+    FILE *fp = fopen(md, "r");
+    char path[MAP_PATH_MAX] = {0};
+
+    if(fp == NULL) {
+        fprintf(stderr, "%s: %s\n", md, strerror(errno));
+        return -1;
+    }
+
+    if(fscanf(fp, "%d,%d,%d,%d,%d,%223s", &mp->cols, &mp->rows, &mp->layer_count,
+                &mp->sprite_width, &mp->sprite_height, path) != 6) {
+        fprintf(stderr, "%s: malformed metadata\n", md);
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+
+    mp->tile_width = mp->sprite_width;
+    mp->tile_height = mp->sprite_height;
+    set_map_dimensions(mp);
+    set_tile_count(mp);
+
+    mp->path = calloc(strlen(path) + 1, sizeof(char));
+
+    if(mp->path == NULL) {
+        error_msg();
+    }
+
+    strcpy(mp->path, path);
+
+    return 0;
+}
+
+/* fill a binary map header for map */
+int init_map_header(const struct Map *mp, struct MapHeader *hdr)
+{
+    if(strlen(mp->path) >= MAP_PATH_MAX) {
+        fprintf(stderr, "%s: path too long for binary map\n", mp->path);
+        return -1;
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, MAP_MAGIC, sizeof(hdr->magic));
+    hdr->version = MAP_VERSION;
+    hdr->byte_order = MAP_BYTE_ORDER;
+    hdr->header_size = sizeof(*hdr);
+    hdr->cols = mp->cols;
+    hdr->rows = mp->rows;
+    hdr->layer_count = mp->layer_count;
+    hdr->sprite_width = mp->sprite_width;
+    hdr->sprite_height = mp->sprite_height;
+    strcpy(hdr->path, mp->path);
+
+    return 0;
+}
+
+/* write header and every layer of map to a binary map file */
+/* the layer store is contiguous so all layers go out in one write,
+ * through a temporary file so an interrupted save keeps the old map */
+int save_map_binary(struct Map *mp, const char *fname)
+{
+    struct iovec iov[2];
+    struct MapHeader hdr;
+    size_t count = (size_t)mp->layer_count * mp->rows * mp->cols;
+
+    if(init_map_header(mp, &hdr) != 0) {
+        return -1;
+    }
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = mp->layers;
+    iov[1].iov_len = count * sizeof(uint16_t);
+
+    return write_file_atomic(fname, iov, 2);
+}
+
+/* copy size bytes of in to out, sharing the blocks when the filesystem
+ * supports reflinks so copying a large map costs next to nothing */
+int clone_file(int in, int out, off_t size)
+{
+    char buf[READ_BUF_SIZE];
+    off_t off = 0;
+
+    if(ioctl(out, FICLONE, in) == 0) {
+        return 0;
+    }
+
+    while(off < size) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, size - off, 0);
+
+        if(n <= 0) {
+            break;
+        }
+        off += n;
+    }
+
+    /* copy_file_range is not available across all filesystems */
+    while(off < size) {
+        ssize_t n = pread(in, buf, sizeof(buf), off);
+
+        if(n <= 0 || pwrite(out, buf, n, off) != n) {
+            if(n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        off += n;
+    }
+
+    return 0;
+}
+
+/* clone file src into a new file dst */
+/* returns an fd of dst open for reading and writing or -1 */
+int clone_path(const char *src, const char *dst)
+{
+    struct stat st;
+    int in = open(src, O_RDONLY);
+    int out = -1;
+
+    if(in == -1 || fstat(in, &st) == -1) {
+        goto fail;
+    }
+
+    out = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(out == -1 || clone_file(in, out, st.st_size) != 0) {
+        goto fail;
+    }
+
+    close(in);
+    return out;
+
+fail:
+    fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+    if(in != -1) {
+        close(in);
+    }
+    if(out != -1) {
+        close(out);
+        remove(dst);
+    }
+    return -1;
+}
+
+/* fnv-1a of len bytes at p, continued from h */
+static inline uint64_t hash_more(uint64_t h, const uint8_t *p, size_t len)
+{
+    for(size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+
+    return h;
+}
+
+/* reflink file src into a new file dst, sharing its blocks, so the copy
+ * costs nothing whatever the size of src
+ * returns an fd of dst open for reading and writing, or -1 without a
+ * message when the filesystem can not share blocks */
+int reflink_path(const char *src, const char *dst)
+{
+    int in = open(src, O_RDONLY);
+    int out = -1;
+
+    if(in == -1) {
+        return -1;
+    }
+
+    out = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(out == -1 || ioctl(out, FICLONE, in) != 0) {
+        if(out != -1) {
+            close(out);
+            remove(dst);
+        }
+        close(in);
+        return -1;
+    }
+
+    close(in);
+    return out;
+}
+
+/* sync fd, close it and rename tmp over fname */
+int commit_file(int fd, const char *tmp, const char *fname)
+{
+    if(fsync(fd) != 0) {
+        fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+        close(fd);
+        remove(tmp);
+        return -1;
+    }
+
+    close(fd);
+
+    if(rename(tmp, fname) != 0) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        remove(tmp);
+        return -1;
+    }
+
+    return sync_dir(fname);
+}
+
+/* <fname>.log, caller frees */
+char *save_log_name(const char *fname)
+{
+    char *log = calloc(strlen(fname) + strlen(SAVE_LOG_SUFFIX) + 1, sizeof(char));
+
+    if(log == NULL) {
+        error_msg();
+    }
+
+    strcpy(log, fname);
+    strcat(log, SAVE_LOG_SUFFIX);
+
+    return log;
+}
+
+/* write len bytes at p to fd, continuing where a short write stopped */
+int write_full(int fd, const void *p, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+
+        p = (const char *)p + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* start a save log header, buf is where the entries are gathered and
+ * keeps room for the header at its start */
+void save_log_init(struct SaveLogHeader *hdr, uint8_t *buf)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, SAVE_LOG_MAGIC, sizeof(hdr->magic));
+    hdr->hash = 14695981039346656037ull;
+    memset(buf, 0, sizeof(*hdr));
+}
+
+/* write what is left in buf and then the header, a log is only valid once
+ * it is complete, sync the log and close fd, which is closed on failure too */
+int save_log_finish(int fd, const uint8_t *buf, size_t used, const struct SaveLogHeader *hdr)
+{
+    if(write_full(fd, buf, used) != 0 || pwrite(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+            fsync(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return close(fd);
+}
+
+/* append len bytes to a save log through buf, hashing them */
+int save_log_append(int fd, uint8_t *buf, size_t *used, struct SaveLogHeader *hdr, const void *p, size_t len)
+{
+    hdr->hash = hash_more(hdr->hash, p, len);
+
+    if(*used + len > READ_BUF_SIZE) {
+        if(write_full(fd, buf, *used) != 0) {
+            return -1;
+        }
+        *used = 0;
+    }
+
+    if(len > READ_BUF_SIZE) {
+        return write_full(fd, p, len);
+    }
+
+    memcpy(buf + *used, p, len);
+    *used += len;
+
+    return 0;
+}
+
+/* write the rows of every chunk flagged DIRTY_SAVE to the save log at log
+ * and sync it. the rows are read at their offset in the map file from
+ * src, the map file mapped whole, or else from the file src_fd, which for
+ * a streamed map is its work file and holds the rows by chunk
+ * returns the number of bytes of rows logged or -1 */
+long save_log_write(const struct Map *mp, const char *log, const uint8_t *src, int src_fd, off_t data_offset)
+{
+    struct SaveLogHeader hdr;
+    uint8_t *buf = malloc(READ_BUF_SIZE);
+    uint8_t *row = malloc((size_t)mp->cols * sizeof(uint16_t));
+    size_t used = sizeof(hdr);
+    int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(buf == NULL || row == NULL) {
+        error_msg();
+    }
+
+    save_log_init(&hdr, buf);
+
+    if(fd == -1) {
+        goto fail;
+    }
+
+    /* runs of dirty chunks in a chunk row are logged a tile row at a time,
+     * the chunks of a streamed map one at a time from their slot */
+    for(int l = 0; l < mp->layer_count; l++) {
+        for(int cy = 0; cy < mp->chunk_rows; cy++) {
+            const uint8_t *d = mp->dirty + ((size_t)l * mp->chunk_rows + cy) * mp->chunk_cols;
+            int y0 = cy * CHUNK_SIZE;
+            int y1 = (y0 + CHUNK_SIZE < mp->rows) ? y0 + CHUNK_SIZE : mp->rows;
+
+            for(int cx = 0; cx < mp->chunk_cols; cx++) {
+                int cx1 = cx;
+                int x0 = cx * CHUNK_SIZE;
+                struct SaveLogEntry e;
+
+                off_t slot = -1;
+
+                if(!(d[cx] & DIRTY_SAVE)) {
+                    continue;
+                }
+
+                if(mp->chunks != NULL) {
+                    /* a chunk never written back still matches the map */
+                    if(mp->chunks->slot[cy * mp->chunk_cols + cx] == -1) {
+                        continue;
+                    }
+                    slot = (off_t)mp->chunks->slot[cy * mp->chunk_cols + cx] * chunk_bytes(mp);
+                }
+
+                while(slot == -1 && cx1 + 1 < mp->chunk_cols && (d[cx1 + 1] & DIRTY_SAVE)) {
+                    cx1++;
+                }
+
+                e.len = (((cx1 + 1) * CHUNK_SIZE < mp->cols ? (cx1 + 1) * CHUNK_SIZE : mp->cols) - x0) * sizeof(uint16_t);
+
+                for(int y = y0; y < y1; y++) {
+                    const uint8_t *data = row;
+                    off_t at = slot + (off_t)(((size_t)l * CHUNK_SIZE + y - y0) * CHUNK_SIZE * sizeof(uint16_t));
+
+                    e.off = data_offset + (((size_t)l * mp->rows + y) * mp->cols + x0) * sizeof(uint16_t);
+
+                    if(src != NULL) {
+                        data = src + e.off;
+                    } else if(pread(src_fd, row, e.len, slot == -1 ? (off_t)e.off : at) != (ssize_t)e.len) {
+                        goto fail;
+                    }
+
+                    if(save_log_append(fd, buf, &used, &hdr, &e, sizeof(e)) != 0 ||
+                            save_log_append(fd, buf, &used, &hdr, data, e.len) != 0) {
+                        goto fail;
+                    }
+                    hdr.count++;
+                    hdr.bytes += e.len;
+                }
+                cx = cx1;
+            }
+        }
+    }
+
+    if(save_log_finish(fd, buf, used, &hdr) != 0) {
+        fd = -1;
+        goto fail;
+    }
+
+    free(buf);
+    free(row);
+    return sync_dir(log) == 0 ? (long)hdr.bytes : -1;
+
+fail:
+    fprintf(stderr, "%s: %s\n", log, strerror(errno));
+    if(fd != -1) {
+        close(fd);
+    }
+    remove(log);
+    free(buf);
+    free(row);
+    return -1;
+}
+
+/* finish the save logged at log into the map file fname and remove the
+ * log. a log that is missing or incomplete is removed without touching the
+ * map, the save it belonged to never got to write over it.
+ * returns 0, or -1 when the rows could not be written, the log is then
+ * kept for the next try */
+int save_log_replay(const char *log, const char *fname)
+{
+    const struct SaveLogHeader *hdr = NULL;
+    const uint8_t *p = NULL;
+    const uint8_t *end = NULL;
+    uint64_t hash = 14695981039346656037ull;
+    uint8_t *base = NULL;
+    struct stat st;
+    struct stat map_st;
+    int fd = open(log, O_RDONLY);
+    int out = -1;
+    int valid = 0;
+
+    if(fd == -1) {
+        return 0;
+    }
+
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*hdr) || stat(fname, &map_st) == -1) {
+        close(fd);
+        goto done;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(base == MAP_FAILED) {
+        base = NULL;
+        goto done;
+    }
+
+    /* check every entry before the first is written over the map */
+    hdr = (const struct SaveLogHeader *)base;
+    p = base + sizeof(*hdr);
+    end = base + st.st_size;
+    valid = memcmp(hdr->magic, SAVE_LOG_MAGIC, sizeof(hdr->magic)) == 0;
+
+    for(uint32_t i = 0; valid && i < hdr->count; i++) {
+        struct SaveLogEntry e;
+
+        if((size_t)(end - p) < sizeof(e)) {
+            valid = 0;
+            break;
+        }
+
+        memcpy(&e, p, sizeof(e));
+
+        if(e.len > (size_t)(end - p) - sizeof(e) || e.off > (uint64_t)map_st.st_size ||
+                e.len > (uint64_t)map_st.st_size - e.off) {
+            valid = 0;
+            break;
+        }
+
+        hash = hash_more(hash, p, sizeof(e) + e.len);
+        p += sizeof(e) + e.len;
+    }
+
+    if(!valid || hash != hdr->hash) {
+        if(verbose == 1) {
+            printf("%s: incomplete save log, ignored\n", log);
+        }
+        goto done;
+    }
+
+    out = open(fname, O_WRONLY);
+
+    if(out == -1) {
+        goto fail;
+    }
+
+    p = base + sizeof(*hdr);
+
+    for(uint32_t i = 0; i < hdr->count; i++) {
+        struct SaveLogEntry e;
+
+        memcpy(&e, p, sizeof(e));
+
+        if(pwrite(out, p + sizeof(e), e.len, e.off) != (ssize_t)e.len) {
+            goto fail;
+        }
+        p += sizeof(e) + e.len;
+    }
+
+    if(fsync(out) != 0 || close(out) != 0) {
+        out = -1;
+        goto fail;
+    }
+
+done:
+    if(base != NULL) {
+        munmap(base, st.st_size);
+    }
+    remove(log);
+    return sync_dir(log);
+
+fail:
+    fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+    if(out != -1) {
+        close(out);
+    }
+    munmap(base, st.st_size);
+    return -1;
+}
+
+/* save the dirty chunks of a binary map in place, through a save log
+ * returns the number of bytes written or -1 */
+long save_map_logged(struct Map *mp, const uint8_t *src, int src_fd, off_t data_offset)
+{
+    char *log = save_log_name(mp->file);
+    long bytes = save_log_write(mp, log, src, src_fd, data_offset);
+
+    if(bytes >= 0 && save_log_replay(log, mp->file) != 0) {
+        bytes = -1;
+    }
+
+    free(log);
+    return bytes;
+}
+
+/* write the dirty chunks of one layer of a binary map to lf->fd, a pool
+ * job over LayerFiles. runs of dirty chunks in a chunk row are written with
+ * one pwrite per tile row */
+void update_layer_job(void *ctx, int i)
+{
+    struct LayerFile *lf = (struct LayerFile *)ctx + i;
+    struct Map *mp = lf->mp;
+    const struct MapHeader *hdr = mp->mapped;
+    int l = lf->layer;
+
+    for(int cy = 0; cy < mp->chunk_rows; cy++) {
+        uint8_t *d = mp->dirty + ((size_t)l * mp->chunk_rows + cy) * mp->chunk_cols;
+        int y0 = cy * CHUNK_SIZE;
+        int y1 = (y0 + CHUNK_SIZE < mp->rows) ? y0 + CHUNK_SIZE : mp->rows;
+
+        for(int cx = 0; cx < mp->chunk_cols; cx++) {
+            int cx1 = cx;
+            int x0 = cx * CHUNK_SIZE;
+            size_t len = 0;
+
+            if(!(d[cx] & DIRTY_SAVE)) {
+                continue;
+            }
+
+            while(cx1 + 1 < mp->chunk_cols && (d[cx1 + 1] & DIRTY_SAVE)) {
+                cx1++;
+            }
+
+            len = (((cx1 + 1) * CHUNK_SIZE < mp->cols ? (cx1 + 1) * CHUNK_SIZE : mp->cols) - x0) * sizeof(uint16_t);
+
+            for(int y = y0; y < y1; y++) {
+                size_t cell = ((size_t)l * mp->rows + y) * mp->cols + x0;
+                off_t off = hdr->header_size + (off_t)(cell * sizeof(uint16_t));
+
+                if(pwrite(lf->fd, mp->layers + cell, len, off) != (ssize_t)len) {
+                    fprintf(stderr, "%s: %s\n", lf->fname, strerror(errno));
+                    lf->bytes = -1;
+                    return;
+                }
+                lf->bytes += len;
+            }
+            cx = cx1;
+        }
+    }
+}
+
+/* save the changes of a map opened with open_map_binary back to its file.
+ * the old file is reflinked to a temporary file, only the rows of dirty
+ * chunks are written into it, a layer per worker, and it then replaces the
+ * old file. where the filesystem can not reflink the rows go through a
+ * save log instead, never a copy of the whole file.
+ * returns the number of bytes written or -1 */
+long update_map_binary(struct Map *mp)
+{
+    struct LayerFile *files = NULL;
+    char *tmp = calloc(strlen(mp->file) + strlen(".tmp") + 1, sizeof(char));
+    long total = 0;
+    int fd = -1;
+
+    if(tmp == NULL) {
+        error_msg();
+    }
+
+    strcpy(tmp, mp->file);
+    strcat(tmp, ".tmp");
+    fd = reflink_path(mp->file, tmp);
+
+    if(fd == -1) {
+        free(tmp);
+        return save_map_logged(mp, mp->mapped, -1, ((const struct MapHeader *)mp->mapped)->header_size);
+    }
+
+    files = calloc(mp->layer_count, sizeof(struct LayerFile));
+
+    if(files == NULL) {
+        error_msg();
+    }
+
+    for(int l = 0; l < mp->layer_count; l++) {
+        files[l].mp = mp;
+        files[l].layer = l;
+        files[l].fname = tmp;
+        files[l].fd = fd;
+    }
+
+    pool_run(mp->layer_count, update_layer_job, files);
+
+    for(int l = 0; l < mp->layer_count; l++) {
+        total = (total < 0 || files[l].bytes < 0) ? -1 : total + files[l].bytes;
+    }
+    free(files);
+
+    if(total < 0) {
+        close(fd);
+        remove(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    if(commit_file(fd, tmp, mp->file) != 0) {
+        free(tmp);
+        return -1;
+    }
+
+    free(tmp);
+    return total;
+}
+
+/* check a binary map header against the file size */
+int check_map_header(const struct MapHeader *hdr, size_t size, const char *fname)
+{
+    size_t need = hdr->header_size + (size_t)hdr->layer_count * hdr->rows * hdr->cols * sizeof(uint16_t);
+
+    if(memcmp(hdr->magic, MAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->version != MAP_VERSION ||
+            hdr->byte_order != MAP_BYTE_ORDER ||
+            hdr->header_size < sizeof(struct MapHeader) ||
+            hdr->header_size % sizeof(uint16_t) != 0 ||
+            hdr->cols <= 0 || hdr->rows <= 0 || hdr->layer_count <= 0 ||
+            need > size) {
+        fprintf(stderr, "%s: unsupported or truncated binary map\n", fname);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* set map metadata from a checked binary map header */
+int set_map_header(struct Map *mp, struct MapHeader *hdr, const char *name)
+{
+    mp->cols = hdr->cols;
+    mp->rows = hdr->rows;
+    mp->layer_count = hdr->layer_count;
+    mp->sprite_width = hdr->sprite_width;
+    mp->sprite_height = hdr->sprite_height;
+    mp->tile_width = hdr->sprite_width;
+    mp->tile_height = hdr->sprite_height;
+    set_map_dimensions(mp);
+    set_tile_count(mp);
+
+    hdr->path[MAP_PATH_MAX - 1] = '\0';
+    mp->path = calloc(strlen(hdr->path) + 1, sizeof(char));
+    mp->name = calloc(strlen(name) + 1, sizeof(char));
+
+    if(mp->path == NULL || mp->name == NULL) {
+        error_msg();
+    }
+
+    strcpy(mp->path, hdr->path);
+    strcpy(mp->name, name);
+
+    return 0;
+}
+
+/* map a binary map file into memory and use it as the layer store */
+/* nothing is parsed, the mapping is private so edits never reach the file
+ * until the map is saved. name is the map name without extension */
+int open_map_binary(struct Map *mp, const char *fname, const char *name)
+{
+    struct MapHeader *hdr = NULL;
+    struct stat st;
+    void *base = NULL;
+    char *log = save_log_name(fname);
+    int fd = -1;
+
+    verbose_print("opening binary map... ");
+
+    /* finish a save that was cut short */
+    if(save_log_replay(log, fname) != 0) {
+        free(log);
+        return -1;
+    }
+    free(log);
+    fd = open(fname, O_RDONLY);
+
+    if(fd == -1) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct MapHeader)) {
+        fprintf(stderr, "%s: not a binary map\n", fname);
+        close(fd);
+        return -1;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    hdr = base;
+
+    if(check_map_header(hdr, st.st_size, fname) != 0) {
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    set_map_header(mp, hdr, name);
+
+    mp->mapped = base;
+    mp->mapped_size = st.st_size;
+    mp->layers = (uint16_t *)((char *)base + hdr->header_size);
+    mp->file = calloc(strlen(fname) + 1, sizeof(char));
+
+    if(mp->file == NULL) {
+        error_msg();
+    }
+
+    strcpy(mp->file, fname);
+    alloc_dirty(mp);
+
+    verbose_print("OK\n");
+    return 0;
+}
+
+/* a packed map file (<path><name>.lrz) holds every layer as run length
+ * encoded chunks, see rle_encode. after the MapHeader, with magic
+ * PACKED_MAGIC, come the chunk count, layer_count * chunk_rows * chunk_cols,
+ * and the blob count as uint32, the blob of every chunk as uint32, layer
+ * major then row major and padded to an even count, and blob_count + 1
+ * uint64 offsets of the blobs in
+ * the data that follows. chunks that encode the same, empty chunks most
+ * of all, share one blob */
+struct PackJob {
+    struct Map *mp;
+    uint8_t **blobs;
+    uint32_t *lens;
+    const uint32_t *chunk_blob;
+    const uint64_t *offsets;
+    const uint8_t *data;
+    SDL_atomic_t failed;
+};
+
+/* tile rectangle of chunk i of a packed map, layer in *layer */
+static inline SDL_Rect pack_chunk_rect(const struct Map *mp, int i, int *layer)
+{
+    int per_layer = mp->chunk_rows * mp->chunk_cols;
+    SDL_Rect r;
+
+    *layer = i / per_layer;
+    r.x = i % per_layer % mp->chunk_cols * CHUNK_SIZE;
+    r.y = i % per_layer / mp->chunk_cols * CHUNK_SIZE;
+    r.w = mp->cols - r.x < CHUNK_SIZE ? mp->cols - r.x : CHUNK_SIZE;
+    r.h = mp->rows - r.y < CHUNK_SIZE ? mp->rows - r.y : CHUNK_SIZE;
+
+    return r;
+}
+
+void pack_chunk_job(void *ctx, int i)
+{
+    struct PackJob *pj = ctx;
+    uint8_t buf[CHUNK_SIZE * CHUNK_SIZE * 6];
+    int layer = 0;
+    SDL_Rect r = pack_chunk_rect(pj->mp, i, &layer);
+    const uint16_t *cells = layer_data(pj->mp, layer) + (size_t)r.y * pj->mp->cols + r.x;
+
+    pj->lens[i] = rle_encode(cells, r.w, r.h, pj->mp->cols, buf);
+    pj->blobs[i] = malloc(pj->lens[i]);
+
+    if(pj->blobs[i] == NULL) {
+        error_msg();
+    }
+    memcpy(pj->blobs[i], buf, pj->lens[i]);
+}
+
+void unpack_chunk_job(void *ctx, int i)
+{
+    struct PackJob *pj = ctx;
+    int layer = 0;
+    SDL_Rect r = pack_chunk_rect(pj->mp, i, &layer);
+    const uint8_t *p = pj->data + pj->offsets[pj->chunk_blob[i]];
+    const uint8_t *end = pj->data + pj->offsets[pj->chunk_blob[i] + 1];
+    uint16_t *cells = layer_data(pj->mp, layer) + (size_t)r.y * pj->mp->cols + r.x;
+
+    if(rle_decode(p, end, cells, r.w, r.h, pj->mp->cols) != end) {
+        SDL_AtomicAdd(&pj->failed, 1);
+    }
+}
+
+/* FNV-1a hash of a blob, for finding chunks that encode the same */
+static inline uint64_t blob_hash(const uint8_t *p, size_t len)
+{
+    return hash_more(14695981039346656037ull, p, len);
+}
+
+/* write map as a packed map file, chunks are encoded on the worker pool
+ * and equal ones stored once. returns the bytes written or -1 */
+long save_map_packed(struct Map *mp, const char *fname)
+{
+    struct MapHeader hdr;
+    struct PackJob pj;
+    struct iovec iov[5];
+    uint32_t counts[2];
+    int n = mp->layer_count * mp->chunk_rows * mp->chunk_cols;
+    int padded = (n + 1) & ~1;
+    int table_size = 1;
+    int *table = NULL;
+    uint32_t *chunk_blob = NULL;
+    uint64_t *offsets = NULL;
+    uint8_t *data = NULL;
+    size_t data_len = 0;
+    size_t data_cap = 4096;
+    int blob_count = 0;
+    int ret = 0;
+
+    if(mp->layers == NULL) {
+        fprintf(stderr, "%s: a streamed map can not be packed\n", fname);
+        return -1;
+    }
+
+    if(init_map_header(mp, &hdr) != 0) {
+        return -1;
+    }
+    memcpy(hdr.magic, PACKED_MAGIC, sizeof(hdr.magic));
+    hdr.version = PACKED_VERSION;
+
+    while(table_size < n * 2) {
+        table_size *= 2;
+    }
+
+    memset(&pj, 0, sizeof(pj));
+    pj.mp = mp;
+    pj.blobs = calloc(n, sizeof(uint8_t *));
+    pj.lens = calloc(n, sizeof(uint32_t));
+    table = calloc(table_size, sizeof(int));
+    chunk_blob = calloc(padded, sizeof(uint32_t));
+    offsets = calloc(n + 1, sizeof(uint64_t));
+    data = malloc(data_cap);
+
+    if(pj.blobs == NULL || pj.lens == NULL || table == NULL || chunk_blob == NULL ||
+            offsets == NULL || data == NULL) {
+        error_msg();
+    }
+
+    pool_run(n, pack_chunk_job, &pj);
+
+    /* the table holds blob index + 1 by hash, 0 is free */
+    for(int i = 0; i < n; i++) {
+        uint64_t h = blob_hash(pj.blobs[i], pj.lens[i]);
+        int slot = (int)(h & (table_size - 1));
+
+        while(table[slot] != 0) {
+            int b = table[slot] - 1;
+
+            if(offsets[b + 1] - offsets[b] == pj.lens[i] &&
+                    memcmp(data + offsets[b], pj.blobs[i], pj.lens[i]) == 0) {
+                break;
+            }
+            slot = (slot + 1) & (table_size - 1);
+        }
+
+        if(table[slot] == 0) {
+            while(data_len + pj.lens[i] > data_cap) {
+                data_cap *= 2;
+                data = realloc(data, data_cap);
+
+                if(data == NULL) {
+                    error_msg();
+                }
+            }
+
+            memcpy(data + data_len, pj.blobs[i], pj.lens[i]);
+            data_len += pj.lens[i];
+            offsets[++blob_count] = data_len;
+            table[slot] = blob_count;
+        }
+
+        chunk_blob[i] = table[slot] - 1;
+        free(pj.blobs[i]);
+    }
+
+    counts[0] = n;
+    counts[1] = blob_count;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = counts;
+    iov[1].iov_len = sizeof(counts);
+    iov[2].iov_base = chunk_blob;
+    iov[2].iov_len = padded * sizeof(uint32_t);
+    iov[3].iov_base = offsets;
+    iov[3].iov_len = (blob_count + 1) * sizeof(uint64_t);
+    iov[4].iov_base = data;
+    iov[4].iov_len = data_len;
+    ret = write_file_atomic(fname, iov, 5);
+
+    if(verbose == 1 && ret == 0) {
+        printf("%s: %d chunks, %d stored, %zu bytes\n", fname, n, blob_count, data_len);
+    }
+
+    free(pj.blobs);
+    free(pj.lens);
+    free(table);
+    free(chunk_blob);
+    free(offsets);
+    free(data);
+
+    return ret == 0 ? (long)(sizeof(hdr) + sizeof(counts) + padded * sizeof(uint32_t) +
+            (blob_count + 1) * sizeof(uint64_t) + data_len) : -1;
+}
+
+/* load a packed map file into the flat layer store, the chunks are decoded
+ * on the worker pool. saving the map writes the packed file again */
+int open_map_packed(struct Map *mp, const char *fname, const char *name)
+{
+    struct MapHeader *hdr = NULL;
+    struct PackJob pj;
+    struct stat st;
+    const uint32_t *counts = NULL;
+    uint8_t *base = NULL;
+    size_t need = sizeof(struct MapHeader) + 2 * sizeof(uint32_t);
+    size_t data_len = 0;
+    int fd = open(fname, O_RDONLY);
+    int n = 0;
+
+    verbose_print("opening packed map... ");
+
+    if(fd == -1) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < need) {
+        fprintf(stderr, "%s: not a packed map\n", fname);
+        close(fd);
+        return -1;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    hdr = (struct MapHeader *)base;
+    counts = (const uint32_t *)(base + sizeof(struct MapHeader));
+
+    if(memcmp(hdr->magic, PACKED_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->version != PACKED_VERSION || hdr->byte_order != MAP_BYTE_ORDER ||
+            hdr->header_size != sizeof(struct MapHeader) ||
+            hdr->cols <= 0 || hdr->rows <= 0 || hdr->layer_count <= 0) {
+        fprintf(stderr, "%s: unsupported packed map\n", fname);
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    set_map_header(mp, hdr, name);
+    n = mp->layer_count * mp->chunk_rows * mp->chunk_cols;
+    need += (size_t)((counts[0] + 1) & ~1u) * sizeof(uint32_t) + ((size_t)counts[1] + 1) * sizeof(uint64_t);
+
+    memset(&pj, 0, sizeof(pj));
+    pj.mp = mp;
+    pj.chunk_blob = (const uint32_t *)(counts + 2);
+    pj.offsets = (const uint64_t *)(pj.chunk_blob + ((counts[0] + 1) & ~1u));
+    pj.data = base + need;
+
+    if(counts[0] != (uint32_t)n || (size_t)st.st_size < need) {
+        fprintf(stderr, "%s: truncated packed map\n", fname);
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    /* every blob must lie inside the data, every chunk refer to a blob */
+    data_len = st.st_size - need;
+    for(uint32_t b = 0; b < counts[1]; b++) {
+        if(pj.offsets[b] > pj.offsets[b + 1] || pj.offsets[b + 1] > data_len) {
+            fprintf(stderr, "%s: bad blob offsets\n", fname);
+            munmap(base, st.st_size);
+            return -1;
+        }
+    }
+    for(int i = 0; i < n; i++) {
+        if(pj.chunk_blob[i] >= counts[1]) {
+            fprintf(stderr, "%s: bad chunk table\n", fname);
+            munmap(base, st.st_size);
+            return -1;
+        }
+    }
+
+    alloc_layers(mp);
+    pool_run(n, unpack_chunk_job, &pj);
+    munmap(base, st.st_size);
+
+    if(SDL_AtomicGet(&pj.failed) > 0) {
+        fprintf(stderr, "%s: %d chunks do not decode\n", fname, SDL_AtomicGet(&pj.failed));
+        return -1;
+    }
+
+    mp->packed = calloc(strlen(fname) + 1, sizeof(char));
+
+    if(mp->packed == NULL) {
+        error_msg();
+    }
+
+    strcpy(mp->packed, fname);
+
+    verbose_print("OK\n");
+    return 0;
+}
+
+/* give mp a store of budget bytes of chunks read from fd, the layers
+ * starting at data_offset, and written back to the work file named work,
+ * which is removed when the store is closed. fd -1 makes a store without
+ * a file whose chunks are filled by the caller, see open_map_view.
+ * at least one chunk is always resident */
+int chunk_store_init(struct Map *mp, int fd, char *work, off_t data_offset, size_t budget, size_t cold_budget)
+{
+    struct ChunkStore *cs = calloc(1, sizeof(struct ChunkStore));
+    size_t chunk_len = 0;
+
+    if(cs == NULL) {
+        error_msg();
+    }
+
+    chunk_len = (size_t)mp->layer_count * CHUNK_SIZE * CHUNK_SIZE;
+    cs->fd = fd;
+    cs->work = work;
+    cs->work_fd = -1;
+    cs->data_offset = data_offset;
+    cs->chunk_cols = (mp->cols + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    cs->chunk_rows = (mp->rows + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    cs->capacity = budget / (chunk_len * sizeof(uint16_t));
+
+    /* never hold more chunks than the map has */
+    if((long)cs->capacity > (long)cs->chunk_cols * cs->chunk_rows) {
+        cs->capacity = cs->chunk_cols * cs->chunk_rows;
+    }
+    if(cs->capacity < 1) {
+        cs->capacity = 1;
+    }
+
+    cs->hash_size = cs->capacity * 2 + 1;
+    cs->slots = calloc(cs->capacity, sizeof(struct Chunk));
+    cs->hash = calloc(cs->hash_size, sizeof(struct Chunk *));
+    cs->tile_pool = calloc(chunk_len * cs->capacity, sizeof(uint16_t));
+    cs->cold = calloc((size_t)cs->chunk_cols * cs->chunk_rows, sizeof(uint8_t *));
+    cs->cold_len = calloc((size_t)cs->chunk_cols * cs->chunk_rows, sizeof(uint32_t));
+    cs->slot = malloc((size_t)cs->chunk_cols * cs->chunk_rows * sizeof(int32_t));
+    cs->scratch = malloc(chunk_len * 6);
+    cs->cold_budget = cold_budget;
+
+    if(cs->slots == NULL || cs->hash == NULL || cs->tile_pool == NULL || cs->cold == NULL ||
+            cs->cold_len == NULL || cs->slot == NULL || cs->scratch == NULL) {
+        error_msg();
+    }
+
+    for(int i = 0; i < cs->chunk_cols * cs->chunk_rows; i++) {
+        cs->slot[i] = -1;
+    }
+
+    for(int i = 0; i < cs->capacity; i++) {
+        cs->slots[i].cx = -1;
+        cs->slots[i].cy = -1;
+        cs->slots[i].tiles = cs->tile_pool + chunk_len * i;
+    }
+
+    mp->chunks = cs;
+    return 0;
+}
+
+/* open a binary map for streaming, only chunks that are touched are read
+ * budget is the number of bytes chunk tiles may use, at least one chunk
+ * is always resident. chunks are read from fname and written back to
+ * <fname>.work, save_map_stream writes the changed ones over fname, so
+ * opening costs the same whatever the size of the map */
+int open_map_stream(struct Map *mp, const char *fname, const char *name, size_t budget)
+{
+    struct MapHeader hdr;
+    struct ChunkStore *cs = NULL;
+    struct stat st;
+    char *work = calloc(strlen(fname) + strlen(".work") + 1, sizeof(char));
+    char *log = save_log_name(fname);
+    int fd = -1;
+
+    verbose_print("opening streamed map... ");
+
+    if(work == NULL) {
+        error_msg();
+    }
+
+    /* finish a save that was cut short */
+    if(save_log_replay(log, fname) != 0) {
+        free(log);
+        free(work);
+        return -1;
+    }
+    free(log);
+
+    strcpy(work, fname);
+    strcat(work, ".work");
+    fd = open(fname, O_RDONLY);
+
+    if(fd == -1) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        free(work);
+        return -1;
+    }
+
+    if(fstat(fd, &st) == -1 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            check_map_header(&hdr, st.st_size, fname) != 0) {
+        fprintf(stderr, "%s: not a binary map\n", fname);
+        close(fd);
+        free(work);
+        return -1;
+    }
+
+    set_map_header(mp, &hdr, name);
+
+    mp->file = calloc(strlen(fname) + 1, sizeof(char));
+
+    if(mp->file == NULL) {
+        error_msg();
+    }
+
+    strcpy(mp->file, fname);
+    alloc_dirty(mp);
+    chunk_store_init(mp, fd, work, hdr.header_size, budget, CHUNK_COLD_BUDGET);
+    cs = mp->chunks;
+
+    if(verbose == 1) {
+        printf("%d of %d chunks resident max, OK\n", cs->capacity, cs->chunk_cols * cs->chunk_rows);
+    }
+
+    return 0;
+}
+
+/* make sure every chunk overlapping the tile rectangle plus a margin of one
+ * chunk is resident, called as the camera moves so chunks are loaded before
+ * they scroll into view. x, y, w, h are in tiles */
+int map_stream_view(struct Map *mp, int x, int y, int w, int h)
+{
+    struct ChunkStore *cs = mp->chunks;
+    int cx0 = x / CHUNK_SIZE - 1;
+    int cy0 = y / CHUNK_SIZE - 1;
+    int cx1 = (x + w - 1) / CHUNK_SIZE + 1;
+    int cy1 = (y + h - 1) / CHUNK_SIZE + 1;
+
+    /* a store without a file has nothing to read ahead */
+    if(cs == NULL || cs->fd == -1) {
+        return 0;
+    }
+
+    cx0 = cx0 < 0 ? 0 : cx0;
+    cy0 = cy0 < 0 ? 0 : cy0;
+    cx1 = cx1 >= cs->chunk_cols ? cs->chunk_cols - 1 : cx1;
+    cy1 = cy1 >= cs->chunk_rows ? cs->chunk_rows - 1 : cy1;
+
+    /* skip the prefetch margin when the budget can not hold it */
+    if((cx1 - cx0 + 1) * (cy1 - cy0 + 1) > cs->capacity) {
+        return 0;
+    }
+
+    for(int cy = cy0; cy <= cy1; cy++) {
+        for(int cx = cx0; cx <= cx1; cx++) {
+            chunk_get(mp, cx, cy);
+        }
+    }
+
+    return 0;
+}
+
+/* dirty chunks of a streamed map written back on the worker pool */
+struct ChunkFlush {
+    const struct Map *mp;
+    struct Chunk **chunks;
+};
+
+void flush_chunk_job(void *ctx, int i)
+{
+    struct ChunkFlush *cf = ctx;
+
+    chunk_io(cf->mp, cf->chunks[i], 1);
+}
+
+/* write every dirty resident chunk back to the work file, in parallel */
+/* returns the number of chunks written */
+int flush_map_stream(struct Map *mp)
+{
+    struct ChunkStore *cs = mp->chunks;
+    struct ChunkFlush cf = { mp, NULL };
+    int count = 0;
+
+    cf.chunks = calloc(cs->resident > 0 ? cs->resident : 1, sizeof(struct Chunk *));
+
+    if(cf.chunks == NULL) {
+        error_msg();
+    }
+
+    for(struct Chunk *c = cs->lru_head; c != NULL; c = c->next) {
+        if(c->dirty) {
+            chunk_slot(mp, c);
+            cf.chunks[count++] = c;
+        }
+    }
+
+    pool_run(count, flush_chunk_job, &cf);
+
+    for(int i = 0; i < count; i++) {
+        cf.chunks[i]->dirty = 0;
+    }
+    cs->writebacks += count;
+    free(cf.chunks);
+
+    return count;
+}
+
+/* save a streamed map, dirty resident chunks are flushed to the work file
+ * and the chunks changed since the last save are copied from there over
+ * the map file through a save log. returns the number of bytes written or -1 */
+long save_map_stream(struct Map *mp)
+{
+    struct ChunkStore *cs = mp->chunks;
+
+    flush_map_stream(mp);
+
+    return save_map_logged(mp, NULL, cs->work_fd, cs->data_offset);
+}
+
+/* release the chunk store of a streamed map */
+/* the work file is removed, edits since the last save are discarded */
+int close_map_stream(struct Map *mp)
+{
+    struct ChunkStore *cs = mp->chunks;
+
+    if(verbose == 1) {
+        printf("chunks: %ld loads %ld evictions %ld writebacks %ld cold\n", cs->loads, cs->evictions,
+                cs->writebacks, cs->cold_hits);
+    }
+
+    for(int i = 0; i < cs->chunk_cols * cs->chunk_rows; i++) {
+        free(cs->cold[i]);
+    }
+    free(cs->cold);
+    free(cs->cold_len);
+    free(cs->scratch);
+
+    if(cs->fd != -1) {
+        close(cs->fd);
+    }
+    if(cs->work_fd != -1) {
+        close(cs->work_fd);
+        remove(cs->work);
+    }
+    free(cs->work);
+    free(cs->slot);
+    free(cs->slots);
+    free(cs->hash);
+    free(cs->tile_pool);
+    free(cs);
+    mp->chunks = NULL;
+
+    return 0;
+}
+
+int free_map(struct Map *mp)
+{
+    free(mp->path);
+    free(mp->name);
+    free(mp->md);
+
+    if(mp->chunks != NULL) {
+        close_map_stream(mp);
+    }
+
+    /* layers point into the mapping when loaded from a binary map */
+    if(mp->mapped != NULL) {
+        munmap(mp->mapped, mp->mapped_size);
+        mp->mapped = NULL;
+    } else {
+        free(mp->layers);
+    }
+
+    mp->layers = NULL;
+    free(mp->dirty);
+    mp->dirty = NULL;
+    free(mp->file);
+    mp->file = NULL;
+    free(mp->packed);
+    mp->packed = NULL;
+
+    if(mp->collision != NULL) {
+        free(mp->collision->bits);
+        free(mp->collision);
+        mp->collision = NULL;
+    }
+
+    for(int i = 0; i < 2; i++) {
+        if(mp->sparse[i] != NULL) {
+            free(mp->sparse[i]->keys);
+            free(mp->sparse[i]->ids);
+            free(mp->sparse[i]->runs);
+            free(mp->sparse[i]);
+            mp->sparse[i] = NULL;
+        }
+    }
+
+    return 0;
+}
+
+/* read a sparse layer file into layer of map and its sparse index */
+/* returns bytes read or -1 */
+long load_sparse_layer(struct Map *mp, int layer, const char *fname)
+{
+    struct SparseHeader hdr;
+    struct SparseLayer *sl = NULL;
+    struct stat st;
+    uint8_t *buf = NULL;
+    const uint8_t *p = NULL;
+    uint16_t *cells = layer_data(mp, layer);
+    uint32_t key = 0;
+    int fd = open(fname, O_RDONLY);
+
+    if(fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        if(fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    buf = malloc(st.st_size + 1);
+
+    if(buf == NULL) {
+        error_msg();
+    }
+
+    if(read(fd, buf, st.st_size) != st.st_size || (size_t)st.st_size < sizeof(hdr)) {
+        goto bad;
+    }
+    close(fd);
+    fd = -1;
+
+    memcpy(&hdr, buf, sizeof(hdr));
+
+    if(memcmp(hdr.magic, SPARSE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != SPARSE_VERSION ||
+            hdr.byte_order != MAP_BYTE_ORDER || hdr.cols != mp->cols || hdr.rows != mp->rows ||
+            hdr.count < 0 || hdr.count > (st.st_size - (long)sizeof(hdr)) / 2) {
+        goto bad;
+    }
+
+    sl = calloc(1, sizeof(struct SparseLayer));
+
+    if(sl == NULL) {
+        error_msg();
+    }
+
+    sl->capacity = hdr.count > 0 ? hdr.count : 1;
+    sl->keys = malloc(sl->capacity * sizeof(uint32_t));
+    sl->ids = malloc(sl->capacity * sizeof(uint16_t));
+
+    if(sl->keys == NULL || sl->ids == NULL) {
+        error_msg();
+    }
+
+    p = buf + sizeof(hdr);
+
+    for(int i = 0; i < hdr.count; i++) {
+        uint32_t delta = 0;
+        uint32_t id = 0;
+
+        if(get_varint(&p, buf + st.st_size, &delta) != 0 || get_varint(&p, buf + st.st_size, &id) != 0 ||
+                (i > 0 && delta == 0) || (uint64_t)key + delta >= (uint64_t)mp->rows * mp->cols ||
+                id == 0 || id > UINT16_MAX) {
+            free(sl->keys);
+            free(sl->ids);
+            free(sl);
+            goto bad;
+        }
+
+        key += delta;
+        sl->keys[i] = key;
+        sl->ids[i] = id;
+        cells[key] = id;
+    }
+
+    sl->count = hdr.count;
+    mp->sparse[layer - OBJECT_LAYER] = sl;
+    free(buf);
+
+    return st.st_size;
+
+bad:
+    fprintf(stderr, "%s: not a sparse layer of this map\n", fname);
+    if(fd != -1) {
+        close(fd);
+    }
+    free(buf);
+    return -1;
+}
+
+/* parse one text layer file into layer of map, returns bytes read or -1 */
+/* the file is read in READ_BUF_SIZE blocks and scanned in a single pass,
+ * a number may span two blocks so the scanner state lives outside the block loop.
+ * every row must have exactly cols ids, each followed by a comma
+ * (the last comma of a row is optional), rows beyond mp->rows are ignored
+ * with a warning and *trailing set, blank lines after the last row are not */
+long load_layer(struct Map *mp, int layer, const char *fname, int *trailing)
+{
+    char buf[READ_BUF_SIZE];
+    uint16_t *row_cell = layer_data(mp, layer);
+    long total = 0;
+    ssize_t n = 0;
+    int fd = open(fname, O_RDONLY);
+    int row = 0;
+    int col = 0;
+    unsigned int val = 0;
+    int digits = 0;
+    int gap = 0;
+    const char *tail = NULL;
+    const char *tail_end = NULL;
+
+    *trailing = 0;
+
+    if(fd == -1) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    while(row < mp->rows && (n = read(fd, buf, sizeof(buf))) > 0) {
+        const char *p = buf;
+        const char *end = buf + n;
+
+        total += n;
+
+        while(p < end) {
+            unsigned int d = (unsigned char)*p - '0';
+
+            if(d < 10) {
+                /* spaces may surround a tile id, not split it */
+                if(gap) {
+                    fprintf(stderr, "%s:%d: space inside a tile id\n", fname, row + 1);
+                    goto fail;
+                }
+                val = val * 10 + d;
+                if(val > UINT16_MAX) {
+                    fprintf(stderr, "%s:%d: tile id out of range\n", fname, row + 1);
+                    goto fail;
+                }
+                digits++;
+                p++;
+                continue;
+            }
+
+            if(*p == ',' || *p == '\n') {
+                gap = 0;
+                if(digits > 0) {
+                    if(col == mp->cols) {
+                        fprintf(stderr, "%s:%d: more than %d columns\n", fname, row + 1, mp->cols);
+                        goto fail;
+                    }
+                    row_cell[col++] = val;
+                    val = 0;
+                    digits = 0;
+                } else if(*p == ',') {
+                    fprintf(stderr, "%s:%d: empty cell\n", fname, row + 1);
+                    goto fail;
+                }
+
+                /* blank lines are skipped */
+                if(*p == '\n' && col > 0) {
+                    if(col != mp->cols) {
+                        fprintf(stderr, "%s:%d: %d columns, expected %d\n", fname, row + 1, col, mp->cols);
+                        goto fail;
+                    }
+                    col = 0;
+                    row_cell += mp->cols;
+                    if(++row == mp->rows) {
+                        tail = p + 1;
+                        tail_end = end;
+                        break;
+                    }
+                }
+            } else if(*p == '\r' || *p == ' ') {
+                gap = digits > 0;
+            } else {
+                fprintf(stderr, "%s:%d: unexpected character 0x%02x\n", fname, row + 1, (unsigned char)*p);
+                goto fail;
+            }
+            p++;
+        }
+    }
+
+    if(n == -1) {
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        goto fail;
+    }
+
+    /* last row without trailing newline, checked like the others */
+    if(row < mp->rows && digits > 0) {
+        if(col == mp->cols) {
+            fprintf(stderr, "%s:%d: more than %d columns\n", fname, row + 1, mp->cols);
+            goto fail;
+        }
+        row_cell[col++] = val;
+    }
+    if(row < mp->rows && col > 0) {
+        if(col != mp->cols) {
+            fprintf(stderr, "%s:%d: %d columns, expected %d\n", fname, row + 1, col, mp->cols);
+            goto fail;
+        }
+        row++;
+    }
+
+    if(row < mp->rows) {
+        fprintf(stderr, "%s: %d rows, expected %d\n", fname, row, mp->rows);
+        goto fail;
+    }
+
+    /* the rest of the block the last row ended in, then the rest of the file */
+    while(!*trailing) {
+        for(; tail < tail_end; tail++) {
+            if(*tail != '\n' && *tail != '\r' && *tail != ' ') {
+                *trailing = 1;
+                break;
+            }
+        }
+
+        if(*trailing || (n = read(fd, buf, sizeof(buf))) <= 0) {
+            break;
+        }
+        tail = buf;
+        tail_end = buf + n;
+    }
+
+    if(*trailing) {
+        fprintf(stderr, "%s: ignoring data after row %d\n", fname, mp->rows);
+    }
+
+    close(fd);
+    return total;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/* store the name of the map from the metadata file name, without directory and .md */
+int set_map_name(struct Map *mp, const char *md)
+{
+    const char *base = strrchr(md, '/');
+    size_t len = 0;
+
+    base = (base == NULL) ? md : base + 1;
+    len = strlen(base);
+    if(len > 3 && strcmp(base + len - 3, ".md") == 0) {
+        len -= 3;
+    }
+
+    free(mp->name);
+    mp->name = calloc(len + 1, sizeof(char));
+
+    if(mp->name == NULL) {
+        error_msg();
+    }
+
+    memcpy(mp->name, base, len);
+
+    return 0;
+}
+
+/* read one layer file of a map, a pool job over LayerFiles
+ * the sparse layers are read from .lrs files when there are any */
+void load_layer_job(void *ctx, int i)
+{
+    struct LayerFile *lf = (struct LayerFile *)ctx + i;
+    Uint64 start = SDL_GetPerformanceCounter();
+    char suffix[32];
+
+    sprintf(suffix, "_%d.lrs", lf->layer);
+    lf->fname = map_file_name(lf->mp, suffix);
+
+    PROF_BEGIN(t);
+    if((lf->layer == OBJECT_LAYER || lf->layer == EVENT_LAYER) && access(lf->fname, R_OK) == 0) {
+        lf->bytes = load_sparse_layer(lf->mp, lf->layer, lf->fname);
+    } else {
+        lf->fname[strlen(lf->fname) - 1] = '\0';
+        lf->bytes = load_layer(lf->mp, lf->layer, lf->fname, &lf->trailing);
+    }
+    PROF_END(t, "load_layer");
+
+    lf->msec = elapsed_sec(start) * 1000.0;
+}
+
+/* load a text map, md is the path to the metadata file
+ * ex asset/test/test.md
+ * the metadata line gives dimensions, layer count and the map folder,
+ * then every <path><name>_<i>.lr is parsed into the layer store, the
+ * layers in parallel on the worker pool.
+ * an empty map struct is populated, free it with free_map */
+int load_map(struct Map *mp, const char *md)
+{
+    struct LayerFile *files = NULL;
+    long total = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    verbose_print("loading map... \n");
+
+    if(load_metadata(mp, md) != 0) {
+        return -1;
+    }
+
+    if(mp->cols <= 0 || mp->rows <= 0 || mp->layer_count <= 0) {
+        fprintf(stderr, "%s: bad map dimensions\n", md);
+        return -1;
+    }
+
+    set_map_name(mp, md);
+
+    mp->md = calloc(strlen(md) + 1, sizeof(char));
+
+    if(mp->md == NULL) {
+        error_msg();
+    }
+
+    strcpy(mp->md, md);
+
+    alloc_layers(mp);
+
+    files = calloc(mp->layer_count, sizeof(struct LayerFile));
+
+    if(files == NULL) {
+        error_msg();
+    }
+
+    for(int i = 0; i < mp->layer_count; i++) {
+        files[i].mp = mp;
+        files[i].layer = i;
+    }
+
+    pool_run(mp->layer_count, load_layer_job, files);
+
+    for(int i = 0; i < mp->layer_count; i++) {
+        mp->trailing += files[i].trailing;
+    }
+
+    total = layer_files_done(files, mp->layer_count);
+
+    if(total < 0) {
+        return -1;
+    }
+
+    if(verbose == 1) {
+        double sec = elapsed_sec(start);
+        printf("\t%ld bytes in %.3f ms, %.1f MB/s\n", total, sec * 1000.0, total / sec / (1024.0 * 1024.0));
+        printf("\tOK\n");
+    }
+
+    return 0;
+}
+
+/* convert a text map (.md + <name>_<i>.lr) to a binary map <path><name>.lrb */
+int convert_map_binary(const char *md)
+{
+    struct Map mp;
+    char *fname = NULL;
+    int ret = 0;
+
+    init_map(&mp);
+
+    ret = load_map(&mp, md);
+
+    if(ret == 0) {
+        fname = map_file_name(&mp, ".lrb");
+        ret = save_map_binary(&mp, fname);
+        if(ret == 0 && verbose == 1) {
+            printf("%s -> %s\n", md, fname);
+        }
+        free(fname);
+    }
+
+    free_map(&mp);
+    return ret;
+}
+
+/* save what changed in map since it was loaded or last saved, to the
+ * binary map it was opened from or else to its text layer files.
+ * a packed map is written whole, it is small */
+int save_map(struct Map *mp)
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+    long bytes = 0;
+
+    PROF_BEGIN(t);
+    if(mp->chunks != NULL) {
+        bytes = save_map_stream(mp);
+    } else if(mp->file != NULL) {
+        bytes = update_map_binary(mp);
+    } else if(mp->packed != NULL) {
+        bytes = save_map_packed(mp, mp->packed);
+    } else {
+        bytes = save_layers(mp, 0);
+    }
+    PROF_END(t, "save_map");
+
+    if(bytes < 0) {
+        return -1;
+    }
+
+    /* every changed chunk has been saved, autosave keeps its own flags */
+    if(mp->dirty != NULL) {
+        size_t n = (size_t)mp->layer_count * mp->chunk_rows * mp->chunk_cols;
+
+        for(size_t i = 0; i < n; i++) {
+            mp->dirty[i] &= ~DIRTY_SAVE;
+        }
+    }
+
+    if(verbose == 1) {
+        printf("saved %ld bytes in %.3f ms\n", bytes, elapsed_sec(start) * 1000.0);
+    }
+
+    return 0;
+}
+
+/* create the autosave file on first use, a clone of the binary map the
+ * map was opened from, or an empty binary map of the right size. it is
+ * made under a temporary name and renamed into place, with the log of an
+ * autosave left by an earlier run removed first */
+int autosave_open(struct Autosave *as)
+{
+    size_t size = as->hdr.header_size + (size_t)as->hdr.layer_count * as->rows * as->cols * sizeof(uint16_t);
+    char *tmp = calloc(strlen(as->file) + strlen(".tmp") + 1, sizeof(char));
+    char *log = save_log_name(as->file);
+    int fd = -1;
+
+    if(tmp == NULL) {
+        error_msg();
+    }
+
+    strcpy(tmp, as->file);
+    strcat(tmp, ".tmp");
+    remove(log);
+    free(log);
+
+    if(as->base != NULL) {
+        fd = clone_path(as->base, tmp);
+    } else {
+        fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+        if(fd == -1 ||
+                pwrite(fd, &as->hdr, sizeof(as->hdr), 0) != sizeof(as->hdr) ||
+                ftruncate(fd, size) != 0) {
+            fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+            if(fd != -1) {
+                close(fd);
+                remove(tmp);
+                fd = -1;
+            }
+        }
+    }
+
+    as->created = fd != -1 && commit_file(fd, tmp, as->file) == 0;
+    free(tmp);
+
+    return as->created ? 0 : -1;
+}
+
+/* write the rows of every chunk of the snapshot to the save log at log
+ * and sync it, returns the number of bytes of rows logged or -1 */
+long autosave_log(struct Autosave *as, const char *log)
+{
+    struct SaveLogHeader hdr;
+    uint8_t *buf = malloc(READ_BUF_SIZE);
+    size_t used = sizeof(hdr);
+    int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(buf == NULL) {
+        error_msg();
+    }
+
+    save_log_init(&hdr, buf);
+
+    if(fd == -1) {
+        goto fail;
+    }
+
+    for(int i = 0; i < as->count; i++) {
+        const struct SnapChunk *sc = &as->chunks[i];
+        const uint16_t *tiles = as->tiles + (size_t)i * CHUNK_SIZE * CHUNK_SIZE;
+        int x0 = sc->cx * CHUNK_SIZE;
+        int y0 = sc->cy * CHUNK_SIZE;
+        int w = (as->cols - x0 < CHUNK_SIZE) ? as->cols - x0 : CHUNK_SIZE;
+        int h = (as->rows - y0 < CHUNK_SIZE) ? as->rows - y0 : CHUNK_SIZE;
+        struct SaveLogEntry e;
+
+        e.len = w * sizeof(uint16_t);
+
+        for(int r = 0; r < h; r++) {
+            e.off = as->hdr.header_size + (((size_t)sc->layer * as->rows + y0 + r) * as->cols + x0) * sizeof(uint16_t);
+
+            if(save_log_append(fd, buf, &used, &hdr, &e, sizeof(e)) != 0 ||
+                    save_log_append(fd, buf, &used, &hdr, tiles + (size_t)r * CHUNK_SIZE, e.len) != 0) {
+                goto fail;
+            }
+            hdr.count++;
+            hdr.bytes += e.len;
+        }
+    }
+
+    if(save_log_finish(fd, buf, used, &hdr) != 0) {
+        fd = -1;
+        goto fail;
+    }
+
+    free(buf);
+    return sync_dir(log) == 0 ? (long)hdr.bytes : -1;
+
+fail:
+    fprintf(stderr, "%s: %s\n", log, strerror(errno));
+    if(fd != -1) {
+        close(fd);
+    }
+    remove(log);
+    free(buf);
+    return -1;
+}
+
+/* write the snapshot into the autosave file through its save log, a crash
+ * leaves either the last autosave or this one once the log is replayed as
+ * the autosave is opened. a log an earlier write could not finish is
+ * replayed first. returns the number of bytes written or -1 */
+long autosave_write(struct Autosave *as)
+{
+    char *log = NULL;
+    long total = -1;
+
+    if(!as->created && autosave_open(as) != 0) {
+        return -1;
+    }
+
+    log = save_log_name(as->file);
+
+    if(save_log_replay(log, as->file) == 0) {
+        total = autosave_log(as, log);
+    }
+
+    if(total >= 0 && save_log_replay(log, as->file) != 0) {
+        total = -1;
+    }
+
+    free(log);
+    return total;
+}
+
+/* autosave thread, writes a snapshot every time one is handed over */
+int autosave_worker(void *data)
+{
+    struct Autosave *as = data;
+
+    SDL_LockMutex(as->lock);
+
+    while(!as->quit) {
+        if(SDL_AtomicGet(&as->state) == AUTOSAVE_WRITING) {
+            Uint64 start = SDL_GetPerformanceCounter();
+            long bytes = 0;
+
+            SDL_UnlockMutex(as->lock);
+            PROF_BEGIN(t);
+            bytes = autosave_write(as);
+            PROF_END(t, "autosave");
+            SDL_LockMutex(as->lock);
+
+            as->bytes = bytes;
+            as->msec = elapsed_sec(start) * 1000.0;
+
+            if(verbose == 1 && bytes >= 0) {
+                printf("autosave: %d chunks, %ld bytes in %.3f ms\n", as->count, bytes, as->msec);
+            }
+
+            SDL_AtomicSet(&as->state, AUTOSAVE_IDLE);
+        } else {
+            SDL_CondWait(as->wake, as->lock);
+        }
+    }
+
+    SDL_UnlockMutex(as->lock);
+    return 0;
+}
+
+/* start autosaving map to <path><name>.autosave.lrb
+ * only maps with a layer store in memory are autosaved, a streamed map
+ * already keeps its edits in its work file */
+int autosave_init(struct Autosave *as, struct Map *mp)
+{
+    memset(as, 0, sizeof(*as));
+    as->last = SDL_GetTicks();
+
+    if(mp->layers == NULL || init_map_header(mp, &as->hdr) != 0) {
+        return -1;
+    }
+
+    as->mp = mp;
+    mp->autosave = as;
+
+    as->file = map_file_name(mp, AUTOSAVE_SUFFIX);
+    as->cols = mp->cols;
+    as->rows = mp->rows;
+
+    /* a binary map is the base of the autosave, only unsaved chunks are
+     * copied. without one the whole map has to go into the first autosave */
+    if(mp->file != NULL) {
+        size_t n = (size_t)mp->layer_count * mp->chunk_rows * mp->chunk_cols;
+
+        as->base = calloc(strlen(mp->file) + 1, sizeof(char));
+
+        if(as->base == NULL) {
+            error_msg();
+        }
+
+        strcpy(as->base, mp->file);
+
+        for(size_t i = 0; i < n; i++) {
+            if(mp->dirty[i] & DIRTY_SAVE) {
+                mp->dirty[i] |= DIRTY_AUTOSAVE;
+            }
+        }
+    } else {
+        SDL_Rect all = { 0, 0, mp->cols, mp->rows };
+
+        for(int l = 0; l < mp->layer_count; l++) {
+            mark_dirty(mp, l, all, DIRTY_AUTOSAVE);
+        }
+    }
+
+    as->lock = SDL_CreateMutex();
+    as->wake = SDL_CreateCond();
+
+    if(as->lock == NULL || as->wake == NULL) {
+        error_msg();
+    }
+
+    as->thread = SDL_CreateThread(autosave_worker, "autosave", as);
+    return 0;
+}
+
+/* take every chunk flagged for autosave into the snapshot, flagged
+ * DIRTY_SNAPSHOT until it is copied, and make room for them. chunks
+ * flagged while copying are left for the next autosave.
+ * the old buffers are not copied, growing never costs more than a malloc */
+void reserve_snapshot(struct Autosave *as, struct Map *mp)
+{
+    size_t n = (size_t)mp->layer_count * mp->chunk_rows * mp->chunk_cols;
+    int count = 0;
+
+    for(size_t i = 0; i < n; i++) {
+        if(mp->dirty[i] & DIRTY_AUTOSAVE) {
+            mp->dirty[i] = (mp->dirty[i] & ~DIRTY_AUTOSAVE) | DIRTY_SNAPSHOT;
+            count++;
+        }
+    }
+
+    if(count <= as->capacity) {
+        return;
+    }
+
+    free(as->chunks);
+    free(as->tiles);
+    as->capacity = count;
+    as->chunks = malloc(as->capacity * sizeof(struct SnapChunk));
+    as->tiles = malloc((size_t)as->capacity * CHUNK_SIZE * CHUNK_SIZE * sizeof(uint16_t));
+
+    if(as->chunks == NULL || as->tiles == NULL) {
+        error_msg();
+    }
+}
+
+/* flag the chunks of a snapshot that failed to write for the next autosave
+ * their flags were cleared when they were copied */
+void autosave_retry(struct Autosave *as, struct Map *mp)
+{
+    for(int i = 0; i < as->count; i++) {
+        const struct SnapChunk *sc = &as->chunks[i];
+
+        mp->dirty[((size_t)sc->layer * mp->chunk_rows + sc->cy) * mp->chunk_cols + sc->cx] |= DIRTY_AUTOSAVE;
+    }
+
+    as->count = 0;
+    as->bytes = 0;
+}
+
+/* called once per frame, starts an autosave every AUTOSAVE_INTERVAL ms and
+ * copies chunks into its snapshot for at most AUTOSAVE_SLICE_US, so a frame
+ * is never held up by more than that however much has changed */
+int autosave_tick(struct Autosave *as, struct Map *mp)
+{
+    size_t n = (size_t)mp->layer_count * mp->chunk_rows * mp->chunk_cols;
+    Uint64 start = 0;
+    Uint64 limit = 0;
+
+    if(as->thread == NULL) {
+        return 0;
+    }
+
+    switch(SDL_AtomicGet(&as->state)) {
+        case AUTOSAVE_IDLE:
+            if(as->bytes < 0) {
+                autosave_retry(as, mp);
+            }
+            if(SDL_GetTicks() - as->last < AUTOSAVE_INTERVAL) {
+                return 0;
+            }
+            as->cursor = 0;
+            as->count = 0;
+            reserve_snapshot(as, mp);
+            SDL_AtomicSet(&as->state, AUTOSAVE_COPYING);
+            break;
+        case AUTOSAVE_WRITING:
+            return 0;
+        default:
+            break;
+    }
+
+    start = SDL_GetPerformanceCounter();
+    limit = SDL_GetPerformanceFrequency() * AUTOSAVE_SLICE_US / 1000000;
+
+    PROF_BEGIN(t);
+    while(as->cursor < n) {
+        size_t i = as->cursor++;
+
+        if(!(mp->dirty[i] & DIRTY_SNAPSHOT)) {
+            continue;
+        }
+
+        snapshot_chunk(as, mp, i);
+
+        if(SDL_GetPerformanceCounter() - start > limit) {
+            break;
+        }
+    }
+    PROF_END(t, "autosave_copy");
+
+    if(as->cursor < n) {
+        return 0;
+    }
+
+    as->last = SDL_GetTicks();
+
+    if(as->count == 0) {
+        SDL_AtomicSet(&as->state, AUTOSAVE_IDLE);
+        return 0;
+    }
+
+    SDL_LockMutex(as->lock);
+    SDL_AtomicSet(&as->state, AUTOSAVE_WRITING);
+    SDL_CondSignal(as->wake);
+    SDL_UnlockMutex(as->lock);
+
+    return 0;
+}
+
+/* stop the autosave thread after it finishes the snapshot it is writing
+ * the autosave file is removed, it is only kept when the editor dies */
+void autosave_free(struct Autosave *as)
+{
+    if(as->thread != NULL) {
+        SDL_LockMutex(as->lock);
+        as->quit = 1;
+        SDL_CondSignal(as->wake);
+        SDL_UnlockMutex(as->lock);
+        SDL_WaitThread(as->thread, NULL);
+        SDL_DestroyCond(as->wake);
+        SDL_DestroyMutex(as->lock);
+    }
+
+    if(as->mp != NULL) {
+        as->mp->autosave = NULL;
+    }
+
+    if(as->file != NULL) {
+        char *log = save_log_name(as->file);
+
+        remove(log);
+        remove(as->file);
+        free(log);
+    }
+
+    free(as->file);
+    free(as->base);
+    free(as->chunks);
+    free(as->tiles);
+    memset(as, 0, sizeof(*as));
+}
+
+/* ms until the next frame of an animated range is due, at most IDLE_WAIT_MS */
+Uint32 anim_wait(const struct SpriteDB *db, Uint32 now)
+{
+    Uint32 wait = IDLE_WAIT_MS;
+
+    for(int r = 0; r < db->range_count; r++) {
+        Uint32 left = db->ranges[r].frame_ms - now % db->ranges[r].frame_ms;
+
+        wait = left < wait ? left : wait;
+    }
+
+    return wait;
+}
+
+/* ms until autosave_tick has work, the next autosave or the copy of one
+ * under way, at most IDLE_WAIT_MS */
+Uint32 autosave_wait(struct Autosave *as, Uint32 now)
+{
+    if(as->thread == NULL) {
+        return IDLE_WAIT_MS;
+    }
+
+    switch(SDL_AtomicGet(&as->state)) {
+        case AUTOSAVE_IDLE:
+            if(now - as->last >= AUTOSAVE_INTERVAL) {
+                return 0;
+            }
+            return as->last + AUTOSAVE_INTERVAL - now < IDLE_WAIT_MS ?
+                as->last + AUTOSAVE_INTERVAL - now : IDLE_WAIT_MS;
+        case AUTOSAVE_COPYING:
+            return 0;
+        default:
+            return IDLE_WAIT_MS;
+    }
+}
+
+/* whether an event can change what is drawn, the mouse moving over the
+ * window with no button held does not. what the edit thread changed comes
+ * as SDL_USEREVENT */
+int event_redraws(const SDL_Event *event, const struct Editor *ed)
+{
+    switch(event->type) {
+        case SDL_MOUSEMOTION:
+            return ed->panning || (event->motion.state & (SDL_BUTTON_LMASK | SDL_BUTTON_MMASK)) != 0;
+        case SDL_QUIT:
+        case SDL_WINDOWEVENT:
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:
+        case SDL_MOUSEWHEEL:
+        case SDL_KEYDOWN:
+        case SDL_USEREVENT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+void print_metadata(struct Map *mp)
+{
+    printf("width: %d\n", mp->cols);
+    printf("height: %d\n", mp->rows);
+    printf("layers: %d\n", mp->layer_count);
+    printf("sprite_width: %d\n", mp->sprite_width);
+    printf("sprite_height: %d\n", mp->sprite_height);
+    printf("name: %s\n", mp->name);
+}
+
+/* render complete spritesheet to screen */
+int render_spritesheet(struct SpriteDB *db, int sheet, struct Editor *ed) 
+{
+    struct Spritesheet *sp = &db->sheets[sheet];
+    SDL_Rect src = { sp->x, sp->y, sp->width, sp->height };
+    SDL_Rect dst = { 0, 0, sp->width, sp->height };
+
+    SDL_RenderCopy(ed->screen.renderer, db->atlases[sp->atlas].texture, &src, &dst);
+
+    return 0;
+}
+
+/* free atlas textures, sheets and sprites, each texture is destroyed once */
+void free_sprite_database(struct SpriteDB *db)
+{
+    for(int i = 0; i < db->atlas_count; i++) {
+        SDL_DestroyTexture(db->atlases[i].texture);
+        free(db->atlases[i].pixels);
+    }
+
+    for(int i = 0; i < db->sheet_count; i++) {
+        SDL_FreeSurface(db->sheets[i].surface);
+        free(db->sheets[i].path);
+        free(db->sheets[i].rect);
+    }
+
+    free(db->ranges);
+    free(db->frame);
+    free(db->animated);
+    free(db->colors);
+
+    free(db->atlases);
+    free(db->sheets);
+    free(db->sprites);
+    memset(db, 0, sizeof(struct SpriteDB));
+}
+
+/* drop the oldest step to make room */
+void undo_drop_oldest(struct Journal *j)
+{
+    j->first++;
+    j->current = j->current < j->first ? j->first : j->current;
+    j->tail = j->first < j->end ? j->entries[j->first % UNDO_ENTRIES].first : j->head;
+}
+
+/* start a step, every undo_record until undo_end becomes one undo entry
+ * so a whole brush stroke or fill is undone at once.
+ * starting a step drops everything that could be redone */
+int undo_begin(struct Journal *j)
+{
+    struct UndoEntry *e = NULL;
+
+    if(j->open) {
+        return 0;
+    }
+
+    /* discard redo steps and their deltas */
+    if(j->current < j->end) {
+        j->head = j->entries[j->current % UNDO_ENTRIES].first;
+        j->end = j->current;
+    }
+
+    if(j->end - j->first == UNDO_ENTRIES) {
+        undo_drop_oldest(j);
+    }
+
+    e = &j->entries[j->end % UNDO_ENTRIES];
+    e->first = j->head;
+    e->count = 0;
+    e->layers = 0;
+    e->bounds = (SDL_Rect){ 0, 0, 0, 0 };
+    j->end++;
+    j->open = 1;
+    j->overflow = 0;
+
+    return 0;
+}
+
+/* add len cells from cell of layer changing from old_id to new_id to the
+ * open step, continuing the last run when they follow on from it.
+ * returns -1 when the step outgrew the budget */
+int undo_push(struct Journal *j, struct UndoEntry *e, uint32_t cell, int layer, uint32_t len,
+        uint16_t old_id, uint16_t new_id)
+{
+    while(len > 0) {
+        struct Delta *last = e->count > 0 ? &j->deltas[(j->head - 1) % j->capacity] : NULL;
+        uint32_t n = len < UINT16_MAX ? len : UINT16_MAX;
+
+        if(last != NULL && last->layer == layer && last->old_id == old_id && last->new_id == new_id &&
+                last->cell + last->len == cell && last->len < UINT16_MAX) {
+            n = n < (uint32_t)(UINT16_MAX - last->len) ? n : (uint32_t)(UINT16_MAX - last->len);
+            last->len += n;
+            cell += n;
+            len -= n;
+            continue;
+        }
+
+        /* make room, a step larger than the whole budget can not be undone */
+        while(j->head - j->tail == j->capacity) {
+            if(j->first == j->end - 1) {
+                j->overflow = 1;
+                verbose_print("undo: step larger than undo budget, not recorded\n");
+                return -1;
+            }
+            undo_drop_oldest(j);
+        }
+
+        j->deltas[j->head % j->capacity] = (struct Delta){ cell, layer, n, old_id, new_id };
+        j->head++;
+        e->count++;
+        cell += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* grow the changed rect and layers of a step by len cells from row, col */
+static inline void undo_bounds(struct UndoEntry *e, int empty, int layer, int row, int col, int len)
+{
+    SDL_Rect r = { col, row, len, 1 };
+
+    if(empty) {
+        e->bounds = r;
+    } else {
+        SDL_UnionRect(&e->bounds, &r, &e->bounds);
+    }
+    e->layers |= 1u << (layer & 31);
+}
+
+/* record that cell row, col of layer changes from old_id to new_id */
+/* a repeat of the last recorded cell, as when a brush sits still, is merged */
+void undo_record(struct Journal *j, const struct Map *mp, int layer, int row, int col,
+        uint16_t old_id, uint16_t new_id)
+{
+    struct UndoEntry *e = &j->entries[(j->end - 1) % UNDO_ENTRIES];
+    uint32_t cell = (uint32_t)row * mp->cols + col;
+    int empty = e->count == 0;
+
+    if(!j->open || j->overflow || old_id == new_id) {
+        return;
+    }
+
+    if(!empty) {
+        struct Delta *last = &j->deltas[(j->head - 1) % j->capacity];
+
+        if(last->len == 1 && last->cell == cell && last->layer == layer) {
+            last->new_id = new_id;
+            return;
+        }
+    }
+
+    if(undo_push(j, e, cell, layer, 1, old_id, new_id) == 0) {
+        undo_bounds(e, empty, layer, row, col, 1);
+    }
+}
+
+/* record that len cells from row, col of layer change from old_ids to new_id */
+/* same as undo_record per cell, for fills that change whole runs of a row.
+ * costs a delta per run of equal old ids, not per cell */
+void undo_record_span(struct Journal *j, const struct Map *mp, int layer, int row, int col,
+        const uint16_t *old_ids, int len, uint16_t new_id)
+{
+    struct UndoEntry *e = &j->entries[(j->end - 1) % UNDO_ENTRIES];
+    uint32_t cell = (uint32_t)row * mp->cols + col;
+    int empty = e->count == 0;
+    int changed = 0;
+
+    if(!j->open || j->overflow) {
+        return;
+    }
+
+    for(int i = 0; i < len;) {
+        int n = 1;
+
+        while(i + n < len && old_ids[i + n] == old_ids[i]) {
+            n++;
+        }
+
+        if(old_ids[i] != new_id) {
+            if(undo_push(j, e, cell + i, layer, n, old_ids[i], new_id) != 0) {
+                return;
+            }
+            changed = 1;
+        }
+        i += n;
+    }
+
+    if(changed) {
+        undo_bounds(e, empty, layer, row, col, len);
+    }
+}
+
+/* close the step, empty or overflowed steps are dropped */
+int undo_end(struct Journal *j)
+{
+    struct UndoEntry *e = &j->entries[(j->end - 1) % UNDO_ENTRIES];
+
+    if(!j->open) {
+        return 0;
+    }
+
+    j->open = 0;
+    j->current = j->end;
+
+    if(e->count == 0 || j->overflow) {
+        j->end--;
+        j->current = j->end;
+        j->head = e->first;
+        if(j->overflow) {
+            /* older steps may depend on cells this step changed */
+            j->first = j->end;
+            j->tail = j->head;
+        }
+    }
+
+    return 0;
+}
+
+/* set len cells of layer from row, col to id, span is where tile_span put
+ * them. keeps the dirty flags, collision bitset and sparse index in step */
+void write_span(struct Map *mp, int layer, int row, int col, uint16_t *span, int len, uint16_t id)
+{
+    snapshot_before_write(mp, layer, row, col, col + len - 1);
+
+    for(int i = 0; i < len; i++) {
+        span[i] = id;
+    }
+
+    mark_dirty(mp, layer, (SDL_Rect){ col, row, len, 1 }, DIRTY_EDIT);
+    if(layer == COLLISION_LAYER) {
+        collision_sync(mp, row, col, len);
+    } else if(sparse_of(mp, layer) != NULL) {
+        sparse_mark(sparse_of(mp, layer), (uint32_t)row * mp->cols + col, len);
+    }
+}
+
+/* set len cells of layer from cell on to id, the run of a delta */
+void set_run(struct Map *mp, int layer, uint32_t cell, uint32_t len, uint16_t id)
+{
+    int row = cell / mp->cols;
+    int col = cell % mp->cols;
+
+    while(len > 0) {
+        int n = 0;
+        uint16_t *span = tile_span(mp, layer, row, col, &n);
+
+        n = (uint32_t)n > len ? (int)len : n;
+        write_span(mp, layer, row, col, span, n, id);
+        len -= n;
+        col += n;
+
+        if(col == mp->cols) {
+            col = 0;
+            row++;
+        }
+    }
+}
+
+/* set every cell of a step back to its old id, last change first */
+/* returns 0 and the changed rect and layers, or -1 with nothing to undo */
+int undo_step(struct Journal *j, struct Map *mp, SDL_Rect *bounds, uint32_t *layers)
+{
+    struct UndoEntry *e = NULL;
+
+    if(j->open || j->current == j->first) {
+        return -1;
+    }
+
+    e = &j->entries[--j->current % UNDO_ENTRIES];
+
+    for(long i = e->first + e->count - 1; i >= e->first; i--) {
+        const struct Delta *d = &j->deltas[i % j->capacity];
+
+        set_run(mp, d->layer, d->cell, d->len, d->old_id);
+    }
+
+    *bounds = e->bounds;
+    *layers = e->layers;
+    return 0;
+}
+
+/* apply a step undone before again, first change first */
+int redo_step(struct Journal *j, struct Map *mp, SDL_Rect *bounds, uint32_t *layers)
+{
+    struct UndoEntry *e = NULL;
+
+    if(j->open || j->current == j->end) {
+        return -1;
+    }
+
+    e = &j->entries[j->current++ % UNDO_ENTRIES];
+
+    for(long i = e->first; i < e->first + e->count; i++) {
+        const struct Delta *d = &j->deltas[i % j->capacity];
+
+        set_run(mp, d->layer, d->cell, d->len, d->new_id);
+    }
+
+    *bounds = e->bounds;
+    *layers = e->layers;
+    return 0;
+}
+
+/* get the batch for texture, creating it on first use */
+/* there are only a few atlas textures so a linear search is enough */
+struct RenderBatch *get_batch(struct Editor *ed, SDL_Texture *texture)
+{
+    struct RenderBatch *b = NULL;
+    int w = 0;
+    int h = 0;
+
+    for(int i = 0; i < ed->batch_count; i++) {
+        if(ed->batches[i].texture == texture) {
+            return &ed->batches[i];
+        }
+    }
+
+    b = realloc(ed->batches, (ed->batch_count + 1) * sizeof(struct RenderBatch));
+
+    if(b == NULL) {
+        error_msg();
+    }
+
+    ed->batches = b;
+    b = &ed->batches[ed->batch_count++];
+
+    SDL_QueryTexture(texture, NULL, NULL, &w, &h);
+    b->texture = texture;
+    b->inv_w = 1.0f / w;
+    b->inv_h = 1.0f / h;
+    b->vertices = NULL;
+    b->quads = 0;
+    b->capacity = 0;
+
+    return b;
+}
+
+/* append one sprite quad at screen x, y to batch */
+static inline void batch_quad(struct RenderBatch *b, float x, float y, float w, float h, const SDL_Rect *src)
+{
+    SDL_Vertex *v = NULL;
+    float u0 = src->x * b->inv_w;
+    float v0 = src->y * b->inv_h;
+    float u1 = (src->x + src->w) * b->inv_w;
+    float v1 = (src->y + src->h) * b->inv_h;
+
+    if(b->quads == b->capacity) {
+        b->capacity = b->capacity == 0 ? 1024 : b->capacity * 2;
+        b->vertices = realloc(b->vertices, b->capacity * 4 * sizeof(SDL_Vertex));
+
+        if(b->vertices == NULL) {
+            error_msg();
+        }
+    }
+
+    v = &b->vertices[b->quads * 4];
+    v[0] = (SDL_Vertex){ { x, y }, { 0xFF, 0xFF, 0xFF, 0xFF }, { u0, v0 } };
+    v[1] = (SDL_Vertex){ { x + w, y }, { 0xFF, 0xFF, 0xFF, 0xFF }, { u1, v0 } };
+    v[2] = (SDL_Vertex){ { x + w, y + h }, { 0xFF, 0xFF, 0xFF, 0xFF }, { u1, v1 } };
+    v[3] = (SDL_Vertex){ { x, y + h }, { 0xFF, 0xFF, 0xFF, 0xFF }, { u0, v1 } };
+    b->quads++;
+}
+
+/* submit every non empty batch with one draw call each and reset them */
+/* quads share one index buffer, 0 1 2 2 3 0 offset by 4 per quad */
+int flush_batches(struct Editor *ed)
+{
+    for(int i = 0; i < ed->batch_count; i++) {
+        struct RenderBatch *b = &ed->batches[i];
+
+        if(b->quads == 0) {
+            continue;
+        }
+
+        if(b->quads > ed->index_quads) {
+            int *indices = realloc(ed->indices, b->capacity * 6 * sizeof(int));
+
+            if(indices == NULL) {
+                error_msg();
+            }
+
+            for(int q = ed->index_quads; q < b->capacity; q++) {
+                indices[q * 6 + 0] = q * 4 + 0;
+                indices[q * 6 + 1] = q * 4 + 1;
+                indices[q * 6 + 2] = q * 4 + 2;
+                indices[q * 6 + 3] = q * 4 + 2;
+                indices[q * 6 + 4] = q * 4 + 3;
+                indices[q * 6 + 5] = q * 4 + 0;
+            }
+
+            ed->indices = indices;
+            ed->index_quads = b->capacity;
+        }
+
+        SDL_RenderGeometry(ed->screen.renderer, b->texture, b->vertices, b->quads * 4,
+                ed->indices, b->quads * 6);
+        ed->stats.draw_calls++;
+        b->quads = 0;
+    }
+
+    return 0;
+}
+
+/* screen position of map pixel p on an axis where the camera is at c
+ * tile edges are floored so neighbouring tiles never overlap or leave a gap */
+static inline int to_screen(int p, int c, float zoom)
+{
+    return (int)floorf((p - c) * zoom);
+}
+
+/* render tiles col0..col1, row0..row1 of one layer, batched per texture
+ * quads are grouped by atlas texture and each group is drawn with
+ * one call. tile id 0 is empty and is skipped, animated tiles are drawn
+ * at their current frame or skipped when still is set, for layer caches
+ * that must not change as the animation runs */
+int render_layer_rect(struct Editor *ed, struct Map *mp, struct SpriteDB *db, int layer,
+        int col0, int row0, int col1, int row1, int still)
+{
+    struct RenderBatch *b = NULL;
+    SDL_Texture *last = NULL;
+    int len = 0;
+    int x = 0;
+    int tw = mp->tile_width;
+    int th = mp->tile_height;
+
+    for(int row = row0; row <= row1; row++) {
+        int y = to_screen(row * th, ed->camera_y, ed->zoom);
+        int h = to_screen((row + 1) * th, ed->camera_y, ed->zoom) - y;
+
+        for(int col = col0; col <= col1; col += len) {
+            const uint16_t *cell = tile_span(mp, layer, row, col, &len);
+
+            if(len > col1 - col + 1) {
+                len = col1 - col + 1;
+            }
+
+            for(int n = 0; n < len; n++) {
+                const struct Sprite *sp = NULL;
+                uint16_t id = cell[n];
+
+                if(id == 0 || id >= db->count) {
+                    continue;
+                }
+
+                if(db->animated[id]) {
+                    if(still) {
+                        continue;
+                    }
+                    id = db->frame[id];
+                }
+
+                sp = &db->sprites[id];
+                if(db->atlases[sp->atlas].texture != last) {
+                    last = db->atlases[sp->atlas].texture;
+                    b = get_batch(ed, last);
+                }
+
+                x = to_screen((col + n) * tw, ed->camera_x, ed->zoom);
+                batch_quad(b, x, y, to_screen((col + n + 1) * tw, ed->camera_x, ed->zoom) - x, h, &sp->rect);
+                ed->stats.tiles++;
+            }
+        }
+    }
+
+    flush_batches(ed);
+
+    return 0;
+}
+
+/* allocate every level of the lod of mp down to 1x1, all chunks stale */
+int lod_init(struct Lod *lod, const struct Map *mp)
+{
+    int w = mp->cols;
+    int h = mp->rows;
+
+    memset(lod, 0, sizeof(*lod));
+    lod->cols = mp->cols;
+    lod->rows = mp->rows;
+
+    if(w <= 0 || h <= 0) {
+        return 0;
+    }
+
+    while(lod->levels < LOD_LEVELS) {
+        struct LodLevel *lv = &lod->level[lod->levels++];
+
+        lv->w = w;
+        lv->h = h;
+        lv->page_cols = (w + LOD_PAGE - 1) / LOD_PAGE;
+        lv->page_rows = (h + LOD_PAGE - 1) / LOD_PAGE;
+        lv->pixels = calloc((size_t)w * h, sizeof(Uint32));
+        lv->pages = calloc(lv->page_cols * lv->page_rows, sizeof(struct LodPage));
+
+        if(lv->pixels == NULL || lv->pages == NULL) {
+            error_msg();
+        }
+
+        if(w == 1 && h == 1) {
+            break;
+        }
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+
+    lod->chunk_cols = (mp->cols + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    lod->chunk_rows = (mp->rows + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    lod->stale_count = lod->chunk_cols * lod->chunk_rows;
+    lod->stale = malloc(lod->stale_count);
+
+    if(lod->stale == NULL) {
+        error_msg();
+    }
+    memset(lod->stale, 1, lod->stale_count);
+
+    return 0;
+}
+
+/* flag the chunks under rect, in tiles, to be downsampled again */
+void lod_mark(struct Lod *lod, SDL_Rect rect)
+{
+    SDL_Rect all = { 0, 0, lod->cols, lod->rows };
+
+    if(lod->stale == NULL || !SDL_IntersectRect(&rect, &all, &rect)) {
+        return;
+    }
+
+    for(int cy = rect.y / CHUNK_SIZE; cy <= (rect.y + rect.h - 1) / CHUNK_SIZE; cy++) {
+        for(int cx = rect.x / CHUNK_SIZE; cx <= (rect.x + rect.w - 1) / CHUNK_SIZE; cx++) {
+            uint8_t *st = &lod->stale[cy * lod->chunk_cols + cx];
+
+            lod->stale_count += !*st;
+            *st = 1;
+        }
+    }
+}
+
+/* add rect, in level pixels, to the dirty part of the pages it covers */
+void lod_page_mark(struct LodLevel *lv, SDL_Rect rect)
+{
+    for(int py = rect.y / LOD_PAGE; py <= (rect.y + rect.h - 1) / LOD_PAGE; py++) {
+        for(int px = rect.x / LOD_PAGE; px <= (rect.x + rect.w - 1) / LOD_PAGE; px++) {
+            struct LodPage *pg = &lv->pages[py * lv->page_cols + px];
+            SDL_Rect page = { px * LOD_PAGE, py * LOD_PAGE, LOD_PAGE, LOD_PAGE };
+            SDL_Rect part;
+
+            SDL_IntersectRect(&rect, &page, &part);
+            if(SDL_RectEmpty(&pg->dirty)) {
+                pg->dirty = part;
+            } else {
+                SDL_UnionRect(&pg->dirty, &part, &pg->dirty);
+            }
+        }
+    }
+}
+
+/* blend src over dst, straight alpha, both RGBA32 */
+static inline void lod_blend(Uint8 *dst, const Uint8 *src)
+{
+    int sa = src[3];
+    int da = dst[3] * (255 - sa) / 255;
+    int a = sa + da;
+
+    if(sa == 0) {
+        return;
+    }
+
+    for(int c = 0; c < 3; c++) {
+        dst[c] = (src[c] * sa + dst[c] * da) / a;
+    }
+    dst[3] = a;
+}
+
+/* rect of dst, in its pixels, is the average of the 2x2 blocks of src
+ * under it, weighted by alpha. blocks cut off by an odd edge count the
+ * missing pixels as transparent */
+void lod_downsample(const struct LodLevel *src, struct LodLevel *dst, SDL_Rect rect)
+{
+    for(int y = rect.y; y < rect.y + rect.h; y++) {
+        for(int x = rect.x; x < rect.x + rect.w; x++) {
+            Uint8 *out = (Uint8 *)&dst->pixels[y * dst->w + x];
+            int sum[4] = {0};
+
+            for(int sy = y * 2; sy < y * 2 + 2 && sy < src->h; sy++) {
+                for(int sx = x * 2; sx < x * 2 + 2 && sx < src->w; sx++) {
+                    const Uint8 *px = (const Uint8 *)&src->pixels[sy * src->w + sx];
+
+                    sum[0] += px[0] * px[3];
+                    sum[1] += px[1] * px[3];
+                    sum[2] += px[2] * px[3];
+                    sum[3] += px[3];
+                }
+            }
+
+            if(sum[3] == 0) {
+                dst->pixels[y * dst->w + x] = 0;
+                continue;
+            }
+
+            out[0] = sum[0] / sum[3];
+            out[1] = sum[1] / sum[3];
+            out[2] = sum[2] / sum[3];
+            out[3] = sum[3] / 4;
+        }
+    }
+}
+
+/* level 0 pixels of chunk cx, cy from the colors of its tiles, layers
+ * blended in order, then the part of every level above it */
+void lod_build_chunk(struct Lod *lod, struct Map *mp, const struct SpriteDB *db, int cx, int cy)
+{
+    struct LodLevel *lv = &lod->level[0];
+    SDL_Rect rect = { cx * CHUNK_SIZE, cy * CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE };
+
+    rect.w = mp->cols - rect.x < CHUNK_SIZE ? mp->cols - rect.x : CHUNK_SIZE;
+    rect.h = mp->rows - rect.y < CHUNK_SIZE ? mp->rows - rect.y : CHUNK_SIZE;
+
+    for(int r = rect.y; r < rect.y + rect.h; r++) {
+        Uint32 *out = &lv->pixels[(size_t)r * lv->w + rect.x];
+
+        memset(out, 0, rect.w * sizeof(Uint32));
+
+        for(int l = 0; l < mp->layer_count; l++) {
+            int len = 0;
+            const uint16_t *cell = tile_span(mp, l, r, rect.x, &len);
+
+            for(int c = 0; c < rect.w; c++) {
+                if(cell[c] != 0 && cell[c] < db->count) {
+                    lod_blend((Uint8 *)&out[c], (const Uint8 *)&db->colors[cell[c]]);
+                }
+            }
+        }
+    }
+    lod_page_mark(lv, rect);
+
+    for(int l = 1; l < lod->levels; l++) {
+        SDL_Rect up = { rect.x / 2, rect.y / 2, 0, 0 };
+
+        up.w = (rect.x + rect.w + 1) / 2 - up.x;
+        up.h = (rect.y + rect.h + 1) / 2 - up.y;
+        lod_downsample(&lod->level[l - 1], &lod->level[l], up);
+        lod_page_mark(&lod->level[l], up);
+        rect = up;
+    }
+}
+
+/* rebuild stale chunks for at most LOD_SLICE_US, a whole map is built
+ * over a number of frames and an edit costs only the chunks it touched.
+ * a chunked map only has its resident and filled chunks downsampled, the
+ * others stay stale until they are loaded. returns 1 when time ran out first */
+int lod_update(struct Lod *lod, struct Map *mp, const struct SpriteDB *db)
+{
+    int total = lod->chunk_cols * lod->chunk_rows;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    lod->busy = 0;
+
+    if(lod->stale_count == 0 || db->colors == NULL) {
+        return 0;
+    }
+
+    PROF_BEGIN(t);
+    for(int n = 0; n < total && lod->stale_count > 0; n++) {
+        struct Chunk *c = NULL;
+        int i = lod->cursor;
+        int cx = i % lod->chunk_cols;
+        int cy = i / lod->chunk_cols;
+
+        lod->cursor = (lod->cursor + 1) % total;
+        if(!lod->stale[i] || (mp->chunks != NULL && (c = chunk_find(mp, cx, cy)) == NULL) ||
+                (c != NULL && !c->filled)) {
+            continue;
+        }
+
+        lod->stale[i] = 0;
+        lod->stale_count--;
+        lod_build_chunk(lod, mp, db, cx, cy);
+
+        if(elapsed_sec(start) * 1000000.0 > LOD_SLICE_US) {
+            lod->busy = lod->stale_count > 0;
+            break;
+        }
+    }
+    PROF_END(t, "lod_update");
+
+    return lod->busy;
+}
+
+/* texture of page i of a level, created on first use, with the changed
+ * part of the level uploaded. NULL when the texture can not be created */
+SDL_Texture *lod_page_texture(struct Editor *ed, struct LodLevel *lv, int i)
+{
+    struct LodPage *pg = &lv->pages[i];
+    int px = i % lv->page_cols * LOD_PAGE;
+    int py = i / lv->page_cols * LOD_PAGE;
+
+    if(pg->texture == NULL) {
+        int pw = lv->w - px < LOD_PAGE ? lv->w - px : LOD_PAGE;
+        int ph = lv->h - py < LOD_PAGE ? lv->h - py : LOD_PAGE;
+
+        pg->texture = SDL_CreateTexture(ed->screen.renderer, SDL_PIXELFORMAT_RGBA32,
+                SDL_TEXTUREACCESS_STATIC, pw, ph);
+
+        if(pg->texture == NULL) {
+            return NULL;
+        }
+        SDL_SetTextureBlendMode(pg->texture, SDL_BLENDMODE_BLEND);
+        pg->dirty = (SDL_Rect){ px, py, pw, ph };
+    }
+
+    if(!SDL_RectEmpty(&pg->dirty)) {
+        SDL_Rect local = { pg->dirty.x - px, pg->dirty.y - py, pg->dirty.w, pg->dirty.h };
+
+        SDL_UpdateTexture(pg->texture, &local, &lv->pixels[(size_t)pg->dirty.y * lv->w + pg->dirty.x],
+                lv->w * sizeof(Uint32));
+        pg->dirty = (SDL_Rect){ 0, 0, 0, 0 };
+    }
+
+    return pg->texture;
+}
+
+/* draw the tiles in view from the lod level with about one pixel per
+ * screen pixel, one copy per visible page whatever the map size */
+void render_lod(struct Editor *ed, struct Map *mp, SDL_Rect view)
+{
+    struct Lod *lod = &ed->lod;
+    struct LodLevel *lv = NULL;
+    float tile = mp->tile_width * ed->zoom;
+    int level = 0;
+    int x0, y0, x1, y1;
+
+    if(lod->levels == 0) {
+        return;
+    }
+
+    while(level + 1 < lod->levels && tile * (2 << level) <= 1.0f) {
+        level++;
+    }
+
+    lv = &lod->level[level];
+    x0 = view.x >> level;
+    y0 = view.y >> level;
+    x1 = (view.x + view.w - 1) >> level;
+    y1 = (view.y + view.h - 1) >> level;
+
+    for(int py = y0 / LOD_PAGE; py <= y1 / LOD_PAGE; py++) {
+        for(int px = x0 / LOD_PAGE; px <= x1 / LOD_PAGE; px++) {
+            SDL_Texture *t = lod_page_texture(ed, lv, py * lv->page_cols + px);
+            int sx0 = x0 > px * LOD_PAGE ? x0 : px * LOD_PAGE;
+            int sy0 = y0 > py * LOD_PAGE ? y0 : py * LOD_PAGE;
+            int sx1 = x1 < (px + 1) * LOD_PAGE - 1 ? x1 : (px + 1) * LOD_PAGE - 1;
+            int sy1 = y1 < (py + 1) * LOD_PAGE - 1 ? y1 : (py + 1) * LOD_PAGE - 1;
+            int tx1 = (sx1 + 1) << level;
+            int ty1 = (sy1 + 1) << level;
+            SDL_Rect src = { sx0 - px * LOD_PAGE, sy0 - py * LOD_PAGE, sx1 - sx0 + 1, sy1 - sy0 + 1 };
+            SDL_Rect dst;
+
+            if(t == NULL) {
+                continue;
+            }
+
+            /* the last pixel of an odd level covers fewer tiles */
+            tx1 = tx1 > mp->cols ? mp->cols : tx1;
+            ty1 = ty1 > mp->rows ? mp->rows : ty1;
+            dst.x = to_screen((sx0 << level) * mp->tile_width, ed->camera_x, ed->zoom);
+            dst.y = to_screen((sy0 << level) * mp->tile_height, ed->camera_y, ed->zoom);
+            dst.w = to_screen(tx1 * mp->tile_width, ed->camera_x, ed->zoom) - dst.x;
+            dst.h = to_screen(ty1 * mp->tile_height, ed->camera_y, ed->zoom) - dst.y;
+
+            SDL_RenderCopy(ed->screen.renderer, t, &src, &dst);
+            ed->stats.draw_calls++;
+        }
+    }
+}
+
+/* the whole map in the top right corner from the first lod level that
+ * fits on one page, with the part on screen outlined. it follows edits
+ * as their chunks are downsampled */
+void render_minimap(struct Editor *ed, const struct Map *mp)
+{
+    SDL_Renderer *r = ed->screen.renderer;
+    struct Lod *lod = &ed->lod;
+    struct LodLevel *lv = NULL;
+    SDL_Texture *t = NULL;
+    int map_w = mp->cols * mp->tile_width;
+    int map_h = mp->rows * mp->tile_height;
+    float scale = 0.0f;
+    SDL_Rect box;
+    SDL_Rect view;
+    int level = 0;
+
+    if(!ed->minimap || lod->levels == 0) {
+        return;
+    }
+
+    while(level + 1 < lod->levels &&
+            (lod->level[level].w > MINIMAP_SIZE || lod->level[level].h > MINIMAP_SIZE)) {
+        level++;
+    }
+
+    lv = &lod->level[level];
+    t = lod_page_texture(ed, lv, 0);
+
+    if(t == NULL) {
+        return;
+    }
+
+    scale = (float)MINIMAP_SIZE / (map_w > map_h ? map_w : map_h);
+    box.w = map_w * scale > 1.0f ? (int)(map_w * scale) : 1;
+    box.h = map_h * scale > 1.0f ? (int)(map_h * scale) : 1;
+    box.x = ed->screen.w - box.w - 8;
+    box.y = 8;
+
+    view.x = box.x + (int)floorf(ed->camera_x * scale);
+    view.y = box.y + (int)floorf(ed->camera_y * scale);
+    view.w = (int)ceilf(ed->screen.w / ed->zoom * scale);
+    view.h = (int)ceilf(ed->screen.h / ed->zoom * scale);
+
+    SDL_SetRenderDrawColor(r, 0, 0, 0, 0xFF);
+    SDL_RenderFillRect(r, &box);
+    SDL_RenderCopy(r, t, &(SDL_Rect){ 0, 0, lv->w, lv->h }, &box);
+    SDL_SetRenderDrawColor(r, 0xFF, 0xFF, 0, 0xFF);
+    SDL_RenderDrawRect(r, &view);
+    SDL_SetRenderDrawColor(r, 0xFF, 0xFF, 0xFF, 0xFF);
+    ed->stats.draw_calls += 3;
+}
+
+/* mark tiles of layer as changed so its cached texture is redrawn there
+ * layer -1 marks every layer, for a camera move that changes no tile.
+ * rect is in tiles */
+void invalidate_tiles(struct Editor *ed, int layer, SDL_Rect rect)
+{
+    /* edited chunks are downsampled again */
+    if(layer != -1) {
+        lod_mark(&ed->lod, rect);
+    }
+
+    /* the animated tiles of edited chunks are listed again */
+    if(layer != -1 && ed->anim_chunks != NULL && rect.w > 0 && rect.h > 0) {
+        int cx1 = (rect.x + rect.w - 1) / CHUNK_SIZE;
+        int cy1 = (rect.y + rect.h - 1) / CHUNK_SIZE;
+
+        cx1 = cx1 >= ed->anim_cols ? ed->anim_cols - 1 : cx1;
+        cy1 = cy1 >= ed->anim_rows ? ed->anim_rows - 1 : cy1;
+
+        for(int cy = rect.y / CHUNK_SIZE; cy <= cy1; cy++) {
+            for(int cx = rect.x / CHUNK_SIZE; cx <= cx1; cx++) {
+                ed->anim_chunks[(layer * ed->anim_rows + cy) * ed->anim_cols + cx].built = 0;
+            }
+        }
+    }
+
+    for(int i = 0; i < ed->cache_layers; i++) {
+        struct LayerCache *lc = &ed->layer_cache[i];
+
+        if(layer != -1 && layer != i) {
+            continue;
+        }
+
+        if(SDL_RectEmpty(&lc->dirty)) {
+            lc->dirty = rect;
+        } else {
+            SDL_UnionRect(&lc->dirty, &rect, &lc->dirty);
+        }
+    }
+}
+
+/* clear every cached layer texture, a dirty rect only covers tiles, so
+ * after a camera move the pixels off the map would keep old tiles */
+void clear_layer_cache(struct Editor *ed)
+{
+    SDL_Renderer *r = ed->screen.renderer;
+
+    SDL_SetRenderDrawColor(r, 0, 0, 0, 0);
+    for(int i = 0; i < ed->cache_layers; i++) {
+        if(ed->layer_cache[i].texture != NULL) {
+            SDL_SetRenderTarget(r, ed->layer_cache[i].texture);
+            SDL_RenderClear(r);
+        }
+    }
+    SDL_SetRenderTarget(r, NULL);
+    SDL_SetRenderDrawColor(r, 0xFF, 0xFF, 0xFF, 0xFF);
+}
+
+/* create a screen sized render target per layer, all fully dirty */
+int alloc_layer_cache(struct Editor *ed, struct Map *mp)
+{
+    ed->layer_cache = calloc(mp->layer_count, sizeof(struct LayerCache));
+
+    if(ed->layer_cache == NULL) {
+        error_msg();
+    }
+
+    ed->cache_layers = mp->layer_count;
+
+    for(int i = 0; i < ed->cache_layers; i++) {
+        SDL_Texture *t = SDL_CreateTexture(ed->screen.renderer, SDL_PIXELFORMAT_RGBA32,
+                SDL_TEXTUREACCESS_TARGET, ed->screen.w, ed->screen.h);
+
+        /* without render targets every layer is drawn directly each frame */
+        if(t != NULL) {
+            SDL_SetTextureBlendMode(t, SDL_BLENDMODE_BLEND);
+        }
+        ed->layer_cache[i].texture = t;
+    }
+
+    ed->cache_camera_x = ed->camera_x;
+    ed->cache_camera_y = ed->camera_y;
+    clear_layer_cache(ed);
+    invalidate_tiles(ed, -1, (SDL_Rect){ 0, 0, mp->cols, mp->rows });
+
+    return 0;
+}
+
+/* visible part of the map in tiles, empty when the camera is off the map */
+/* the screen covers screen / zoom map pixels */
+SDL_Rect view_tiles(const struct Editor *ed, const struct Map *mp)
+{
+    SDL_Rect view;
+    SDL_Rect all = { 0, 0, mp->cols, mp->rows };
+    int right = ed->camera_x + (int)ceilf(ed->screen.w / ed->zoom);
+    int bottom = ed->camera_y + (int)ceilf(ed->screen.h / ed->zoom);
+
+    if(right <= 0 || bottom <= 0) {
+        return (SDL_Rect){ 0, 0, 0, 0 };
+    }
+
+    view.x = ed->camera_x < 0 ? 0 : ed->camera_x / mp->tile_width;
+    view.y = ed->camera_y < 0 ? 0 : ed->camera_y / mp->tile_height;
+    view.w = (right - 1) / mp->tile_width - view.x + 1;
+    view.h = (bottom - 1) / mp->tile_height - view.y + 1;
+
+    if(!SDL_IntersectRect(&view, &all, &view)) {
+        return (SDL_Rect){ 0, 0, 0, 0 };
+    }
+
+    return view;
+}
+
+/* list the animated tiles of chunk cx, cy of layer */
+void anim_chunk_build(struct AnimChunk *ac, struct Map *mp, struct SpriteDB *db, int layer, int cx, int cy)
+{
+    int x0 = cx * CHUNK_SIZE;
+    int y0 = cy * CHUNK_SIZE;
+    int w = (mp->cols - x0 < CHUNK_SIZE) ? mp->cols - x0 : CHUNK_SIZE;
+    int h = (mp->rows - y0 < CHUNK_SIZE) ? mp->rows - y0 : CHUNK_SIZE;
+
+    ac->count = 0;
+
+    for(int r = 0; r < h; r++) {
+        int len = 0;
+        const uint16_t *cell = tile_span(mp, layer, y0 + r, x0, &len);
+
+        for(int c = 0; c < w; c++) {
+            if(cell[c] == 0 || cell[c] >= db->count || !db->animated[cell[c]]) {
+                continue;
+            }
+
+            if(ac->count == ac->capacity) {
+                ac->capacity = ac->capacity == 0 ? 16 : ac->capacity * 2;
+                ac->cells = realloc(ac->cells, ac->capacity * sizeof(uint16_t));
+
+                if(ac->cells == NULL) {
+                    error_msg();
+                }
+            }
+            ac->cells[ac->count++] = r * CHUNK_SIZE + c;
+        }
+    }
+
+    ac->built = 1;
+}
+
+/* draw the animated tiles of layer inside view at their current frame
+ * straight to the screen, over the cached layer. only the lists of the
+ * visible chunks are walked, the cache itself never holds animated tiles */
+void render_animated(struct Editor *ed, struct Map *mp, struct SpriteDB *db, int layer, SDL_Rect view)
+{
+    struct RenderBatch *b = NULL;
+    SDL_Texture *last = NULL;
+    int tw = mp->tile_width;
+    int th = mp->tile_height;
+    int x = 0;
+    int y = 0;
+
+    if(db->range_count == 0) {
+        return;
+    }
+
+    for(int cy = view.y / CHUNK_SIZE; cy <= (view.y + view.h - 1) / CHUNK_SIZE; cy++) {
+        for(int cx = view.x / CHUNK_SIZE; cx <= (view.x + view.w - 1) / CHUNK_SIZE; cx++) {
+            struct AnimChunk *ac = &ed->anim_chunks[(layer * ed->anim_rows + cy) * ed->anim_cols + cx];
+
+            if(!ac->built) {
+                anim_chunk_build(ac, mp, db, layer, cx, cy);
+            }
+
+            for(int i = 0; i < ac->count; i++) {
+                int row = cy * CHUNK_SIZE + ac->cells[i] / CHUNK_SIZE;
+                int col = cx * CHUNK_SIZE + ac->cells[i] % CHUNK_SIZE;
+                const struct Sprite *sp = &db->sprites[db->frame[get_tile(mp, layer, row, col)]];
+
+                if(db->atlases[sp->atlas].texture != last) {
+                    last = db->atlases[sp->atlas].texture;
+                    b = get_batch(ed, last);
+                }
+
+                x = to_screen(col * tw, ed->camera_x, ed->zoom);
+                y = to_screen(row * th, ed->camera_y, ed->zoom);
+                batch_quad(b, x, y, to_screen((col + 1) * tw, ed->camera_x, ed->zoom) - x,
+                        to_screen((row + 1) * th, ed->camera_y, ed->zoom) - y, &sp->rect);
+                ed->stats.tiles++;
+            }
+        }
+    }
+
+    flush_batches(ed);
+}
+
+/* render the part of every layer inside the camera rectangle
+ * each layer is kept pre-rendered in its own texture, only the dirty part
+ * of a layer that overlaps the screen is cleared and drawn again, then the
+ * layer textures are composited in order. while painting one layer the
+ * other layers cost one copy each, whatever the map holds.
+ * moving the camera makes every layer dirty */
+int render_layers(struct Editor *ed, struct Map *mp, struct SpriteDB *db)
+{
+    SDL_Renderer *r = ed->screen.renderer;
+    int tw = mp->tile_width;
+    int th = mp->tile_height;
+    SDL_Rect view;
+
+    ed->stats.draw_calls = 0;
+    ed->stats.tiles = 0;
+
+    if(ed->cache_layers != mp->layer_count) {
+        for(int i = 0; i < ed->cache_layers; i++) {
+            SDL_DestroyTexture(ed->layer_cache[i].texture);
+        }
+        free(ed->layer_cache);
+        alloc_layer_cache(ed, mp);
+    }
+
+    /* one list of animated tiles per chunk of every layer */
+    if(ed->anim_cols != mp->chunk_cols || ed->anim_rows != mp->chunk_rows ||
+            ed->anim_chunk_count != mp->layer_count * mp->chunk_rows * mp->chunk_cols) {
+        for(int i = 0; i < ed->anim_chunk_count; i++) {
+            free(ed->anim_chunks[i].cells);
+        }
+        ed->anim_cols = mp->chunk_cols;
+        ed->anim_rows = mp->chunk_rows;
+        ed->anim_chunk_count = mp->layer_count * mp->chunk_rows * mp->chunk_cols;
+        ed->anim_chunks = realloc(ed->anim_chunks, ed->anim_chunk_count * sizeof(struct AnimChunk));
+
+        if(ed->anim_chunks == NULL) {
+            error_msg();
+        }
+        memset(ed->anim_chunks, 0, ed->anim_chunk_count * sizeof(struct AnimChunk));
+    }
+
+    if(ed->camera_x != ed->cache_camera_x || ed->camera_y != ed->cache_camera_y ||
+            ed->zoom != ed->cache_zoom) {
+        ed->cache_camera_x = ed->camera_x;
+        ed->cache_camera_y = ed->camera_y;
+        ed->cache_zoom = ed->zoom;
+        clear_layer_cache(ed);
+        invalidate_tiles(ed, -1, (SDL_Rect){ 0, 0, mp->cols, mp->rows });
+    }
+
+    /* the lod is only built once it is drawn, zoomed out or in the
+     * minimap, edits made meanwhile leave their chunks stale */
+    if(tw * ed->zoom < LOD_TILE_PX || ed->minimap) {
+        if(ed->lod.cols != mp->cols || ed->lod.rows != mp->rows) {
+            lod_free(&ed->lod);
+            lod_init(&ed->lod, mp);
+        }
+        lod_update(&ed->lod, mp, db);
+    } else {
+        ed->lod.busy = 0;
+    }
+
+    /* visible tiles */
+    view = view_tiles(ed, mp);
+
+    if(view.w <= 0 || view.h <= 0) {
+        return 0;
+    }
+
+    /* tiles a few pixels across are drawn from the lod instead */
+    if(tw * ed->zoom < LOD_TILE_PX) {
+        render_lod(ed, mp, view);
+        return 0;
+    }
+
+    map_stream_view(mp, view.x, view.y, view.w, view.h);
+
+    for(int i = 0; i < mp->layer_count; i++) {
+        struct LayerCache *lc = &ed->layer_cache[i];
+        SDL_Rect area;
+
+        if(lc->texture == NULL) {
+            render_layer_rect(ed, mp, db, i, view.x, view.y, view.x + view.w - 1, view.y + view.h - 1, 0);
+            continue;
+        }
+
+        if(SDL_IntersectRect(&lc->dirty, &view, &area)) {
+            SDL_Rect px;
+
+            px.x = to_screen(area.x * tw, ed->camera_x, ed->zoom);
+            px.y = to_screen(area.y * th, ed->camera_y, ed->zoom);
+            px.w = to_screen((area.x + area.w) * tw, ed->camera_x, ed->zoom) - px.x;
+            px.h = to_screen((area.y + area.h) * th, ed->camera_y, ed->zoom) - px.y;
+
+            SDL_SetRenderTarget(r, lc->texture);
+            SDL_SetRenderDrawBlendMode(r, SDL_BLENDMODE_NONE);
+            SDL_SetRenderDrawColor(r, 0, 0, 0, 0);
+            SDL_RenderFillRect(r, &px);
+            SDL_SetRenderDrawColor(r, 0xFF, 0xFF, 0xFF, 0xFF);
+            render_layer_rect(ed, mp, db, i, area.x, area.y, area.x + area.w - 1, area.y + area.h - 1, 1);
+            SDL_SetRenderTarget(r, NULL);
+        }
+        lc->dirty = (SDL_Rect){ 0, 0, 0, 0 };
+
+        SDL_RenderCopy(r, lc->texture, NULL, NULL);
+        ed->stats.draw_calls++;
+        render_animated(ed, mp, db, i, view);
+    }
+
+    return 0;
+}
+
+/* id of the event under screen position x, y, 0 when there is none */
+/* a chunked map is not indexed, the chunk under the mouse is looked at
+ * when it is held */
+uint16_t event_at(const struct Editor *ed, struct Map *mp, int x, int y)
+{
+    const struct SparseLayer *sl = NULL;
+    const struct Chunk *c = NULL;
+    int mx = ed->camera_x + (int)floorf(x / ed->zoom);
+    int my = ed->camera_y + (int)floorf(y / ed->zoom);
+    int col = mx / mp->tile_width;
+    int row = my / mp->tile_height;
+
+    if(mx < 0 || my < 0 || col >= mp->cols || row >= mp->rows || EVENT_LAYER >= mp->layer_count) {
+        return 0;
+    }
+
+    if(mp->chunks != NULL) {
+        c = chunk_find(mp, col / CHUNK_SIZE, row / CHUNK_SIZE);
+
+        return c == NULL || !c->filled ? 0 :
+            c->tiles[((size_t)EVENT_LAYER * CHUNK_SIZE + row % CHUNK_SIZE) * CHUNK_SIZE + col % CHUNK_SIZE];
+    }
+
+    sl = map_sparse(mp, EVENT_LAYER);
+    return sparse_get(mp, sl, row, col);
+}
+
+/* events on screen, up to max are stored in out, returns how many there are */
+/* a chunked map is not indexed, the chunks held on screen are looked at */
+int events_in_view(const struct Editor *ed, struct Map *mp, struct SparseCell *out, int max)
+{
+    SDL_Rect view = view_tiles(ed, mp);
+    int count = 0;
+
+    if(EVENT_LAYER >= mp->layer_count || view.w <= 0 || view.h <= 0) {
+        return 0;
+    }
+
+    if(mp->chunks == NULL) {
+        return sparse_rect(mp, map_sparse(mp, EVENT_LAYER), view, out, max);
+    }
+
+    for(int cy = view.y / CHUNK_SIZE; cy <= (view.y + view.h - 1) / CHUNK_SIZE; cy++) {
+        for(int cx = view.x / CHUNK_SIZE; cx <= (view.x + view.w - 1) / CHUNK_SIZE; cx++) {
+            const struct Chunk *c = chunk_find(mp, cx, cy);
+            SDL_Rect area = { cx * CHUNK_SIZE, cy * CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE };
+
+            if(c == NULL || !c->filled || !SDL_IntersectRect(&area, &view, &area)) {
+                continue;
+            }
+
+            for(int row = area.y; row < area.y + area.h; row++) {
+                const uint16_t *cell = c->tiles + ((size_t)EVENT_LAYER * CHUNK_SIZE + row % CHUNK_SIZE) * CHUNK_SIZE;
+
+                for(int col = area.x; col < area.x + area.w; col++) {
+                    if(cell[col % CHUNK_SIZE] == 0) {
+                        continue;
+                    }
+                    if(count < max) {
+                        out[count].row = row;
+                        out[count].col = col;
+                        out[count].id = cell[col % CHUNK_SIZE];
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+/* show frames, draw calls and tiles of the last frame in the window title once a second */
+/* along with the events on screen and the one under the mouse */
+void report_render_stats(struct Editor *ed, struct Map *mp)
+{
+    char title[160];
+    Uint32 now = SDL_GetTicks();
+    int x = 0;
+    int y = 0;
+
+    ed->stats.frames++;
+
+    if(now - ed->stats.last_report < 1000) {
+        return;
+    }
+
+    SDL_GetMouseState(&x, &y);
+    sprintf(title, "%s - %d fps, %d draw calls, %d tiles, %d events, event %d", WIN_TITLE,
+            ed->stats.frames, ed->stats.draw_calls, ed->stats.tiles,
+            events_in_view(ed, mp, NULL, 0), event_at(ed, mp, x, y));
+    SDL_SetWindowTitle(ed->screen.window, title);
+
+    ed->stats.frames = 0;
+    ed->stats.last_report = now;
+}
+
+/* set a cell to id through the undo journal and mark it for redraw */
+void paint_tile(struct Editor *ed, struct Map *mp, int layer, int row, int col, uint16_t id)
+{
+    uint16_t old = get_tile(mp, layer, row, col);
+
+    if(old == id) {
+        return;
+    }
+
+    undo_record(&ed->undo, mp, layer, row, col, old, id);
+    set_tile(mp, layer, row, col, id);
+    invalidate_tiles(ed, layer, (SDL_Rect){ col, row, 1, 1 });
+}
+
+/* paint every cell on the line from row0, col0 to row1, col1, so a fast
+ * stroke leaves no gaps between the mouse positions it was sampled at */
+void paint_line(struct Editor *ed, struct Map *mp, int layer, int row0, int col0, int row1, int col1, uint16_t id)
+{
+    int dc = abs(col1 - col0);
+    int dr = -abs(row1 - row0);
+    int sc = col0 < col1 ? 1 : -1;
+    int sr = row0 < row1 ? 1 : -1;
+    int err = dc + dr;
+
+    for(;;) {
+        int e2 = 2 * err;
+
+        paint_tile(ed, mp, layer, row0, col0, id);
+
+        if(row0 == row1 && col0 == col1) {
+            break;
+        }
+
+        /* both steps are decided on the error before either is taken */
+        if(e2 >= dr) {
+            err += dr;
+            col0 += sc;
+        }
+        if(e2 <= dc) {
+            err += dc;
+            row0 += sr;
+        }
+    }
+}
+
+/* tile row, col under screen position x, y, returns -1 outside the map */
+int screen_to_tile(const struct Editor *ed, const struct Map *mp, int x, int y, int *row, int *col)
+{
+    int mx = ed->camera_x + (int)floorf(x / ed->zoom);
+    int my = ed->camera_y + (int)floorf(y / ed->zoom);
+
+    *col = mx / mp->tile_width;
+    *row = my / mp->tile_height;
+
+    if(mx < 0 || my < 0 || *col >= mp->cols || *row >= mp->rows ||
+            ed->selected_layer >= mp->layer_count) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* smallest zoom, the whole map on screen, never above 1 */
+float zoom_min(const struct Editor *ed, const struct Map *mp)
+{
+    float zx = (float)ed->screen.w / (mp->cols * mp->tile_width);
+    float zy = (float)ed->screen.h / (mp->rows * mp->tile_height);
+    float z = zx < zy ? zx : zy;
+
+    return z < 1.0f ? z : 1.0f;
+}
+
+/* multiply the zoom by factor, the map pixel under screen x, y stays put */
+void zoom_camera(struct Editor *ed, const struct Map *mp, int x, int y, float factor)
+{
+    float zoom = ed->zoom * factor;
+    float lo = zoom_min(ed, mp);
+    int mx = ed->camera_x + (int)floorf(x / ed->zoom);
+    int my = ed->camera_y + (int)floorf(y / ed->zoom);
+
+    zoom = zoom < lo ? lo : zoom > ZOOM_MAX ? ZOOM_MAX : zoom;
+    ed->camera_x = mx - (int)floorf(x / zoom);
+    ed->camera_y = my - (int)floorf(y / zoom);
+    ed->zoom = zoom;
+}
+
+/* zoom out until the whole map is on screen, centered */
+void fit_camera(struct Editor *ed, const struct Map *mp)
+{
+    ed->zoom = zoom_min(ed, mp);
+    ed->camera_x = (mp->cols * mp->tile_width - (int)(ed->screen.w / ed->zoom)) / 2;
+    ed->camera_y = (mp->rows * mp->tile_height - (int)(ed->screen.h / ed->zoom)) / 2;
+}
+
+/* dragging with the middle button keeps the map pixel that was clicked
+ * under the mouse */
+void pan_press(struct Editor *ed, int x, int y)
+{
+    ed->panning = 1;
+    ed->pan_x = ed->camera_x + (int)floorf(x / ed->zoom);
+    ed->pan_y = ed->camera_y + (int)floorf(y / ed->zoom);
+}
+
+void pan_drag(struct Editor *ed, int x, int y)
+{
+    if(ed->panning) {
+        ed->camera_x = ed->pan_x - (int)floorf(x / ed->zoom);
+        ed->camera_y = ed->pan_y - (int)floorf(y / ed->zoom);
+    }
+}
+
+/* set cells col0..col1 of row in layer to id through the undo journal */
+/* walks the row a span at a time, the caller marks the cells for redraw */
+void fill_span(struct Editor *ed, struct Map *mp, int layer, int row, int col0, int col1, uint16_t id)
+{
+    int col = col0;
+
+    while(col <= col1) {
+        int len = 0;
+        uint16_t *span = tile_span(mp, layer, row, col, &len);
+
+        len = len > col1 - col + 1 ? col1 - col + 1 : len;
+        undo_record_span(&ed->undo, mp, layer, row, col, span, len, id);
+        write_span(mp, layer, row, col, span, len, id);
+        col += len;
+    }
+}
+
+/* set every cell of layer inside the tile rect to id */
+void fill_rect(struct Editor *ed, struct Map *mp, int layer, SDL_Rect rect, uint16_t id)
+{
+    SDL_Rect all = { 0, 0, mp->cols, mp->rows };
+
+    if(!SDL_IntersectRect(&rect, &all, &rect)) {
+        return;
+    }
+
+    PROF_BEGIN(t);
+    for(int row = rect.y; row < rect.y + rect.h; row++) {
+        fill_span(ed, mp, layer, row, rect.x, rect.x + rect.w - 1, id);
+    }
+    PROF_END(t, "fill_rect");
+
+    invalidate_tiles(ed, layer, rect);
+}
+
+/* a run of cells x1..x2 on row y, dy is the direction it was reached from */
+struct FillSpan {
+    int x1;
+    int x2;
+    int y;
+    int dy;
+};
+
+/* is col of a row on the map and set to id, cells is the row when the map
+ * has a flat layer store and NULL when it is streamed */
+static inline int fill_match(const struct Map *mp, const uint16_t *cells, int layer, int row, int col, uint16_t id)
+{
+    if(col < 0 || col >= mp->cols) {
+        return 0;
+    }
+
+    return (cells != NULL ? cells[col] : get_tile(mp, layer, row, col)) == id;
+}
+
+/* replace the 4-connected region of equal ids around row, col of layer with id
+ * scanline fill with an explicit stack of spans: every run of the region is
+ * filled with one fill_span and only the spans above and below it that were
+ * not just scanned are pushed, so each cell is read a small constant number
+ * of times and the stack never holds more than a few spans per row */
+int flood_fill(struct Editor *ed, struct Map *mp, int layer, int row, int col, uint16_t id)
+{
+    struct FillSpan *stack = NULL;
+    int size = 0;
+    int capacity = 0;
+    uint16_t target = 0;
+    SDL_Rect bounds = { col, row, 1, 1 };
+
+    if(row < 0 || row >= mp->rows || col < 0 || col >= mp->cols) {
+        return -1;
+    }
+
+    target = get_tile(mp, layer, row, col);
+
+    if(target == id) {
+        return 0;
+    }
+
+#define FILL_PUSH(a, b, c, d) do { \
+        if(size == capacity) { \
+            capacity = capacity == 0 ? 256 : capacity * 2; \
+            stack = realloc(stack, capacity * sizeof(struct FillSpan)); \
+            if(stack == NULL) { \
+                error_msg(); \
+            } \
+        } \
+        stack[size++] = (struct FillSpan){ a, b, c, d }; \
+    } while(0)
+
+    PROF_BEGIN(t);
+    FILL_PUSH(col, col, row, 1);
+    FILL_PUSH(col, col, row - 1, -1);
+
+    while(size > 0) {
+        struct FillSpan s = stack[--size];
+        const uint16_t *cells = NULL;
+        int x1 = s.x1;
+        int x = s.x1;
+
+        if(s.y < 0 || s.y >= mp->rows) {
+            continue;
+        }
+
+        if(mp->layers != NULL) {
+            cells = mp->layers + tile_index(mp, layer, s.y, 0);
+        }
+
+        if(fill_match(mp, cells, layer, s.y, x, target)) {
+            while(fill_match(mp, cells, layer, s.y, x - 1, target)) {
+                x--;
+            }
+            if(x < x1) {
+                FILL_PUSH(x, x1 - 1, s.y - s.dy, -s.dy);
+            }
+        }
+
+        while(x1 <= s.x2) {
+            while(fill_match(mp, cells, layer, s.y, x1, target)) {
+                x1++;
+            }
+
+            /* x..x1-1 is one run of the region */
+            if(x1 > x) {
+                SDL_Rect run = { x, s.y, x1 - x, 1 };
+
+                fill_span(ed, mp, layer, s.y, x, x1 - 1, id);
+                SDL_UnionRect(&bounds, &run, &bounds);
+                FILL_PUSH(x, x1 - 1, s.y + s.dy, s.dy);
+            }
+            if(x1 - 1 > s.x2) {
+                FILL_PUSH(s.x2 + 1, x1 - 1, s.y - s.dy, -s.dy);
+            }
+
+            x1++;
+            while(x1 < s.x2 && !fill_match(mp, cells, layer, s.y, x1, target)) {
+                x1++;
+            }
+            x = x1;
+        }
+    }
+    PROF_END(t, "flood_fill");
+
+#undef FILL_PUSH
+
+    free(stack);
+    invalidate_tiles(ed, layer, bounds);
+
+    return 0;
+}
+
+/* copy the tiles of the selected layer inside the tile rect into the stamp */
+int select_stamp(struct Editor *ed, struct Map *mp, SDL_Rect rect)
+{
+    SDL_Rect all = { 0, 0, mp->cols, mp->rows };
+    uint16_t *tiles = NULL;
+
+    if(!SDL_IntersectRect(&rect, &all, &rect)) {
+        return -1;
+    }
+
+    tiles = malloc((size_t)rect.w * rect.h * sizeof(uint16_t));
+
+    if(tiles == NULL) {
+        error_msg();
+    }
+
+    for(int r = 0; r < rect.h; r++) {
+        for(int c = 0; c < rect.w; c++) {
+            tiles[(size_t)r * rect.w + c] = get_tile(mp, ed->selected_layer, rect.y + r, rect.x + c);
+        }
+    }
+
+    free(ed->stamp.tiles);
+    ed->stamp.w = rect.w;
+    ed->stamp.h = rect.h;
+    ed->stamp.tiles = tiles;
+
+    return 0;
+}
+
+/* paint the stamp on layer with its top left corner at row, col */
+void stamp_at(struct Editor *ed, struct Map *mp, int layer, int row, int col)
+{
+    const struct Stamp *st = &ed->stamp;
+    SDL_Rect rect = { col, row, st->w, st->h };
+    SDL_Rect all = { 0, 0, mp->cols, mp->rows };
+
+    if(st->tiles == NULL || !SDL_IntersectRect(&rect, &all, &rect)) {
+        return;
+    }
+
+    for(int r = rect.y; r < rect.y + rect.h; r++) {
+        const uint16_t *src = st->tiles + (size_t)(r - row) * st->w + (rect.x - col);
+
+        for(int c = rect.x; c < rect.x + rect.w; c++) {
+            uint16_t old = get_tile(mp, layer, r, c);
+
+            if(old != *src) {
+                undo_record(&ed->undo, mp, layer, r, c, old, *src);
+                set_tile(mp, layer, r, c, *src);
+            }
+            src++;
+        }
+    }
+
+    invalidate_tiles(ed, layer, rect);
+}
+
+/* rect spanning two cells, in tiles */
+SDL_Rect tile_rect(int row0, int col0, int row1, int col1)
+{
+    SDL_Rect rect;
+
+    rect.x = col0 < col1 ? col0 : col1;
+    rect.y = row0 < row1 ? row0 : row1;
+    rect.w = abs(col1 - col0) + 1;
+    rect.h = abs(row1 - row0) + 1;
+
+    return rect;
+}
+
+/* left button held at screen position x, y
+ * the brush paints the line from where it was last, mouse motion is only
+ * seen once per frame however fast it moves */
+void tool_drag(struct Editor *ed, struct Map *mp, int x, int y)
+{
+    int row = 0;
+    int col = 0;
+
+    if(screen_to_tile(ed, mp, x, y, &row, &col) != 0) {
+        ed->drag_row = -1;
+        return;
+    }
+
+    if(ed->tool == TOOL_PAINT && ed->drag_row != -1) {
+        paint_line(ed, mp, ed->selected_layer, ed->drag_row, ed->drag_col, row, col, ed->selected_tile);
+    } else if(ed->tool == TOOL_PAINT) {
+        paint_tile(ed, mp, ed->selected_layer, row, col, ed->selected_tile);
+    } else if(ed->tool == TOOL_STAMP && (row != ed->drag_row || col != ed->drag_col)) {
+        stamp_at(ed, mp, ed->selected_layer, row, col);
+    }
+
+    ed->drag_row = row;
+    ed->drag_col = col;
+}
+
+/* left button pressed at screen position x, y, starts one undo step that
+ * lasts until tool_release, whatever the tool changes in between */
+void tool_press(struct Editor *ed, struct Map *mp, int x, int y)
+{
+    int row = 0;
+    int col = 0;
+
+    undo_begin(&ed->undo);
+
+    if(screen_to_tile(ed, mp, x, y, &row, &col) != 0) {
+        ed->anchor_row = -1;
+        return;
+    }
+
+    ed->anchor_row = row;
+    ed->anchor_col = col;
+    ed->drag_row = -1;
+
+    if(ed->tool == TOOL_FILL) {
+        flood_fill(ed, mp, ed->selected_layer, row, col, ed->selected_tile);
+    } else {
+        tool_drag(ed, mp, x, y);
+    }
+}
+
+/* left button released at screen position x, y, ends the undo step */
+void tool_release(struct Editor *ed, struct Map *mp, int x, int y)
+{
+    int row = 0;
+    int col = 0;
+
+    tool_drag(ed, mp, x, y);
+
+    if(ed->tool == TOOL_RECT && ed->anchor_row != -1 &&
+            screen_to_tile(ed, mp, x, y, &row, &col) == 0) {
+        fill_rect(ed, mp, ed->selected_layer, tile_rect(ed->anchor_row, ed->anchor_col, row, col),
+                ed->selected_tile);
+    }
+
+    ed->drag_row = -1;
+    undo_end(&ed->undo);
+}
+
+/* right button pressed at screen position x, y, starts a selection */
+void select_press(struct Editor *ed, struct Map *mp, int x, int y)
+{
+    if(screen_to_tile(ed, mp, x, y, &ed->anchor_row, &ed->anchor_col) != 0) {
+        ed->anchor_row = -1;
+    }
+}
+
+/* right button drag from press to release at x, y selects the stamp */
+void select_release(struct Editor *ed, struct Map *mp, int x, int y)
+{
+    int row = 0;
+    int col = 0;
+
+    if(ed->anchor_row == -1 || screen_to_tile(ed, mp, x, y, &row, &col) != 0) {
+        return;
+    }
+
+    if(select_stamp(ed, mp, tile_rect(ed->anchor_row, ed->anchor_col, row, col)) == 0) {
+        ed->tool = TOOL_STAMP;
+    }
+}
+
+/* undo (redo when redo is set) one step and redraw what it changed */
+int undo_edit(struct Editor *ed, struct Map *mp, int redo)
+{
+    SDL_Rect bounds;
+    uint32_t layers = 0;
+    int ret = redo ? redo_step(&ed->undo, mp, &bounds, &layers) : undo_step(&ed->undo, mp, &bounds, &layers);
+
+    if(ret != 0) {
+        return ret;
+    }
+
+    for(int l = 0; l < mp->layer_count && l < 32; l++) {
+        if(layers & (1u << l)) {
+            invalidate_tiles(ed, l, bounds);
+        }
+    }
+
+    return 0;
+}
+
+#ifdef PROFILE
+/* 3x5 pixel glyphs for the overlay, rows top to bottom */
+const char *overlay_glyph(char c)
+{
+    static const char *digits[10] = {
+        "111101101101111", "010110010010111", "111001111100111", "111001111001111", "101101111001001",
+        "111100111001111", "111100111101111", "111001001001001", "111101111101111", "111101111001111",
+    };
+    static const char *letters[26] = {
+        "010101111101101", "110101110101110", "011100100100011", "110101101101110", "111100110100111",
+        "111100110100100", "011100101101011", "101101111101101", "111010010010111", "001001001101010",
+        "101101110101101", "100100100100111", "101111111101101", "110101101101101", "010101101101010",
+        "110101110100100", "010101101110011", "110101110101101", "011100010001110", "111010010010010",
+        "101101101101111", "101101101101010", "101101111111101", "101101010101101", "101101010010010",
+        "111001010100111",
+    };
+
+    if(c >= '0' && c <= '9') {
+        return digits[c - '0'];
+    }
+    if(c >= 'A' && c <= 'Z') {
+        return letters[c - 'A'];
+    }
+
+    switch(c) {
+        case '.': return "000000000000010";
+        case ':': return "000010000010000";
+        case '/': return "001001010100100";
+        case '-': return "000000111000000";
+        default: return "000000000000000";
+    }
+}
+
+/* draw an upper case string at x, y with pixels of scale size */
+void overlay_text(struct Editor *ed, int x, int y, int scale, const char *str)
+{
+    SDL_Rect px[15 * 64];
+    int n = 0;
+
+    for(int c = 0; str[c] != '\0' && c < 64; c++) {
+        const char *g = overlay_glyph(str[c]);
+
+        for(int i = 0; i < 15; i++) {
+            if(g[i] == '1') {
+                px[n++] = (SDL_Rect){ x + (c * 4 + i % 3) * scale, y + (i / 3) * scale, scale, scale };
+            }
+        }
+    }
+
+    SDL_RenderFillRects(ed->screen.renderer, px, n);
+}
+
+/* resident memory of the process in bytes, read at most once a second */
+long overlay_rss(void)
+{
+    Uint32 now = SDL_GetTicks();
+    FILE *fp = NULL;
+    long pages = 0;
+
+    if(prof.rss != 0 && now - prof.rss_time < 1000) {
+        return prof.rss;
+    }
+
+    fp = fopen("/proc/self/statm", "r");
+
+    if(fp != NULL) {
+        if(fscanf(fp, "%*s %ld", &pages) == 1) {
+            prof.rss = pages * sysconf(_SC_PAGESIZE);
+        }
+        fclose(fp);
+    }
+
+    prof.rss_time = now;
+    return prof.rss;
+}
+
+/* frame time histogram of the last PROF_FRAMES frames, one bar per frame,
+ * 2 pixels per ms with a line at 60 fps, and the counters of the last frame */
+void render_overlay(struct Editor *ed)
+{
+    SDL_Renderer *r = ed->screen.renderer;
+    SDL_Rect bars[PROF_FRAMES];
+    SDL_Rect bg = { 8, 8, PROF_FRAMES * 3 + 16, 140 };
+    char line[64];
+    int base = 8 + 8 + 70;
+    float last = prof.frame_ms[(prof.frame + PROF_FRAMES - 1) % PROF_FRAMES];
+
+    if(!prof.overlay) {
+        return;
+    }
+
+    SDL_SetRenderDrawBlendMode(r, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(r, 0, 0, 0, 0xC0);
+    SDL_RenderFillRect(r, &bg);
+
+    for(int i = 0; i < PROF_FRAMES; i++) {
+        float ms = prof.frame_ms[(prof.frame + i) % PROF_FRAMES];
+        int h = ms * 2 > 70 ? 70 : (int)(ms * 2);
+
+        bars[i] = (SDL_Rect){ 16 + i * 3, base - h, 2, h };
+    }
+
+    SDL_SetRenderDrawColor(r, 0x40, 0xE0, 0x40, 0xFF);
+    SDL_RenderFillRects(r, bars, PROF_FRAMES);
+    SDL_SetRenderDrawColor(r, 0xE0, 0x40, 0x40, 0xFF);
+    SDL_RenderDrawLine(r, 16, base - 33, 16 + PROF_FRAMES * 3, base - 33);
+
+    SDL_SetRenderDrawColor(r, 0xFF, 0xFF, 0xFF, 0xFF);
+    sprintf(line, "FRAME %.2f MS", last);
+    overlay_text(ed, 16, base + 6, 2, line);
+    sprintf(line, "DRAW %d TILES %d", ed->stats.draw_calls, ed->stats.tiles);
+    overlay_text(ed, 16, base + 20, 2, line);
+    sprintf(line, "MEM %.1f MB", overlay_rss() / (1024.0 * 1024.0));
+    overlay_text(ed, 16, base + 34, 2, line);
+
+    SDL_SetRenderDrawBlendMode(r, SDL_BLENDMODE_NONE);
+}
+#endif
+
+/* set current mouse coordinates */
+void get_current_mouse_pos(struct Editor *ed)
+{
+    SDL_GetMouseState(&ed->mouse_pos_x, &ed->mouse_pos_y);    
+}
+
+/* make view a map the size of src that holds at most budget bytes of its
+ * chunks, filled from snapshots of src instead of a file. the render thread
+ * draws it while the edit thread owns src */
+int open_map_view(struct Map *view, const struct Map *src, size_t budget)
+{
+    init_map(view);
+    view->cols = src->cols;
+    view->rows = src->rows;
+    view->layer_count = src->layer_count;
+    view->sprite_width = src->sprite_width;
+    view->sprite_height = src->sprite_height;
+    view->tile_width = src->tile_width;
+    view->tile_height = src->tile_height;
+    set_map_dimensions(view);
+    set_tile_count(view);
+
+    view->name = calloc(strlen(src->name) + 1, sizeof(char));
+
+    if(view->name == NULL) {
+        error_msg();
+    }
+
+    strcpy(view->name, src->name);
+    chunk_store_init(view, -1, NULL, 0, budget, 0);
+
+    return 0;
+}
+
+/* number of entries queued in a ring, tail and head only ever grow */
+static inline Uint32 ring_count(SDL_atomic_t *head, SDL_atomic_t *tail)
+{
+    return (Uint32)SDL_AtomicGet(tail) - (Uint32)SDL_AtomicGet(head);
+}
+
+/* move pending commands into the ring as far as there is room, in order */
+void edit_flush(struct EditThread *et)
+{
+    int n = 0;
+
+    while(n < et->pending_count && ring_count(&et->cmd_head, &et->cmd_tail) < EDIT_QUEUE) {
+        Uint32 tail = SDL_AtomicGet(&et->cmd_tail);
+
+        et->cmds[tail % EDIT_QUEUE] = et->pending[n++];
+        SDL_AtomicSet(&et->cmd_tail, tail + 1);
+    }
+
+    if(n > 0) {
+        et->pending_count -= n;
+        memmove(et->pending, et->pending + n, et->pending_count * sizeof(struct EditCommand));
+        SDL_SemPost(et->wake);
+    }
+}
+
+/* queue cmd for the edit thread, never waits. while the edit thread is
+ * busy the commands pile up in pending and a drag replaces the drag before it */
+void edit_queue(struct EditThread *et, const struct EditCommand *cmd)
+{
+    if(cmd->type == EDIT_DRAG && et->pending_count > 0 && et->pending[et->pending_count - 1].type == EDIT_DRAG) {
+        et->pending[et->pending_count - 1] = *cmd;
+        return;
+    }
+
+    if(et->pending_count == et->pending_capacity) {
+        et->pending_capacity = et->pending_capacity == 0 ? 64 : et->pending_capacity * 2;
+        et->pending = realloc(et->pending, et->pending_capacity * sizeof(struct EditCommand));
+
+        if(et->pending == NULL) {
+            error_msg();
+        }
+    }
+
+    et->pending[et->pending_count++] = *cmd;
+    edit_flush(et);
+}
+
+/* queue a command of type at screen x, y with the camera and tool of ed */
+void edit_command(struct EditThread *et, const struct Editor *ed, int type, int x, int y)
+{
+    struct EditCommand cmd = { type, x, y, ed->camera_x, ed->camera_y, ed->zoom,
+        ed->tool, ed->selected_layer, ed->selected_tile };
+
+    edit_queue(et, &cmd);
+}
+
+/* send the last mouse motion seen since the previous frame
+ * the motions in between are dropped, painting fills the line between */
+void edit_motion(struct EditThread *et, struct Editor *ed)
+{
+    if(!ed->motion) {
+        return;
+    }
+
+    ed->motion = 0;
+    pan_drag(ed, ed->motion_x, ed->motion_y);
+
+    if(ed->motion_state & SDL_BUTTON_LMASK) {
+        edit_command(et, ed, EDIT_DRAG, ed->motion_x, ed->motion_y);
+    }
+}
+
+/* flag every layer of chunk cx, cy to be sent to the render thread */
+void edit_fetch(struct Map *mp, int cx, int cy)
+{
+    if(cx < 0 || cy < 0 || cx >= mp->chunk_cols || cy >= mp->chunk_rows) {
+        return;
+    }
+
+    for(int l = 0; l < mp->layer_count; l++) {
+        mp->dirty[dirty_index(mp, l, cy * CHUNK_SIZE, cx * CHUNK_SIZE)] |= DIRTY_RENDER;
+    }
+}
+
+/* run one command on the edit thread, returns 1 for EDIT_QUIT */
+int edit_apply(struct EditThread *et, const struct EditCommand *cmd)
+{
+    struct Editor *ed = &et->ed;
+
+    ed->camera_x = cmd->camera_x;
+    ed->camera_y = cmd->camera_y;
+    ed->zoom = cmd->zoom;
+    ed->tool = cmd->tool;
+    ed->selected_layer = cmd->layer;
+    ed->selected_tile = cmd->tile;
+
+    switch(cmd->type) {
+        case EDIT_PRESS:
+            tool_press(ed, et->mp, cmd->x, cmd->y);
+            break;
+        case EDIT_DRAG:
+            tool_drag(ed, et->mp, cmd->x, cmd->y);
+            break;
+        case EDIT_RELEASE:
+            tool_release(ed, et->mp, cmd->x, cmd->y);
+            break;
+        case EDIT_SELECT_PRESS:
+            select_press(ed, et->mp, cmd->x, cmd->y);
+            break;
+        case EDIT_SELECT_RELEASE:
+            select_release(ed, et->mp, cmd->x, cmd->y);
+            break;
+        case EDIT_UNDO:
+            undo_edit(ed, et->mp, 0);
+            break;
+        case EDIT_REDO:
+            undo_edit(ed, et->mp, 1);
+            break;
+        case EDIT_SAVE:
+            save_map(et->mp);
+            break;
+        case EDIT_FETCH:
+            edit_fetch(et->mp, cmd->x, cmd->y);
+            break;
+        case EDIT_QUIT:
+            return 1;
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+/* snapshot the chunks on screen that changed since they were last sent or
+ * that the render thread asked for, every layer of a chunk at once. chunks
+ * off screen keep their flags and are sent once they are in view.
+ * returns 1 when the ring filled up and chunks are left for later */
+int edit_publish(struct EditThread *et)
+{
+    struct Map *mp = et->mp;
+    SDL_Rect view = view_tiles(&et->ed, mp);
+    size_t chunk_len = (size_t)mp->layer_count * CHUNK_SIZE * CHUNK_SIZE;
+    int sent = 0;
+    int full = 0;
+
+    for(int cy = view.y / CHUNK_SIZE; !full && view.w > 0 && cy <= (view.y + view.h - 1) / CHUNK_SIZE; cy++) {
+        for(int cx = view.x / CHUNK_SIZE; cx <= (view.x + view.w - 1) / CHUNK_SIZE; cx++) {
+            struct ChunkSnapshot *snap = NULL;
+            uint64_t layers = 0;
+            int changed = 0;
+            int w = mp->cols - cx * CHUNK_SIZE < CHUNK_SIZE ? mp->cols - cx * CHUNK_SIZE : CHUNK_SIZE;
+            int h = mp->rows - cy * CHUNK_SIZE < CHUNK_SIZE ? mp->rows - cy * CHUNK_SIZE : CHUNK_SIZE;
+            Uint32 tail = 0;
+
+            for(int l = 0; l < mp->layer_count; l++) {
+                if(mp->dirty[dirty_index(mp, l, cy * CHUNK_SIZE, cx * CHUNK_SIZE)] & DIRTY_RENDER) {
+                    layers |= l < 64 ? (uint64_t)1 << l : 0;
+                    changed = 1;
+                }
+            }
+
+            if(!changed) {
+                continue;
+            }
+
+            if(ring_count(&et->snap_head, &et->snap_tail) == SNAP_QUEUE) {
+                full = 1;
+                break;
+            }
+
+            snap = malloc(sizeof(struct ChunkSnapshot) + chunk_len * sizeof(uint16_t));
+
+            if(snap == NULL) {
+                error_msg();
+            }
+
+            snap->cx = cx;
+            snap->cy = cy;
+            snap->layers = layers;
+
+            for(int l = 0; l < mp->layer_count; l++) {
+                for(int r = 0; r < h; r++) {
+                    int len = 0;
+                    const uint16_t *src = tile_span(mp, l, cy * CHUNK_SIZE + r, cx * CHUNK_SIZE, &len);
+
+                    memcpy(snap->tiles + ((size_t)l * CHUNK_SIZE + r) * CHUNK_SIZE, src, w * sizeof(uint16_t));
+                }
+                mp->dirty[dirty_index(mp, l, cy * CHUNK_SIZE, cx * CHUNK_SIZE)] &= ~DIRTY_RENDER;
+            }
+
+            tail = SDL_AtomicGet(&et->snap_tail);
+            et->snaps[tail % SNAP_QUEUE] = snap;
+            SDL_AtomicSet(&et->snap_tail, tail + 1);
+            sent++;
+        }
+    }
+
+    /* wake the render thread if it is waiting for events */
+    if(sent > 0) {
+        SDL_Event wake;
+
+        memset(&wake, 0, sizeof(wake));
+        wake.type = SDL_USEREVENT;
+        SDL_PushEvent(&wake);
+    }
+
+    return full;
+}
+
+/* edit thread, applies the queued commands, sends what they changed to
+ * the render thread and runs the autosave. sleeps while there is nothing
+ * to do, a full snapshot ring is retried every ms */
+int edit_worker(void *data)
+{
+    struct EditThread *et = data;
+    int quit = 0;
+
+    while(!quit) {
+        int left = 0;
+
+        while(!quit && ring_count(&et->cmd_head, &et->cmd_tail) > 0) {
+            Uint32 head = SDL_AtomicGet(&et->cmd_head);
+            struct EditCommand cmd = et->cmds[head % EDIT_QUEUE];
+
+            SDL_AtomicSet(&et->cmd_head, head + 1);
+            PROF_BEGIN(t);
+            quit = edit_apply(et, &cmd);
+            PROF_END(t, "edit");
+        }
+
+        autosave_tick(&et->autosave, et->mp);
+        left = edit_publish(et);
+
+        if(!quit) {
+            SDL_SemWaitTimeout(et->wake, left ? 1 : autosave_wait(&et->autosave, SDL_GetTicks()));
+        }
+    }
+
+    return 0;
+}
+
+/* start the edit thread on mp, from here on only it touches mp. it starts
+ * with the screen size and camera of ed, the editor of the render thread */
+int edit_start(struct EditThread *et, struct Map *mp, const struct Editor *ed)
+{
+    memset(et, 0, sizeof(*et));
+    et->mp = mp;
+    et->ed.screen.w = ed->screen.w;
+    et->ed.screen.h = ed->screen.h;
+    et->ed.camera_x = ed->camera_x;
+    et->ed.camera_y = ed->camera_y;
+    et->ed.zoom = ed->zoom;
+    et->ed.tool = TOOL_PAINT;
+    et->ed.anchor_row = -1;
+    et->ed.anchor_col = -1;
+    et->ed.drag_row = -1;
+    et->ed.drag_col = -1;
+    et->camera_x = ed->camera_x;
+    et->camera_y = ed->camera_y;
+    et->zoom = ed->zoom;
+    et->asked = calloc((size_t)mp->chunk_cols * mp->chunk_rows, sizeof(uint8_t));
+    undo_init(&et->ed.undo, UNDO_BUDGET);
+    autosave_init(&et->autosave, mp);
+    et->wake = SDL_CreateSemaphore(0);
+
+    if(et->asked == NULL || et->wake == NULL) {
+        error_msg();
+    }
+
+    et->thread = SDL_CreateThread(edit_worker, "edit", et);
+    return 0;
+}
+
+/* ask the edit thread for the chunks on screen view does not hold and tell
+ * it when the camera moved, it only sends chunks on screen. zoomed out only
+ * the chunks the lod still needs are asked for, at most EDIT_QUEUE at a
+ * time, so a large map comes in over a few frames */
+void edit_view(struct EditThread *et, struct Editor *ed, struct Map *view)
+{
+    SDL_Rect tiles = view_tiles(ed, view);
+    int zoomed_out = view->tile_width * ed->zoom < LOD_TILE_PX;
+    int asked = 0;
+
+    if(ed->camera_x != et->camera_x || ed->camera_y != et->camera_y || ed->zoom != et->zoom) {
+        et->camera_x = ed->camera_x;
+        et->camera_y = ed->camera_y;
+        et->zoom = ed->zoom;
+        edit_command(et, ed, EDIT_VIEW, 0, 0);
+    }
+
+    for(int cy = tiles.y / CHUNK_SIZE; tiles.w > 0 && cy <= (tiles.y + tiles.h - 1) / CHUNK_SIZE; cy++) {
+        for(int cx = tiles.x / CHUNK_SIZE; cx <= (tiles.x + tiles.w - 1) / CHUNK_SIZE; cx++) {
+            int i = cy * view->chunk_cols + cx;
+            struct Chunk *c = chunk_find(view, cx, cy);
+
+            if(et->asked[i]) {
+                asked++;
+                continue;
+            }
+
+            if((c != NULL && c->filled) || (zoomed_out && ed->lod.stale != NULL && !ed->lod.stale[i])) {
+                continue;
+            }
+
+            if(asked == EDIT_QUEUE) {
+                return;
+            }
+
+            et->asked[i] = 1;
+            asked++;
+            edit_command(et, ed, EDIT_FETCH, cx, cy);
+        }
+    }
+}
+
+/* copy the chunks the edit thread sent into view and mark their changed
+ * layers for redraw, every layer of a chunk view did not hold yet. at most
+ * a ring full per frame, a long fill shows up over a few frames.
+ * returns 1 when any were applied */
+int edit_receive(struct EditThread *et, struct Editor *ed, struct Map *view)
+{
+    int changed = 0;
+
+    for(int n = 0; n < SNAP_QUEUE && ring_count(&et->snap_head, &et->snap_tail) > 0; n++) {
+        Uint32 head = SDL_AtomicGet(&et->snap_head);
+        struct ChunkSnapshot *snap = et->snaps[head % SNAP_QUEUE];
+        struct Chunk *c = chunk_get(view, snap->cx, snap->cy);
+        SDL_Rect rect = { snap->cx * CHUNK_SIZE, snap->cy * CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE };
+
+        SDL_AtomicSet(&et->snap_head, head + 1);
+        rect.w = view->cols - rect.x < CHUNK_SIZE ? view->cols - rect.x : CHUNK_SIZE;
+        rect.h = view->rows - rect.y < CHUNK_SIZE ? view->rows - rect.y : CHUNK_SIZE;
+
+        for(int l = 0; l < view->layer_count; l++) {
+            for(int r = 0; r < rect.h; r++) {
+                size_t at = ((size_t)l * CHUNK_SIZE + r) * CHUNK_SIZE;
+
+                memcpy(c->tiles + at, snap->tiles + at, rect.w * sizeof(uint16_t));
+            }
+
+            if(!c->filled || l >= 64 || (snap->layers >> l & 1)) {
+                invalidate_tiles(ed, l, rect);
+            }
+        }
+
+        c->filled = 1;
+        et->asked[snap->cy * view->chunk_cols + snap->cx] = 0;
+        free(snap);
+        changed = 1;
+    }
+
+    return changed;
 }
 
-/* init sdl and set editor settings */
-int init_editor(struct Editor *ed)
+/* let the edit thread finish the commands queued, stop it and its autosave */
+void edit_stop(struct EditThread *et)
 {
-    if(SDL_Init(SDL_INIT_EVERYTHING) != 0) {
-        fprintf(stderr, "%s\n", SDL_GetError());
-        exit(-1);
+    /* built here, et->ed belongs to the edit thread until it has stopped */
+    struct EditCommand quit = { EDIT_QUIT, 0, 0, 0, 0, 1.0f, 0, 0, 0 };
+
+    if(et->thread == NULL) {
+        return;
     }
 
-    ed->screen.w = SCREEN_W;
-    ed->screen.h = SCREEN_H;
-    ed->screen.title = calloc(strlen(WIN_TITLE) + 1, sizeof(char));
-    
-    if(ed->screen.title == NULL) {
+    edit_queue(et, &quit);
+    while(et->pending_count > 0) {
+        SDL_Delay(1);
+        edit_flush(et);
+    }
+
+    SDL_WaitThread(et->thread, NULL);
+    SDL_DestroySemaphore(et->wake);
+
+    while(ring_count(&et->snap_head, &et->snap_tail) > 0) {
+        Uint32 head = SDL_AtomicGet(&et->snap_head);
+
+        free(et->snaps[head % SNAP_QUEUE]);
+        SDL_AtomicSet(&et->snap_head, head + 1);
+    }
+
+    autosave_free(&et->autosave);
+    undo_free(&et->ed.undo);
+    free(et->ed.stamp.tiles);
+    free(et->pending);
+    free(et->asked);
+    memset(et, 0, sizeof(*et));
+}
+
+/* batch mode, maps are processed headless on the worker pool
+ *
+ * ./edit -c <map> ...             text maps to binary, binary maps to text
+ * ./edit -z <map> ...             maps to packed maps <path><name>.lrz
+ * ./edit -v [-d db] <map> ...     check layers and tile ids against sprite.db
+ * ./edit -r [-d db] [-s n] <map>  draw maps to <path><name>.png at 1/n size
+ *
+ * a map is a text map .md, a binary map .lrb or a packed map .lrz */
+enum BATCH_MODE {
+    BATCH_CONVERT = 0,
+    BATCH_PACK,
+    BATCH_VALIDATE,
+    BATCH_RENDER
+};
+
+struct Batch {
+    int mode;
+    char **maps;
+    int count;
+    SDL_atomic_t failed;
+    int scale;
+    const struct SpriteDB *db;
+};
+
+/* load a text map, open a binary map or a packed map, by the extension
+ * of fname. a binary map is streamed in chunks when given a memory budget,
+ * 0 maps it whole */
+int open_map_file(struct Map *mp, const char *fname, size_t budget)
+{
+    const char *base = strrchr(fname, '/');
+    size_t len = strlen(fname);
+    char *name = NULL;
+    int ret = 0;
+
+    if(len < 4 || (strcmp(fname + len - 4, ".lrb") != 0 && strcmp(fname + len - 4, ".lrz") != 0)) {
+        return load_map(mp, fname);
+    }
+
+    base = (base == NULL) ? fname : base + 1;
+    len = strlen(base) - 4;
+    name = calloc(len + 1, sizeof(char));
+
+    if(name == NULL) {
         error_msg();
     }
 
-    strcpy(ed->screen.title, WIN_TITLE);
+    memcpy(name, base, len);
+    if(strcmp(fname + strlen(fname) - 4, ".lrz") == 0) {
+        ret = open_map_packed(mp, fname, name);
+    } else if(budget > 0) {
+        ret = open_map_stream(mp, fname, name, budget);
+    } else {
+        ret = open_map_binary(mp, fname, name);
+    }
+    free(name);
 
-    /* create SDL window */
-    ed->screen.window = SDL_CreateWindow(
-            WIN_TITLE, 
-            SDL_WINDOWPOS_CENTERED,
-            SDL_WINDOWPOS_CENTERED,
-            ed->screen.w,
-            ed->screen.h,
-            0
-        );
+    return ret;
+}
 
-    /* create SDL renderer */
-    ed->screen.renderer = SDL_CreateRenderer(ed->screen.window, -1,
-            SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+/* write a binary or packed map as a text map, <name>.md and
+ * <name>_<i>.lr next to it */
+int convert_map_text(const char *lrb)
+{
+    struct Map mp;
+    const char *base = strrchr(lrb, '/');
+    int ret = 0;
 
-    SDL_SetRenderDrawColor(ed->screen.renderer, 0xFF,0xFF,0xFF,0xFF);
+    init_map(&mp);
 
-    /* init SDL Image */
-    int img_flags = IMG_INIT_PNG;
-    if(!(IMG_Init(img_flags) & img_flags)) {
+    if(open_map_file(&mp, lrb, 0) != 0) {
+        free_map(&mp);
+        return -1;
+    }
+
+    /* the text files go where the binary map is, not to the path it was
+     * converted from */
+    free(mp.path);
+    mp.path = calloc(base == NULL ? 3 : base - lrb + 2, sizeof(char));
+
+    if(mp.path == NULL) {
         error_msg();
     }
 
-    ed->screen.surface = SDL_GetWindowSurface(ed->screen.window);
+    if(base == NULL) {
+        strcpy(mp.path, "./");
+    } else {
+        memcpy(mp.path, lrb, base - lrb + 1);
+    }
 
-    ed->running = SDL_TRUE;
+    mp.md = map_file_name(&mp, ".md");
+    ret = write_metadata(&mp);
+    if(ret == 0) {
+        ret = save_layers(&mp, 1) < 0 ? -1 : 0;
+    }
 
-    return 0;
+    free_map(&mp);
+    return ret;
 }
-/* set editor running to false and quit sdl */
-int quit_editor(struct Editor *ed)
+
+/* write a map as a packed map <path><name>.lrz */
+int pack_map(const char *fname)
 {
-    SDL_DestroyRenderer(ed->screen.renderer);
-    SDL_DestroyWindow(ed->screen.window);
-    SDL_Quit();
-    ed->running = SDL_FALSE;
+    struct Map mp;
+    char *lrz = NULL;
+    int ret = -1;
 
-    return 0;
+    init_map(&mp);
+
+    if(open_map_file(&mp, fname, 0) == 0) {
+        lrz = map_file_name(&mp, ".lrz");
+        ret = save_map_packed(&mp, lrz) < 0 ? -1 : 0;
+        free(lrz);
+    }
+
+    free_map(&mp);
+    return ret;
 }
 
-/* init struct map */
-int init_map(struct Map *map)
+/* events no one can walk onto, either on a solid tile or closed in by
+ * solid tiles on all four sides. returns how many, the first few are printed */
+long validate_events(const char *fname, struct Map *mp)
 {
-    map->cols = 0;
-    map->rows = 0;
-    map->sprite_width = 0;
-    map->sprite_height = 0;
-    map->layer_count = 0;
-    map->path = NULL;
-    map->layer0 = NULL;
-    map->name = NULL;
-    map->md = NULL;
-    map->layers = NULL;
-    map->tiles = NULL;
-    return 0;
+    static const int step[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+    const struct SparseLayer *sl = map_sparse(mp, EVENT_LAYER);
+    long bad = 0;
+
+    if(sl == NULL || map_collision(mp) == NULL) {
+        return 0;
+    }
+
+    for(int i = 0; i < sl->count; i++) {
+        int row = sl->keys[i] / mp->cols;
+        int col = sl->keys[i] % mp->cols;
+        double x = (col + 0.5) * mp->tile_width;
+        double y = (row + 0.5) * mp->tile_height;
+        const char *why = NULL;
+        SDL_Point hit;
+        int open = 0;
+
+        if(collision_box(mp, (SDL_Rect){ col * mp->tile_width, row * mp->tile_height, mp->tile_width, mp->tile_height })) {
+            why = "on a solid tile";
+        } else {
+            /* a segment from the center of the event to the center of a
+             * neighbour hits it when the neighbour is solid */
+            for(int d = 0; d < 4; d++) {
+                open += !collision_segment(mp, x, y, x + step[d][0] * mp->tile_width,
+                        y + step[d][1] * mp->tile_height, &hit);
+            }
+            why = open == 0 ? "closed in by solid tiles" : NULL;
+        }
+
+        if(why != NULL && bad++ < 10) {
+            fprintf(stderr, "%s: event %d at row %d col %d is %s\n", fname, sl->ids[i], row, col, why);
+        }
+    }
+
+    return bad;
 }
 
-/* the layout for tiles in mp struct is exactly the same as layers, but with struct tile instead of int */
-int alloc_tiles(struct Map *mp) 
+/* check every tile id of a map against the sprite database and that every
+ * event can be walked onto, the layer dimensions are checked as the map is
+ * loaded. a layer file with rows past the last row counts as one bad tile.
+ * returns the number of bad tiles and events, the first few are printed,
+ * or -1 when the map can not be read */
+long validate_map(const char *fname, const struct SpriteDB *db)
 {
-    verbose_print("allocating tiles... ");
-    mp->tiles = calloc(mp->layer_count, sizeof(struct Tile *));
+    struct Map mp;
+    long bad = 0;
 
-    if(mp->tiles == NULL) {
-        error_msg();
+    init_map(&mp);
+
+    if(open_map_file(&mp, fname, 0) != 0) {
+        free_map(&mp);
+        return -1;
     }
-    for(int i = 0; i < mp->layer_count; i++) {
-        mp->tiles[i] = calloc(mp->rows, sizeof(struct Tile *));
 
+    for(int l = 0; l < mp.layer_count; l++) {
+        for(int row = 0; row < mp.rows; row++) {
+            const uint16_t *cell = &layer_data(&mp, l)[(size_t)row * mp.cols];
+
+            for(int col = 0; col < mp.cols; col++) {
+                if(cell[col] == 0 || (cell[col] < db->count && db->sprites[cell[col]].rect.w > 0)) {
+                    continue;
+                }
+
+                if(bad++ < 10) {
+                    fprintf(stderr, "%s: layer %d row %d col %d: tile %d not in sprite.db\n",
+                            fname, l, row, col, cell[col]);
+                }
+            }
+        }
+    }
+
+    bad += mp.trailing;
+    bad += validate_events(fname, &mp);
+    free_map(&mp);
+    return bad;
+}
+
+/* draw every layer of a map into pixels, tiles scaled to 1/scale by
+ * sampling the atlas, animated tiles at their first frame */
+int draw_map(const struct Map *mp, const struct SpriteDB *db, int scale, Uint32 *pixels)
+{
+    int tw = mp->tile_width / scale;
+    int th = mp->tile_height / scale;
+    int w = mp->cols * tw;
+
+    for(int l = 0; l < mp->layer_count; l++) {
         for(int row = 0; row < mp->rows; row++) {
-            mp->tiles[i][row] = calloc(mp->cols, sizeof(struct Tile ));
-            if(mp->tiles[i][row] == NULL) {
-                error_msg();
+            const uint16_t *cell = &layer_data(mp, l)[(size_t)row * mp->cols];
+
+            for(int col = 0; col < mp->cols; col++) {
+                const struct Sprite *sp = NULL;
+                const struct Atlas *a = NULL;
+
+                if(cell[col] == 0 || cell[col] >= db->count || db->sprites[cell[col]].rect.w == 0) {
+                    continue;
+                }
+
+                sp = &db->sprites[cell[col]];
+                a = &db->atlases[sp->atlas];
+
+                for(int y = 0; y < th; y++) {
+                    const Uint32 *src = &a->pixels[(sp->rect.y + y * sp->rect.h / th) * a->width + sp->rect.x];
+                    Uint32 *dst = &pixels[(size_t)(row * th + y) * w + col * tw];
+
+                    for(int x = 0; x < tw; x++) {
+                        lod_blend((Uint8 *)&dst[x], (const Uint8 *)&src[x * sp->rect.w / tw]);
+                    }
+                }
             }
         }
     }
 
-    verbose_print("OK\n");
     return 0;
 }
 
-/* allocate memory for layers in map and set to 0 */
-int alloc_layers(struct Map *mp) 
+/* draw a map to <path><name>.png at 1/scale size */
+int render_map_png(const char *fname, const struct SpriteDB *db, int scale)
 {
-    verbose_print("allocating layers... ");
-    mp->layers = calloc(mp->layer_count, sizeof(int*));
-    
+    struct Map mp;
+    SDL_Surface *surface = NULL;
+    Uint32 *pixels = NULL;
+    char *png = NULL;
+    int w = 0;
+    int h = 0;
+    int ret = -1;
 
-    if(mp->layers == NULL) {
+    init_map(&mp);
+
+    if(open_map_file(&mp, fname, 0) != 0) {
+        goto out;
+    }
+
+    if(mp.tile_width / scale < 1 || mp.tile_height / scale < 1) {
+        fprintf(stderr, "%s: scale 1/%d is below one pixel per tile\n", fname, scale);
+        goto out;
+    }
+
+    w = mp.cols * (mp.tile_width / scale);
+    h = mp.rows * (mp.tile_height / scale);
+
+    if((size_t)w * h > RENDER_MAX_PIXELS) {
+        fprintf(stderr, "%s: %dx%d pixels is too large, use -s\n", fname, w, h);
+        goto out;
+    }
+
+    pixels = calloc((size_t)w * h, sizeof(Uint32));
+
+    if(pixels == NULL) {
         error_msg();
     }
 
-    for(int i = 0; i < mp->layer_count; i++) {
+    draw_map(&mp, db, scale, pixels);
 
-        mp->layers[i] = calloc(mp->rows,sizeof(int *));
-        for(int row = 0; row < mp->rows; row++) {
-            mp->layers[i][row] = calloc(mp->cols, sizeof(int ));
-            if(mp->layers[i][row] == NULL) {
-                fprintf(stderr,"%s\n", strerror(errno));
-                exit(errno);
+    png = map_file_name(&mp, ".png");
+    surface = SDL_CreateRGBSurfaceWithFormatFrom(pixels, w, h, 32, w * sizeof(Uint32), SDL_PIXELFORMAT_RGBA32);
+
+    if(surface == NULL || IMG_SavePNG(surface, png) != 0) {
+        fprintf(stderr, "%s: %s\n", png, SDL_GetError());
+    } else {
+        ret = 0;
+    }
+
+out:
+    SDL_FreeSurface(surface);
+    free(pixels);
+    free(png);
+    free_map(&mp);
+    return ret;
+}
+
+/* process map i of the batch, one line of output per map */
+void batch_job(void *ctx, int i)
+{
+    struct Batch *b = ctx;
+    const char *fname = b->maps[i];
+    size_t len = strlen(fname);
+    Uint64 start = SDL_GetPerformanceCounter();
+    long ret = 0;
+
+    switch(b->mode) {
+        case BATCH_CONVERT:
+            if(len > 3 && strcmp(fname + len - 3, ".md") == 0) {
+                ret = convert_map_binary(fname);
+            } else {
+                ret = convert_map_text(fname);
             }
+            break;
+        case BATCH_PACK:
+            ret = pack_map(fname);
+            break;
+        case BATCH_VALIDATE:
+            ret = validate_map(fname, b->db);
+            break;
+        case BATCH_RENDER:
+            ret = render_map_png(fname, b->db, b->scale);
+            break;
+        default:
+            break;
+    }
+
+    if(ret == 0) {
+        printf("%s: ok, %.1f ms\n", fname, elapsed_sec(start) * 1000.0);
+    } else if(ret > 0) {
+        printf("%s: %ld bad tiles\n", fname, ret);
+    } else {
+        printf("%s: failed\n", fname);
+    }
+
+    if(ret != 0) {
+        SDL_AtomicAdd(&b->failed, 1);
+    }
+}
+
+/* the batch mode named by arg, or -1 when arg is not one */
+int batch_mode(const char *arg)
+{
+    const char *modes[] = { "-c", "-z", "-v", "-r" };
+
+    for(int m = BATCH_CONVERT; m <= BATCH_RENDER; m++) {
+        if(strcmp(arg, modes[m]) == 0) {
+            return m;
         }
     }
 
-    verbose_print("OK\n");
-    return 0;
+    return -1;
 }
-/* calculate map width and height */
-/* width = tile_width * columns */
-int set_map_dimensions(struct Map *mp)
+
+/* open the map the editor was started with, edit [-m] [<map>]
+ * -m streams a binary map in chunks instead of mapping it whole. without a
+ * map the test map is opened, it is created the first time */
+int open_editor_map(struct Map *mp, int argc, char **argv)
 {
-    mp->map_width = (mp->tile_width * mp->cols);
-    mp->map_height = (mp->tile_height * mp->rows);
+    int stream = argc > 1 && strcmp(argv[1], "-m") == 0;
+    const char *fname = argc > 1 + stream ? argv[1 + stream] : DEFAULT_MAP;
 
-    return 0;
+    if(argc > 2 + stream || (stream && argc == 2) || (argc > 1 && !stream && argv[1][0] == '-')) {
+        fprintf(stderr, "usage: %s [-m] [<map>]\n", argv[0]);
+        return -1;
+    }
+
+    if(argc > 1 + stream || access(fname, F_OK) == 0) {
+        return open_map_file(mp, fname, stream ? CHUNK_BUDGET : 0);
+    }
+
+    create_map(mp, 16, 16, 3, 16, 16, DEFAULT_MAP_NAME);
+    print_metadata(mp);
+
+    if(save_metadata(mp) != 0) {
+        return -1;
+    }
+
+    return create_layers(mp);
 }
 
-/* calculate total nr of tiles in map */
-void set_tile_count(struct Map *mp)
+/* run a batch from the command line, no window is opened
+ * returns the exit status, 1 when any map failed */
+int batch_main(int argc, char **argv)
 {
-    mp->tile_count = (mp->layer_count * mp->rows * mp->cols);
+    struct Batch b;
+    struct Editor ed;
+    struct SpriteDB db;
+    const char *db_file = SPRITE_DB;
+    Uint64 start = SDL_GetPerformanceCounter();
+    int i = 2;
+
+    memset(&b, 0, sizeof(b));
+    memset(&ed, 0, sizeof(ed));
+    memset(&db, 0, sizeof(db));
+    b.scale = 1;
+
+    b.mode = batch_mode(argv[1]);
+
+    if(b.mode == -1) {
+        i = argc;
+    }
+
+    for(; i < argc && argv[i][0] == '-'; i++) {
+        if(strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            db_file = argv[++i];
+        } else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            b.scale = atoi(argv[++i]);
+        } else {
+            break;
+        }
+    }
+
+    if(i >= argc) {
+        fprintf(stderr, "usage: %s -c <map> ...\n"
+                "       %s -z <map> ...\n"
+                "       %s -v [-d sprite.db] <map> ...\n"
+                "       %s -r [-d sprite.db] [-s n] <map> ...\n", argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    b.maps = &argv[i];
+    b.count = argc - i;
+    verbose = 0;
+
+    if(b.mode == BATCH_VALIDATE || b.mode == BATCH_RENDER) {
+        if(IMG_Init(IMG_INIT_PNG) == 0) {
+            error_msg();
+        }
+        load_sprite_database(db_file, &ed, &db);
+        b.db = &db;
+    }
+
+    pool_run(b.count, batch_job, &b);
+    printf("%d maps, %d failed, %.1f ms\n", b.count, SDL_AtomicGet(&b.failed), elapsed_sec(start) * 1000.0);
+
+    free_sprite_database(&db);
+    pool_free();
+
+    return SDL_AtomicGet(&b.failed) > 0 ? 1 : 0;
 }
 
-/* init layers, set width and position of all tiles in map */
-int init_tiles(struct Map *mp)
+#ifdef BENCH
+/* headless benchmark, built with make bench
+ * runs the map and sprite core for every map size given on the command line
+ * (default 256 1024 2048, square maps) and prints one csv line per
+ * measurement. maps are written to a temporary directory that is removed
+ * afterwards. rendering uses a software renderer into an offscreen surface
+ *
+ * ./edit_bench [-l layers] [-f frames] [size ...] */
+
+/* results are summed into this so passes are not optimized away */
+volatile long bench_sink;
+
+/* print one result line, bytes may be 0 when MB/s does not apply */
+void bench_report(const char *name, struct Map *mp, double sec, long tiles, double bytes)
 {
-    int tx = 0;
-    int ty = 0;
+    printf("%s,%d,%d,%d,%ld,%.6f,%.3f,%.1f\n", name, mp->cols, mp->rows, mp->layer_count,
+            tiles, sec, sec * 1e9 / tiles, bytes / sec / (1024.0 * 1024.0));
+    fflush(stdout);
+}
 
-    /* for each layer set x and y position of all tiles */
-    for(int l = 0; l < mp->layer_count; l++) {
-        tx = 0;
-        ty = 0;
-        for(int i = 0; i < (mp->cols * mp->rows); i++) {
-            int row = (ty / mp->tile_height);
-            int col = (tx / mp->tile_width); 
-            printf("[%d][%d][%d]\n", l, row, col);
-            if(tx > (mp->map_width - mp->tile_width)) {
-                tx = 0;
-                ty += mp->tile_height;;
+/* total size of the text layer files of map */
+double bench_layer_bytes(struct Map *mp)
+{
+    char suffix[32];
+    double bytes = 0;
+
+    for(int i = 0; i < mp->layer_count; i++) {
+        sprintf(suffix, map_sparse(mp, i) != NULL ? "_%d.lrs" : "_%d.lr", i);
+        char *fname = map_file_name(mp, suffix);
+        bytes += file_stamp(fname).size;
+        remove(fname);
+        free(fname);
+    }
+
+    return bytes;
+}
+
+int bench_map(struct Editor *ed, struct SpriteDB *db, int size, int layers, int frames)
+{
+    struct Map mp;
+    struct Map ld;
+    char name[32];
+    char *fname = NULL;
+    char *md = NULL;
+    long tiles = (long)size * size * layers;
+    long sum = 0;
+    int len = 0;
+    Uint64 start = 0;
+
+    init_map(&mp);
+    init_map(&ld);
+    sprintf(name, "bench_%d", size);
+
+    /* create */
+    start = SDL_GetPerformanceCounter();
+    create_map(&mp, size, size, layers, 16, 16, name);
+    alloc_layers(&mp);
+    for(long i = 0; i < tiles; i++) {
+        mp.layers[i] = 1 + (uint16_t)((i * 2654435761u) >> 7) % (db->count - 1);
+    }
+    bench_report("create", &mp, elapsed_sec(start), tiles, tiles * sizeof(uint16_t));
+
+    /* full pass over every layer */
+    start = SDL_GetPerformanceCounter();
+    for(int l = 0; l < layers; l++) {
+        for(int row = 0; row < size; row++) {
+            for(int col = 0; col < size; col += len) {
+                const uint16_t *cell = tile_span(&mp, l, row, col, &len);
+
+                for(int n = 0; n < len; n++) {
+                    sum += cell[n];
+                }
+            }
+        }
+    }
+    bench_report("pass", &mp, elapsed_sec(start), tiles, tiles * sizeof(uint16_t));
+
+    /* collision bitset, built once then counted with popcount and queried
+     * with boxes the size of a tile and segments up to 8 tiles each way */
+    if(layers > COLLISION_LAYER) {
+        uint16_t *solid = layer_data(&mp, COLLISION_LAYER);
+        long cells = (long)size * size;
+        int queries = 1 << 18;
+        SDL_Point hit;
+
+        /* walls on one tile in 16, a full layer would stop every query at once */
+        for(long i = 0; i < cells; i++) {
+            solid[i] = ((i * 2654435761u) >> 11) % 16 == 0;
+        }
+
+        start = SDL_GetPerformanceCounter();
+        map_collision(&mp);
+        bench_report("collision_build", &mp, elapsed_sec(start), cells, cells * sizeof(uint16_t));
+
+        start = SDL_GetPerformanceCounter();
+        sum += collision_count(mp.collision, (SDL_Rect){ 0, 0, size, size });
+        bench_report("collision_count", &mp, elapsed_sec(start), cells, cells / 8.0);
+
+        start = SDL_GetPerformanceCounter();
+        for(int i = 0; i < queries; i++) {
+            uint32_t h = (uint32_t)i * 2654435761u;
+
+            sum += collision_box(&mp, (SDL_Rect){ h % mp.map_width, (h >> 7) % mp.map_height, 16, 16 });
+        }
+        bench_report("collision_box", &mp, elapsed_sec(start), queries, 0);
+
+        start = SDL_GetPerformanceCounter();
+        for(int i = 0; i < queries; i++) {
+            uint32_t h = (uint32_t)i * 2654435761u;
+            double x = h % mp.map_width;
+            double y = (h >> 7) % mp.map_height;
+            double dx = (double)(h >> 3 & 0xff) - 128;
+            double dy = (double)(h >> 13 & 0xff) - 128;
+
+            sum += collision_segment(&mp, x, y, x + dx, y + dy, &hit);
+        }
+        bench_report("collision_segment", &mp, elapsed_sec(start), queries, 0);
+    }
+
+    /* text save and load */
+    save_metadata(&mp);
+    start = SDL_GetPerformanceCounter();
+    save_layers(&mp, 1);
+    double sec = elapsed_sec(start);
+
+    md = calloc(strlen(mp.md) + 1, sizeof(char));
+    if(md == NULL) {
+        error_msg();
+    }
+    strcpy(md, mp.md);
+
+    start = SDL_GetPerformanceCounter();
+    if(load_map(&ld, md) != 0) {
+        return -1;
+    }
+    double load_sec = elapsed_sec(start);
+    double bytes = bench_layer_bytes(&mp);
+
+    bench_report("save_text", &mp, sec, tiles, bytes);
+    bench_report("load_text", &mp, load_sec, tiles, bytes);
+    free_map(&ld);
+
+    /* binary save and open, the open touches every page */
+    fname = map_file_name(&mp, ".lrb");
+    start = SDL_GetPerformanceCounter();
+    save_map_binary(&mp, fname);
+    bench_report("save_binary", &mp, elapsed_sec(start), tiles, tiles * sizeof(uint16_t));
+
+    init_map(&ld);
+    start = SDL_GetPerformanceCounter();
+    open_map_binary(&ld, fname, name);
+    for(long i = 0; i < tiles; i += 2048) {
+        sum += ld.layers[i];
+    }
+    bench_report("open_binary", &mp, elapsed_sec(start), tiles, tiles * sizeof(uint16_t));
+    free_map(&ld);
+
+    /* streamed full pass, chunk by chunk */
+    init_map(&ld);
+    start = SDL_GetPerformanceCounter();
+    open_map_stream(&ld, fname, name, CHUNK_BUDGET);
+    for(int cy = 0; cy < size; cy += CHUNK_SIZE) {
+        for(int cx = 0; cx < size; cx += CHUNK_SIZE) {
+            for(int l = 0; l < layers; l++) {
+                for(int row = cy; row < cy + CHUNK_SIZE && row < size; row++) {
+                    const uint16_t *cell = tile_span(&ld, l, row, cx, &len);
+
+                    for(int n = 0; n < len; n++) {
+                        sum += cell[n];
+                    }
+                }
             }
-            /* TODO: segfault */
-            mp->tiles[0][0][0].rect->x = tx;
-            mp->tiles[0][0][0].rect->y = ty;
-            mp->tiles[0][0][0].rect->w = mp->tile_width;
-            mp->tiles[0][0][0].rect->h = mp->tile_height;
-            tx += mp->tile_width;
         }
     }
+    bench_report("stream_pass", &mp, elapsed_sec(start), tiles, tiles * sizeof(uint16_t));
+    free_map(&ld);
+    remove(fname);
+    free(fname);
+
+    /* packed save and open, bytes are the size of the packed file */
+    fname = map_file_name(&mp, ".lrz");
+    start = SDL_GetPerformanceCounter();
+    bytes = save_map_packed(&mp, fname);
+    bench_report("save_packed", &mp, elapsed_sec(start), tiles, bytes);
+
+    init_map(&ld);
+    start = SDL_GetPerformanceCounter();
+    open_map_packed(&ld, fname, name);
+    bench_report("open_packed", &mp, elapsed_sec(start), tiles, bytes);
+    free_map(&ld);
+    remove(fname);
+    free(fname);
+
+    /* render full redraws of the screen */
+    long drawn = 0;
+    start = SDL_GetPerformanceCounter();
+    for(int f = 0; f < frames; f++) {
+        ed->camera_x = (f * 37) % (mp.map_width > ed->screen.w ? mp.map_width - ed->screen.w : 1);
+        ed->camera_y = (f * 23) % (mp.map_height > ed->screen.h ? mp.map_height - ed->screen.h : 1);
+        invalidate_tiles(ed, -1, (SDL_Rect){ 0, 0, mp.cols, mp.rows });
+        SDL_RenderClear(ed->screen.renderer);
+        render_layers(ed, &mp, db);
+        drawn += ed->stats.tiles;
+    }
+    if(drawn > 0) {
+        bench_report("render", &mp, elapsed_sec(start), drawn, 0);
+    }
+
+    /* every level of the lod from scratch, then the whole map zoomed out */
+    lod_free(&ed->lod);
+    lod_init(&ed->lod, &mp);
+    start = SDL_GetPerformanceCounter();
+    while(ed->lod.stale_count > 0) {
+        lod_update(&ed->lod, &mp, db);
+    }
+    bench_report("lod_build", &mp, elapsed_sec(start), tiles, 0);
+
+    fit_camera(ed, &mp);
+    start = SDL_GetPerformanceCounter();
+    for(int f = 0; f < frames; f++) {
+        SDL_RenderClear(ed->screen.renderer);
+        render_layers(ed, &mp, db);
+    }
+    bench_report("render_fit", &mp, elapsed_sec(start), tiles * frames, 0);
+    ed->zoom = 1.0f;
+
+    remove(md);
+    rmdir(mp.path);
+    free(md);
+    free_map(&mp);
+    bench_sink = sum;
 
     return 0;
 }
 
-/* TODO: read.md is supposed to be in map folder in asset 
- * ex asset/map/map_01/map_01.md 
- * this file should contain all map metadata, such as tile width, height
- * map width and height, name, layers 
- * so one should be able to send an empty map struct and path to map to load_asset function
- * and the map struct will be populated  and loaded*/
-int load_map(struct Map *mp, const char *path)
+/* slice every sheet of the sprite database, decode included */
+int bench_sprites(struct SpriteDB *db, int rounds)
 {
-    FILE *fp = NULL;
-    char c = '\0';
-    char *tmp_width;
-    char *tmp_height;
-    char *tmp_line = NULL;
-    int length = 0;
-    int x_pos = 0;
-    int n = 0;
-
-    fp = fopen(path, "r");
-
-    if(fp == NULL) {
-        error_msg();
+    struct Map none;
+    long sprites = 0;
+    double bytes = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    init_map(&none);
+
+    for(int r = 0; r < rounds; r++) {
+        for(int i = 0; i < db->sheet_count; i++) {
+            struct Spritesheet sp;
+
+            memset(&sp, 0, sizeof(sp));
+            load_single_spritesheet(&sp, db->sheets[i].path, db->sheets[i].sprite_width,
+                    db->sheets[i].sprite_height, db->sheets[i].count);
+            sprites += sp.count;
+            bytes += file_stamp(sp.path).size;
+            SDL_FreeSurface(sp.surface);
+            free(sp.path);
+            free(sp.rect);
+        }
     }
 
-    tmp_width = calloc(4, sizeof(char));
-    tmp_height = calloc(4, sizeof(char));
+    bench_report("spritesheet", &none, elapsed_sec(start), sprites, bytes);
+    return 0;
+}
 
-    while((c = fgetc(fp)) != '\n') {
-        if(c == 'x') {
-            
-            x_pos = length;
-            printf("%d\n", x_pos);
+int main(int argc, char **argv)
+{
+    struct Editor ed;
+    struct SpriteDB db;
+    SDL_Surface *target = NULL;
+    char dir[] = "/tmp/l2te_bench_XXXXXX";
+    char cwd[4096];
+    int layers = 7;
+    int frames = 20;
+    int sizes[32] = { 256, 1024, 2048 };
+    int size_count = 3;
+    int user_sizes = 0;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            layers = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if(user_sizes < 32 && atoi(argv[i]) > 0) {
+            sizes[user_sizes++] = atoi(argv[i]);
+            size_count = user_sizes;
+        } else {
+            fprintf(stderr, "usage: %s [-l layers] [-f frames] [size ...]\n", argv[0]);
+            return 1;
         }
-
-        length++;
     }
 
-    tmp_line = calloc(length, sizeof(char));
-
-    rewind(fp);
+    verbose = 0;
+    memset(&ed, 0, sizeof(ed));
+    ed.zoom = 1.0f;
+    ed.cache_zoom = 1.0f;
 
-    while((c = fgetc(fp)) != '\n') {
-        tmp_line[n] = c;
-        n++;
+    if(IMG_Init(IMG_INIT_PNG) == 0) {
+        error_msg();
     }
 
-    fclose(fp);
-
-    for(int i = 0; i < x_pos; i++) {
-        tmp_width[i] = tmp_line[i];
-    }
+    ed.screen.w = 1920;
+    ed.screen.h = 1080;
+    target = SDL_CreateRGBSurfaceWithFormat(0, ed.screen.w, ed.screen.h, 32, SDL_PIXELFORMAT_RGBA32);
+    ed.screen.renderer = SDL_CreateSoftwareRenderer(target);
 
-    for(int i = x_pos+1, j = 0; i < length; i++, j++) {
-        tmp_height[j] = tmp_line[i];
+    if(target == NULL || ed.screen.renderer == NULL) {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        return 1;
     }
-        
-    free(tmp_line);
-    free(tmp_height);
-    free(tmp_width);
-    return 0;
-}
 
-/* create metadata for map struct */
-/* NOTE: tile width and height defaults to same as sprite */
-int create_map(struct Map *mp, int w, int h, int layers, int sw, int sh, const char *name)
-{
-    verbose_print("creating map... \n");
+    load_sprite_database(SPRITE_DB, &ed, &db);
 
-    mp->cols = w;
-    mp->rows = h;
-    mp->layer_count = layers;
-    mp->sprite_width = sw;
-    mp->sprite_height = sh;
-    mp->tile_height = sh;
-    mp->tile_width = sw;
+    printf("bench,cols,rows,layers,tiles,seconds,ns_per_tile,mb_per_s\n");
+    bench_sprites(&db, 10);
 
-    verbose_print("\tsetting map dimensions...\n");
-    set_map_dimensions(mp);
-    if(verbose == 1) {
-        printf("\tmap.w = %d map.h = %d\n", mp->map_height, mp->map_width);
-        printf("\tOK\n");
+    /* maps go to asset/ below a temporary directory */
+    if(getcwd(cwd, sizeof(cwd)) == NULL || mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        error_msg();
     }
+    mkdir(_ASSET_PATH, 0700);
 
-    verbose_print("\tsetting total number of tiles...\n");
-    set_tile_count(mp);
-    if(verbose == 1) {
-        printf("\tmap.tile_count = %d\n", mp->tile_count);
-        printf("\tOK\n");
+    for(int i = 0; i < size_count; i++) {
+        if(bench_map(&ed, &db, sizes[i], layers, frames) < 0) {
+            return 1;
+        }
     }
 
-
-   
-    mp->name = calloc(strlen(name)+1, sizeof(char));
-
-    if(mp->name == NULL) {
-        fprintf(stderr, "%s\n", strerror(errno));
-        exit(errno);
+    rmdir(_ASSET_PATH);
+    if(chdir(cwd) != 0 || rmdir(dir) != 0) {
+        error_msg();
     }
 
-    strcpy(mp->name, name);
+    free_sprite_database(&db);
+    quit_editor(&ed);
+    SDL_FreeSurface(target);
+    pool_free();
 
     return 0;
 }
-int free_map(struct Map *mp)
+#elif defined(TEST)
+/* self tests, built with make test
+ * checks the encodings, the save log and every way a map is saved and
+ * opened against a copy of the tiles kept on the side, and undo and redo
+ * against a copy of the map taken after every step. maps are written to a
+ * temporary directory that is removed afterwards. prints one line per
+ * test and returns the number of tests that failed
+ *
+ * ./edit_test */
+
+int test_failed;
+
+/* report a test, bad is the number of mismatches found */
+void test_report(const char *name, int bad)
 {
-    free(mp->path);
-    free(mp->name);
-    free(mp->md);
+    printf("%-24s %s", name, bad == 0 ? "ok\n" : "FAILED");
+    if(bad != 0) {
+        printf(" (%d)\n", bad);
+        test_failed++;
+    }
+    fflush(stdout);
+}
+
+/* tiles of mp that differ from model, layers of rows * cols ids */
+int test_diff(const struct Map *mp, const uint16_t *model)
+{
+    int bad = 0;
 
-    for(int i = 0 ; i < mp->layer_count; i++) {
+    for(int l = 0; l < mp->layer_count; l++) {
         for(int row = 0; row < mp->rows; row++) {
-            free(mp->layers[i][row]);
+            for(int col = 0; col < mp->cols; col++) {
+                bad += get_tile(mp, l, row, col) != model[((size_t)l * mp->rows + row) * mp->cols + col];
+            }
         }
+    }
 
-        free(mp->layers[i]);
-    }   
+    return bad;
+}
 
-    free(mp->layers);
-    return 0;
+/* set count random tiles of mp and model, in runs so the encodings see both */
+void test_edit(struct Map *mp, uint16_t *model, int count)
+{
+    for(int i = 0; i < count; i++) {
+        int l = rand() % mp->layer_count;
+        int row = rand() % mp->rows;
+        int col = rand() % mp->cols;
+        int len = 1 + rand() % 40;
+        uint16_t id = rand() % 64;
+
+        for(int c = col; c < col + len && c < mp->cols; c++) {
+            set_tile(mp, l, row, c, id);
+            model[((size_t)l * mp->rows + row) * mp->cols + c] = id;
+        }
+    }
 }
-/* append string and comma unless cflag is not 1 */
-int append_metadata(char **str, int data, int cflag)
+
+/* a map of w x h tiles and the model of it, random runs of ids */
+uint16_t *test_map(struct Map *mp, const char *name, int w, int h, int layers)
 {
-    char tmp[128];
+    size_t count = (size_t)layers * w * h;
+    uint16_t *model = malloc(count * sizeof(uint16_t));
 
-    sprintf(tmp, "%d", data);
+    if(model == NULL) {
+        error_msg();
+    }
 
-    strcat(*str, tmp);
+    init_map(mp);
+    create_map(mp, w, h, layers, 16, 16, name);
+    alloc_layers(mp);
 
-    if(cflag == 1) {
-        strcat(*str, ",");
+    for(size_t i = 0; i < count; i++) {
+        model[i] = i > 0 && rand() % 8 != 0 ? model[i - 1] : rand() % 64;
+        mp->layers[i] = model[i];
     }
 
-    return 0;
+    return model;
 }
 
-/* create empty layers for map */
-int create_layers(struct Map *mp)
+/* encode and decode blocks of every shape up to a chunk, cut short
+ * encodings must be rejected */
+void test_rle(void)
 {
-    /* create n layers with default tiles in asset folder */
-    
-    FILE *fp = NULL;
-    char *fname = NULL;
+    uint16_t cells[CHUNK_SIZE * CHUNK_SIZE * 2];
+    uint16_t out[CHUNK_SIZE * CHUNK_SIZE * 2];
+    uint8_t *buf = malloc(sizeof(cells) * 6);
+    int bad = 0;
 
-    alloc_layers(mp);
-    alloc_tiles(mp);
+    if(buf == NULL) {
+        error_msg();
+    }
 
-    for(int i = 0; i < mp->layer_count; i++) {
-        /* create file name for layer file */
-        /* /path/name_<layer>.lr */
-        /* +2 for integer suffix and null terminator */
-        fname = calloc(strlen(mp->path) + strlen(mp->name) + strlen("_.lr") + 2, sizeof(char));
+    for(int round = 0; round < 2000; round++) {
+        int w = 1 + rand() % CHUNK_SIZE;
+        int h = 1 + rand() % CHUNK_SIZE;
+        int stride = w + rand() % (CHUNK_SIZE + 1);
+        size_t len = 0;
 
-        if(fname == NULL) {
-            fprintf(stderr, "%s\n", strerror(errno));
-            exit(errno);
+        for(int i = 0; i < stride * h; i++) {
+            cells[i] = i > 0 && rand() % 4 != 0 ? cells[i - 1] : (round % 3 == 0 ? rand() : rand() % 8);
         }
-        char tmp[3]; /* tmp buffer for i to char conversion */
 
-        sprintf(tmp, "%d", i);
+        memset(out, 0, sizeof(out));
+        len = rle_encode(cells, w, h, stride, buf);
 
-        strcpy(fname,mp->path);
-        strcat(fname,mp->name);
-        strcat(fname,"_");
-        strcat(fname,tmp);
-        strcat(fname, ".lr");
-
-        printf("%s\n", fname);
-        fp = fopen(fname, "a+");
-
-        /* set each array entry to 0 */
-        /* append to fname */
-            for(int row = 0; row < mp->rows; row++) {
-                for(int col = 0; col < mp->cols; col++) {
-                    mp->layers[i][row][col] = 0;
-
-                    fprintf(fp,"%d,",mp->layers[i][row][col]);
-                }
+        if(rle_decode(buf, buf + len, out, w, h, stride) != buf + len) {
+            bad++;
+            continue;
+        }
 
-                fprintf(fp,"%c",'\n');
-            }
+        for(int r = 0; r < h; r++) {
+            bad += memcmp(cells + r * stride, out + r * stride, w * sizeof(uint16_t)) != 0;
+        }
 
-        fclose(fp);
-        free(fname);
+        bad += rle_decode(buf, buf + len - 1, out, w, h, stride) != NULL;
     }
 
-    return 0;
+    free(buf);
+    test_report("rle", bad);
 }
 
-/* save metadata file to map folder in asset */
-int save_metadata(struct Map *mp)
+/* write a save log of one entry, len bytes of data at off */
+int test_log(const char *log, uint64_t off, const void *data, uint64_t len)
 {
-    FILE *fp = NULL;
-    char *md_line;
-
-    md_line = calloc(255, sizeof(char));
-    mp->path = calloc((strlen(_ASSET_PATH) + strlen(mp->name) + 2), sizeof(char));
+    struct SaveLogHeader hdr;
+    struct SaveLogEntry e = { off, len };
+    uint8_t *buf = malloc(READ_BUF_SIZE);
+    size_t used = sizeof(hdr);
+    int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    if(mp->path == NULL) {
-        fprintf(stderr, "%s\n", strerror(errno));
+    if(buf == NULL || fd == -1) {
+        error_msg();
     }
 
+    save_log_init(&hdr, buf);
+    save_log_append(fd, buf, &used, &hdr, &e, sizeof(e));
+    save_log_append(fd, buf, &used, &hdr, data, len);
+    hdr.count++;
+    hdr.bytes += len;
 
-    strcpy(mp->path, _ASSET_PATH);
-    strcat(mp->path, mp->name);
-    strcat(mp->path, "/");
-
-    mp->md = calloc((strlen(mp->path) + strlen(".md") + strlen(mp->name) + 1), sizeof(char));
-
-    if(mp->md == NULL) {
-        fprintf(stderr, "%s\n", strerror(errno));
+    if(save_log_finish(fd, buf, used, &hdr) != 0) {
+        error_msg();
     }
 
-    strcpy(mp->md, mp->path);
-    strcat(mp->md, mp->name);
-    strcat(mp->md, ".md");
+    free(buf);
+    return 0;
+}
 
+/* a whole log is written over the map, a truncated log and a log whose
+ * bytes do not match its hash are dropped and leave the map as it was.
+ * the log is removed either way */
+void test_save_log(void)
+{
+    const char *fname = "asset/test_log.bin";
+    const char *log = "asset/test_log.bin.log";
+    uint8_t map[256];
+    uint8_t want[256];
+    uint8_t got[256];
+    uint8_t edit[16];
+    struct stat st;
+    int fd = -1;
+    int bad = 0;
+
+    for(size_t i = 0; i < sizeof(map); i++) {
+        map[i] = i;
+    }
+    memset(edit, 0xee, sizeof(edit));
 
-    mkdir(mp->path, 0700);
+    for(int kind = 0; kind < 3; kind++) {
+        fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1 || write(fd, map, sizeof(map)) != sizeof(map)) {
+            error_msg();
+        }
+        close(fd);
 
-    /* create metadata line to write to file */
-    append_metadata(&md_line, mp->cols, 1);
-    append_metadata(&md_line, mp->rows, 1);
-    append_metadata(&md_line, mp->layer_count, 1);
-    append_metadata(&md_line, mp->sprite_width, 1);
-    append_metadata(&md_line, mp->sprite_height, 1);
-    strcat(md_line, mp->path);
+        test_log(log, 100, edit, sizeof(edit));
+        if(stat(log, &st) != 0) {
+            error_msg();
+        }
 
-    /* write md_line to asset folder */
-    fp = fopen(mp->md, "w");
+        /* cut the last byte off, or change the last logged byte */
+        if(kind == 1 && truncate(log, st.st_size - 1) != 0) {
+            error_msg();
+        }
+        if(kind == 2) {
+            fd = open(log, O_WRONLY);
+            if(fd == -1 || pwrite(fd, "x", 1, st.st_size - 1) != 1) {
+                error_msg();
+            }
+            close(fd);
+        }
 
-    fprintf(fp, "%s", md_line);
-    fclose(fp);
+        bad += save_log_replay(log, fname) != 0;
+        bad += access(log, F_OK) == 0;
 
-    free(md_line);
+        fd = open(fname, O_RDONLY);
+        if(fd == -1 || read(fd, got, sizeof(got)) != sizeof(got)) {
+            error_msg();
+        }
+        close(fd);
 
-    return 0;
-}
+        memcpy(want, map, sizeof(map));
+        if(kind == 0) {
+            memcpy(want + 100, edit, sizeof(edit));
+        }
+        bad += memcmp(want, got, sizeof(got)) != 0;
+    }
 
-void print_metadata(struct Map *mp)
-{
-    printf("width: %d\n", mp->cols);
-    printf("height: %d\n", mp->rows);
-    printf("layers: %d\n", mp->layer_count);
-    printf("sprite_width: %d\n", mp->sprite_width);
-    printf("sprite_height: %d\n", mp->sprite_height);
-    printf("name: %s\n", mp->name);
+    remove(fname);
+    test_report("save_log", bad);
 }
 
-/* render complete spritesheet to screen */
-int render_spritesheet(struct Spritesheet *sp, struct Editor *ed) 
+/* save and open a map every way it can be stored, edit what was opened,
+ * save it again and check what is opened next matches the model */
+void test_maps(void)
 {
-    int tx = 0;
-    int ty = 0;
+    struct Map mp;
+    struct Map ld;
+    uint16_t *model = test_map(&mp, "test_maps", 200, 150, 3);
+    char *md = NULL;
+    char *fname = NULL;
+    char *packed = NULL;
+    int bad = 0;
 
-    for(int i = 0; i < 25; i++) {
-        if(tx > (sp->width - sp->sprite_width)) {
-            tx = 0;
-            ty += sp->sprite_height;
+    /* each way starts from what the one before saved. text layer files, only the edited ones are written again */
+    save_metadata(&mp);
+    save_layers(&mp, 1);
+    md = calloc(strlen(mp.md) + 1, sizeof(char));
+    if(md == NULL) {
+        error_msg();
+    }
+    strcpy(md, mp.md);
+
+    for(int round = 0; round < 2; round++) {
+        init_map(&ld);
+        bad += load_map(&ld, md) != 0 || test_diff(&ld, model) != 0;
+        test_edit(&ld, model, 200);
+        bad += save_map(&ld) != 0;
+        free_map(&ld);
+    }
+    init_map(&ld);
+    bad += load_map(&ld, md) != 0 || test_diff(&ld, model) != 0;
+    free_map(&ld);
+    test_report("text", bad);
+
+    /* packed map */
+    bad = 0;
+    packed = map_file_name(&mp, ".lrz");
+    init_map(&ld);
+    bad += load_map(&ld, md) != 0 || save_map_packed(&ld, packed) < 0;
+    free_map(&ld);
+
+    for(int round = 0; round < 3; round++) {
+        init_map(&ld);
+        bad += open_map_packed(&ld, packed, "test_maps") != 0 || test_diff(&ld, model) != 0;
+        if(round < 2) {
+            test_edit(&ld, model, 200);
+            bad += save_map(&ld) != 0;
         }
-        render(tx, ty, &sp->rect[i], ed, sp);
-        tx += sp->sprite_width;
+        free_map(&ld);
     }
-
-    return 0;
+    test_report("packed", bad);
+
+    /* binary map, written in place through the save log */
+    bad = 0;
+    fname = map_file_name(&mp, ".lrb");
+    init_map(&ld);
+    bad += open_map_packed(&ld, packed, "test_maps") != 0 || save_map_binary(&ld, fname) != 0;
+    free_map(&ld);
+    remove(packed);
+    free(packed);
+
+    for(int round = 0; round < 3; round++) {
+        init_map(&ld);
+        bad += open_map_binary(&ld, fname, "test_maps") != 0 || test_diff(&ld, model) != 0;
+        if(round < 2) {
+            test_edit(&ld, model, 200);
+            bad += save_map(&ld) != 0;
+        }
+        free_map(&ld);
+    }
+    test_report("binary", bad);
+
+    /* streamed map, a budget of a few chunks so edited chunks are evicted
+     * before they are saved, saved twice while open */
+    bad = 0;
+    init_map(&ld);
+    bad += open_map_stream(&ld, fname, "test_maps", 4 * 3 * CHUNK_SIZE * CHUNK_SIZE * sizeof(uint16_t)) != 0;
+    for(int round = 0; round < 2; round++) {
+        test_edit(&ld, model, 400);
+        bad += save_map(&ld) != 0 || test_diff(&ld, model) != 0;
+    }
+    free_map(&ld);
+
+    init_map(&ld);
+    bad += open_map_binary(&ld, fname, "test_maps") != 0 || test_diff(&ld, model) != 0;
+    free_map(&ld);
+    remove(fname);
+    free(fname);
+
+    /* the work file only lives while the map is open */
+    fname = map_file_name(&mp, ".lrb.work");
+    bad += access(fname, F_OK) == 0;
+    free(fname);
+    test_report("stream", bad);
+
+    for(int i = 0; i < mp.layer_count; i++) {
+        char suffix[32];
+
+        sprintf(suffix, map_sparse(&mp, i) != NULL ? "_%d.lrs" : "_%d.lr", i);
+        fname = map_file_name(&mp, suffix);
+        remove(fname);
+        free(fname);
+    }
+    remove(md);
+    rmdir(mp.path);
+    free(md);
+    free(model);
+    free_map(&mp);
 }
 
-void free_sprite_database(struct Sprite **sprites, int count)
+/* copy every tile of mp to model */
+void test_copy(const struct Map *mp, uint16_t *model)
 {
-    for(int i = 0; i < count; i++) {
-    SDL_DestroyTexture(sprites[i]->spritesheet.texture);
-        free(sprites[i]);
+    for(int l = 0; l < mp->layer_count; l++) {
+        for(int row = 0; row < mp->rows; row++) {
+            for(int col = 0; col < mp->cols; col++) {
+                model[((size_t)l * mp->rows + row) * mp->cols + col] = get_tile(mp, l, row, col);
+            }
+        }
     }
-
-    free(sprites);
 }
 
-int render_layers(struct Editor *ed, struct Map *mp, struct Sprite **db)
+/* random strokes, rects and flood fills mixed with undo and redo, after
+ * every one the map must match the copy taken after the step it is at.
+ * every step changes its first cell, so every step is kept */
+int test_undo(struct Map *mp)
 {
-   for(int i = 0; i < mp->layer_count; i++) {
-        for(int row = 0; row < mp->rows; row++) {
-            for(int col = 0; col < mp->cols; col++) {
+    struct Editor ed;
+    size_t count = (size_t)mp->layer_count * mp->rows * mp->cols;
+    int steps = 300;
+    uint16_t *states = malloc((steps + 1) * count * sizeof(uint16_t));
+    int top = 0;
+    int at = 0;
+    int bad = 0;
+
+    if(states == NULL) {
+        error_msg();
+    }
+
+    memset(&ed, 0, sizeof(ed));
+    undo_init(&ed.undo, UNDO_BUDGET);
+    test_copy(mp, states);
+
+    for(int i = 0; i < steps * 2; i++) {
+        int op = rand() % 6;
+        int l = rand() % mp->layer_count;
+        int row = rand() % mp->rows;
+        int col = rand() % mp->cols;
+        uint16_t id = (get_tile(mp, l, row, col) + 1 + rand() % 4) % 8;
+
+        if(op == 0) {
+            undo_edit(&ed, mp, 0);
+            at -= at > 0;
+        } else if(op == 1) {
+            undo_edit(&ed, mp, 1);
+            at += at < top;
+        } else if(top < steps) {
+            undo_begin(&ed.undo);
+            if(op == 2) {
+                flood_fill(&ed, mp, l, row, col, id);
+            } else if(op == 3) {
+                fill_rect(&ed, mp, l, (SDL_Rect){ col, row, 1 + rand() % 20, 1 + rand() % 20 }, id);
+            } else {
+                paint_line(&ed, mp, l, row, col, rand() % mp->rows, rand() % mp->cols, id);
             }
+            undo_end(&ed.undo);
+            top = ++at;
+            test_copy(mp, states + at * count);
         }
+
+        bad += test_diff(mp, states + at * count) != 0;
     }
 
+    undo_free(&ed.undo);
+    free(states);
 
-    return 0;
+    return bad;
 }
 
-/* set current mouse coordinates */
-void get_current_mouse_pos(struct Editor *ed)
+/* undo and redo on a map held whole and on the same map streamed */
+void test_undo_maps(void)
 {
-    SDL_GetMouseState(&ed->mouse_pos_x, &ed->mouse_pos_y);    
+    const char *fname = "asset/test_undo.lrb";
+    struct Map mp;
+    struct Map st;
+    uint16_t *model = test_map(&mp, "test_undo", 70, 50, 2);
+
+    mp.path = calloc(strlen(_ASSET_PATH) + 1, sizeof(char));
+    if(mp.path == NULL) {
+        error_msg();
+    }
+    strcpy(mp.path, _ASSET_PATH);
+
+    test_report("undo", test_undo(&mp));
+
+    save_map_binary(&mp, fname);
+    init_map(&st);
+    if(open_map_stream(&st, fname, "test_undo", 2 * 2 * CHUNK_SIZE * CHUNK_SIZE * sizeof(uint16_t)) != 0) {
+        error_msg();
+    }
+    test_report("undo_stream", test_undo(&st));
+
+    free_map(&st);
+    free_map(&mp);
+    remove(fname);
+    free(model);
 }
 
 int main(void)
+{
+    char dir[] = "/tmp/l2te_test_XXXXXX";
+    char cwd[4096];
+
+    verbose = 0;
+    srand(1);
+
+    /* maps go to asset/ below a temporary directory */
+    if(getcwd(cwd, sizeof(cwd)) == NULL || mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        error_msg();
+    }
+    mkdir(_ASSET_PATH, 0700);
+
+    test_rle();
+    test_save_log();
+    test_maps();
+    test_undo_maps();
+
+    rmdir(_ASSET_PATH);
+    if(chdir(cwd) != 0 || rmdir(dir) != 0) {
+        error_msg();
+    }
+    pool_free();
+
+    printf("%d failed\n", test_failed);
+    return test_failed;
+}
+#else
+int main(int argc, char **argv)
 {
     struct Map mp;
     struct Editor ed;
     SDL_Event event;
 
+    /* edit -c, -z, -v or -r runs a batch over the maps given and exits */
+    if(argc > 1 && batch_mode(argv[1]) != -1) {
+        return batch_main(argc, argv);
+    }
+
     init_map(&mp);
+    verbose = 1;
+
+    if(open_editor_map(&mp, argc, argv) != 0) {
+        free_map(&mp);
+        return 1;
+    }
+
     init_editor(&ed);
-    
-    //load_map(&mp);
 
-    verbose = 1;
+    struct SpriteDB sprite_db;
+    load_sprite_database(SPRITE_DB, &ed, &sprite_db);
 
-    /* TODO: add stat for dir test before creation */
-    create_map(&mp, 16, 16, 3, 16,16, "test");
-    print_metadata(&mp);
-    save_metadata(&mp);
-    create_layers(&mp);
+    struct SpriteWatch sprite_watch;
+    sprite_watch_init(&sprite_watch, SPRITE_DB, &sprite_db);
+
+    /* edits run on the edit thread, this thread handles input and draws
+     * view, which holds the chunks on screen as the edit thread sends them */
+    struct Map view;
+    open_map_view(&view, &mp, CHUNK_BUDGET);
+
+    struct EditThread edit;
+    edit_start(&edit, &mp, &ed);
+
+    /* a frame is only drawn when something changed, in between the loop
+     * sleeps until an event comes or a timed job is due */
+    int redraw = 1;
 
-    verbose_print("\tinitializing tile position and dimensions...\n");
-    init_tiles(&mp);
-     if(verbose == 1) {
-        printf("\tOK\n");
-    }
-    free_map(&mp);
-    struct Sprite **sprite_db = load_sprite_database(SPRITE_DB, &ed);
     while(ed.running == SDL_TRUE) {
-        if(SDL_GetMouseState(NULL,NULL) & SDL_BUTTON(SDL_BUTTON_LEFT)) {
-            get_current_mouse_pos(&ed);
-            printf("%d:%d\n", ed.mouse_pos_x, ed.mouse_pos_y);       
+        if(!redraw) {
+            SDL_WaitEventTimeout(NULL, anim_wait(&sprite_db, SDL_GetTicks()));
         }
 
+        int camera_x = ed.camera_x;
+        int camera_y = ed.camera_y;
+        float zoom = ed.zoom;
+
+        PROF_BEGIN(frame);
+        PROF_BEGIN(events);
         while(SDL_PollEvent(&event)) {
+            redraw |= event_redraws(&event, &ed);
+
+            /* a pending motion goes first, a click lands where it was made */
+            if(event.type == SDL_MOUSEBUTTONDOWN || event.type == SDL_MOUSEBUTTONUP) {
+                edit_motion(&edit, &ed);
+            }
+
             switch(event.type) {
                 case SDL_QUIT:
                     ed.running = SDL_FALSE;
                     break;
+                /* a stroke lasts while the left button is held */
+                /* the right button selects the stamp */
+                case SDL_MOUSEBUTTONDOWN:
+                    if(event.button.button == SDL_BUTTON_LEFT) {
+                        edit_command(&edit, &ed, EDIT_PRESS, event.button.x, event.button.y);
+                    } else if(event.button.button == SDL_BUTTON_RIGHT) {
+                        select_press(&ed, &view, event.button.x, event.button.y);
+                        edit_command(&edit, &ed, EDIT_SELECT_PRESS, event.button.x, event.button.y);
+                    } else if(event.button.button == SDL_BUTTON_MIDDLE) {
+                        pan_press(&ed, event.button.x, event.button.y);
+                    }
+                    break;
+                case SDL_MOUSEBUTTONUP:
+                    if(event.button.button == SDL_BUTTON_LEFT) {
+                        edit_command(&edit, &ed, EDIT_RELEASE, event.button.x, event.button.y);
+                    } else if(event.button.button == SDL_BUTTON_RIGHT) {
+                        /* the stamp is selected on both threads, this one
+                         * switches to the stamp tool, the edit thread paints it */
+                        edit_command(&edit, &ed, EDIT_SELECT_RELEASE, event.button.x, event.button.y);
+                        select_release(&ed, &view, event.button.x, event.button.y);
+                    } else if(event.button.button == SDL_BUTTON_MIDDLE) {
+                        ed.panning = 0;
+                    }
+                    break;
+                /* motion is merged into one per frame, see edit_motion,
+                 * the left button paints, the middle button drags the map */
+                case SDL_MOUSEMOTION:
+                    ed.motion = 1;
+                    ed.motion_x = event.motion.x;
+                    ed.motion_y = event.motion.y;
+                    ed.motion_state = event.motion.state;
+                    break;
+                /* wheel selects the tile to paint, ctrl+wheel zooms at the mouse */
+                case SDL_MOUSEWHEEL:
+                    if(SDL_GetModState() & KMOD_CTRL) {
+                        get_current_mouse_pos(&ed);
+                        zoom_camera(&ed, &view, ed.mouse_pos_x, ed.mouse_pos_y,
+                                event.wheel.y > 0 ? ZOOM_STEP : 1.0f / ZOOM_STEP);
+                        break;
+                    }
+                    ed.selected_tile += event.wheel.y > 0 ? 1 : -1;
+                    ed.selected_tile = ed.selected_tile < 1 ? 1 : ed.selected_tile;
+                    ed.selected_tile = ed.selected_tile >= sprite_db.count ? sprite_db.count - 1 : ed.selected_tile;
+                    break;
+                /* pan camera with the arrow keys, home shows the whole map,
+                 * m toggles the minimap */
+                /* 1-9 select the layer, ctrl+z undo, ctrl+y redo, ctrl+s save */
+                case SDL_KEYDOWN:
+                    if(event.key.keysym.sym >= SDLK_1 && event.key.keysym.sym <= SDLK_9 &&
+                            event.key.keysym.sym - SDLK_1 < view.layer_count) {
+                        ed.selected_layer = event.key.keysym.sym - SDLK_1;
+                    }
+                    if(event.key.keysym.mod & KMOD_CTRL) {
+                        if(event.key.keysym.sym == SDLK_z) {
+                            edit_command(&edit, &ed, EDIT_UNDO, 0, 0);
+                        } else if(event.key.keysym.sym == SDLK_y) {
+                            edit_command(&edit, &ed, EDIT_REDO, 0, 0);
+                        } else if(event.key.keysym.sym == SDLK_s) {
+                            edit_command(&edit, &ed, EDIT_SAVE, 0, 0);
+                        }
+                    }
+                    /* b brush, r rectangle, f flood fill, s stamp */
+                    if(!(event.key.keysym.mod & KMOD_CTRL)) {
+                        switch(event.key.keysym.sym) {
+                            case SDLK_b:
+                                ed.tool = TOOL_PAINT;
+                                break;
+                            case SDLK_r:
+                                ed.tool = TOOL_RECT;
+                                break;
+                            case SDLK_f:
+                                ed.tool = TOOL_FILL;
+                                break;
+                            case SDLK_s:
+                                ed.tool = ed.stamp.tiles != NULL ? TOOL_STAMP : ed.tool;
+                                break;
+                            default:
+                                break;
+                        }
+                    }
+                    switch(event.key.keysym.sym) {
+                        case SDLK_LEFT:
+                            ed.camera_x -= (int)(PAN_PX / ed.zoom);
+                            break;
+                        case SDLK_RIGHT:
+                            ed.camera_x += (int)(PAN_PX / ed.zoom);
+                            break;
+                        case SDLK_UP:
+                            ed.camera_y -= (int)(PAN_PX / ed.zoom);
+                            break;
+                        case SDLK_DOWN:
+                            ed.camera_y += (int)(PAN_PX / ed.zoom);
+                            break;
+                        case SDLK_HOME:
+                            fit_camera(&ed, &view);
+                            break;
+                        case SDLK_m:
+                            ed.minimap = !ed.minimap;
+                            break;
+#ifdef PROFILE
+                        /* F1 toggles the overlay, F2 dumps a chrome trace */
+                        case SDLK_F1:
+                            prof.overlay = !prof.overlay;
+                            break;
+                        case SDLK_F2:
+                            prof_dump(PROF_TRACE);
+                            break;
+#endif
+                        default:
+                            break;
+                    }
+                    break;
                 default:
                     break;
             }
         }
+        edit_motion(&edit, &ed);
+        edit_view(&edit, &ed, &view);
+        edit_flush(&edit);
+        PROF_END(events, "events");
+
+        redraw |= ed.camera_x != camera_x || ed.camera_y != camera_y || ed.zoom != zoom;
+
+        /* the chunks asked for and edited since the last frame */
+        redraw |= edit_receive(&edit, &ed, &view);
+        redraw |= anim_tick(&sprite_db, SDL_GetTicks());
+
+        /* a reloaded sheet can be anywhere on the map */
+        if(sprite_watch_tick(&sprite_watch, &sprite_db)) {
+            for(int l = 0; l < view.layer_count; l++) {
+                invalidate_tiles(&ed, l, (SDL_Rect){ 0, 0, view.cols, view.rows });
+            }
+            redraw = 1;
+        }
 
+        if(!redraw) {
+            continue;
+        }
+
+        PROF_BEGIN(render);
         SDL_RenderClear(ed.screen.renderer);
-        render_sprite(0, 0, sprite_db[49], &ed); 
+        render_layers(&ed, &view, &sprite_db);
+        render_minimap(&ed, &view);
+#ifdef PROFILE
+        render_overlay(&ed);
+#endif
+        PROF_END(render, "render");
         SDL_RenderPresent(ed.screen.renderer);
+        report_render_stats(&ed, &view);
+#ifdef PROFILE
+        prof_frame(frame, SDL_GetPerformanceCounter());
+#endif
+
+        /* the zoomed out map is rebuilt a slice per frame while it is
+         * drawn and has work left, the profiling overlay shows every frame */
+        redraw = ed.lod.busy;
+#ifdef PROFILE
+        redraw |= prof.overlay;
+#endif
     }
 
-    free_sprite_database(sprite_db, ed.sprite_count); 
+    edit_stop(&edit);
+    sprite_watch_free(&sprite_watch);
+    free_map(&view);
+    free_map(&mp);
+    free_sprite_database(&sprite_db);
+    pool_free();
     quit_editor(&ed);
 
     return 0;
 }
-
+#endif